@@ -0,0 +1,367 @@
+#!/bin/bash
+# Benchmark and validation driver for the programs of all parts.
+# Builds every variant, runs strong- and weak-scaling sweeps over ranks x threads with mpirun, checks
+# every run against its reference and writes machine-readable results:
+#   runs.csv     one line per run
+#   summary.csv  one line per configuration: repeat statistics and the speedup (strong) or the
+#                efficiency (weak) against the configuration with the fewest cores
+#
+#   bench/bench.sh [-s quick|full] [-r "1 2 4"] [-t "1 2"] [-n repeats] [-o dir] [-b baseline.csv] [-T percent] [-k]
+#     -s  sizes: quick (300x300 plates, the default) or full (1000x1000 plates and the 10K reference)
+#     -r  rank counts of the MPI and hybrid programs (default "1 2 4")
+#     -t  threads per rank of the OpenMP and hybrid programs (default "1 2")
+#     -n  runs of every configuration (default 3)
+#     -o  results directory (default bench/results)
+#     -b  summary.csv of an earlier run: a configuration whose median is more than -T percent
+#         (default 10) slower is a regression
+#     -k  keep the binaries, skip the build
+# MPIRUN (default mpirun) launches the MPI programs, e.g. MPIRUN="mpirun --oversubscribe".
+# The exit status is 1 if a run fails its check or regresses, 0 otherwise.
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BENCH=$ROOT/bench
+BUILD=$BENCH/build
+PART1=$ROOT/part1-MPIOverview
+TRAFFIC=$ROOT/part2-MessagePassingProgramming/traffic_flow
+PART5=$ROOT/part5-AnnualChallenge
+COMMON=$ROOT/common
+
+SUITE=quick
+RANKS="1 2 4"
+THREADS="1 2"
+REPEATS=3
+OUT=$BENCH/results
+BASELINE=
+TOLERANCE=10
+BUILDING=1
+MPIRUN=${MPIRUN:-mpirun}
+CC=${CC:-gcc}
+MPICC=${MPICC:-mpicc}
+
+while getopts "s:r:t:n:o:b:T:kh" option; do
+    case $option in
+    s) SUITE=$OPTARG ;;
+    r) RANKS=$OPTARG ;;
+    t) THREADS=$OPTARG ;;
+    n) REPEATS=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    b) BASELINE=$OPTARG ;;
+    T) TOLERANCE=$OPTARG ;;
+    k) BUILDING=0 ;;
+    *) sed -n '2,21p' "$0" | sed 's/^# \{0,1\}//'; exit 2 ;;
+    esac
+done
+
+# problem sizes and the references they converge to
+case $SUITE in
+quick)
+    PLATE=300; JACOBI_ITERATIONS=2893; SOR_ITERATIONS=398
+    PI_TERMS=20000000
+    WEAK_ROWS=300; WEAK_ITERATIONS=1000
+    BATCH_PLATES=16
+    ;;
+full)
+    PLATE=1000; JACOBI_ITERATIONS=3372; SOR_ITERATIONS=1249
+    PI_TERMS=100000000
+    WEAK_ROWS=250; WEAK_ITERATIONS=500
+    BATCH_PLATES=8
+    ;;
+*)
+    echo "unknown suite $SUITE, quick or full"; exit 2 ;;
+esac
+ROAD=100000        # the traffic reference is the velocity series of the default road
+PLATE_10K=10000    # full suite: converges at iteration 3578
+ITERATIONS_10K=3578
+MIXED_DIFFERENCE=1e-5 # laplace_mixed against its double precision solve: the float correction
+ACTIVE_DIFFERENCE=1e-3 # laplace_active against full Jacobi: the tiles it leaves quiet
+CONVERGED=0.01     # MAX_TEMP_ERROR of the plates, for the solvers whose iteration count varies
+CUBE=100           # laplace3d volume, converges at iteration 1976
+CUBE_ITERATIONS=1976
+
+# the environment of the runs: defaults of every program, no tracing, no tuning cache
+unset TRACE TRACE_FILE TRACE_COUNTERS TRACE_ROOFLINE HALO HALO_BENCHMARK TUNE OMP_SCHEDULE
+export TUNE_CACHE=$OUT/none.cache
+
+mkdir -p "$OUT/logs"
+FAILED=0
+
+# --- build -----------------------------------------------------------------------------------------
+
+# the Makefiles where the repo has them, the compile commands of the sources where it has not;
+# the pure MPI traffic model is the Makefile's build without -fopenmp
+build()
+{
+    mkdir -p "$BUILD"
+    make -C "$PART5" all || return 1
+    $CC -O3 -march=native -o "$BUILD/pi_serial" "$PART1/pi_openmp.c" "$COMMON/trace.c" -lm || return 1
+    $CC -O3 -march=native -fopenmp -o "$BUILD/pi_openmp" "$PART1/pi_openmp.c" "$COMMON/trace.c" -lm || return 1
+    $MPICC -O3 -march=native -o "$BUILD/pi_mpi" "$PART1/pi_mpi.c" "$COMMON/trace.c" -lm || return 1
+    # the flags of the traffic Makefile, trace.c with its PROBEFLAGS
+    local sources="$TRAFFIC/traffic.c $TRAFFIC/trafficlib.c $TRAFFIC/uni.c $COMMON/halo.c $COMMON/tune.c"
+    $MPICC -fopenmp -O3 -march=native -c -o "$BUILD/trace_hybrid.o" "$COMMON/trace.c" || return 1
+    $MPICC -fopenmp -o "$BUILD/traffic_hybrid" $sources "$BUILD/trace_hybrid.o" -lm || return 1
+    $MPICC -O3 -march=native -c -o "$BUILD/trace_mpi.o" "$COMMON/trace.c" || return 1
+    $MPICC -o "$BUILD/traffic_mpi" $sources "$BUILD/trace_mpi.o" -lm || return 1
+}
+
+if [ $BUILDING = 1 ]; then
+    echo "Building"
+    if ! build > "$OUT/logs/build.log" 2>&1; then
+        echo "Build failed, see $OUT/logs/build.log"
+        exit 1
+    fi
+fi
+
+# --- checks: the output of a run in $1, the expected value in $2; print what was found -------------
+
+# converged (or stopped) at the expected iteration
+check_iterations()
+{
+    local found
+    found=$(sed -n 's/.*Max error at iteration \([0-9]*\) was.*/\1/p' "$1" | tail -1)
+    echo "iteration ${found:-none}"
+    [ "$found" = "$2" ]
+}
+
+# the last max error within the limit, for the solvers whose iterations depend on the ranks (CG),
+# that count cycles (multigrid) or sweep asynchronously
+check_converged()
+{
+    local error
+    error=$(sed -n -e 's/.*Max error at [a-z]* [0-9]* was \([0-9.]*\).*/\1/p' \
+        -e 's/.*Max error of the final synchronous sweep was \([0-9.]*\).*/\1/p' "$1" | tail -1)
+    echo "error ${error:-none}"
+    awk -v e="${error:-1}" -v limit="$2" 'BEGIN { exit !(e <= limit) }'
+}
+
+# the plate table of laplace_batch: every plate converged within the limit, and the last one, the
+# plate of laplace_serial, at the expected iteration; $2 is iteration:limit
+check_batch()
+{
+    local iteration=${2%%:*} limit=${2#*:} found
+    found=$(awk -v limit="$limit" '
+        /^ *[0-9]+ +[0-9]+ +[0-9.]+ +[0-9.-]+$/ { plates++; last = $2; if ($3 > limit) open++ }
+        END { if (plates) printf "%d plates, %d unconverged, last at %d", plates, open, last }' "$1")
+    echo "${found:-no plates}"
+    [ -n "$found" ] && [ "${found#*, }" = "0 unconverged, last at $iteration" ]
+}
+
+# the validation report: the program and its reference solve both at the expected iteration, and the
+# max |difference| of their fields within the limit; $2 is iteration:limit
+check_deviation()
+{
+    local iteration=${2%%:*} limit=${2#*:} found difference
+    found=$(sed -n 's/^iterations: [a-z]* \([0-9]*\) [a-z]* \([0-9]*\)$/\1 \2/p' "$1" | tail -1)
+    difference=$(sed -n 's/^max |difference|: \([0-9.e+-]*\) .*/\1/p' "$1" | tail -1)
+    echo "iterations ${found:-none} difference ${difference:-none}"
+    [ "$found" = "$iteration $iteration" ] && awk -v d="${difference:-1}" -v limit="$limit" 'BEGIN { exit !(d <= limit) }'
+}
+
+# the velocity series of the reference road, or a plausible last velocity of any other road
+check_velocities()
+{
+    if [ "$2" = reference ]; then
+        if grep '^At iteration' "$1" | sed 's/ *$//' | cmp -s - "$BENCH/reference/traffic.txt"; then
+            echo "velocities match"
+            return 0
+        fi
+        echo "velocities differ"
+        return 1
+    fi
+    local last
+    last=$(sed -n 's/^At iteration [0-9]* average velocity is \([0-9.]*\).*/\1/p' "$1" | tail -1)
+    echo "velocity ${last:-none}"
+    awk -v v="${last:-2}" 'BEGIN { exit !(v > 0 && v <= 1) }'
+}
+
+# pi to the six decimals printed
+check_pi()
+{
+    local error
+    error=$(sed -n 's/.*Error: \([0-9.]*\).*/\1/p' "$1" | tail -1)
+    echo "error ${error:-none}"
+    awk -v e="${error:-1}" -v limit="$2" 'BEGIN { exit !(e <= limit) }'
+}
+
+# fresh file command...: the command on a new plate file, as laplace_ooc continues the one of the last run
+fresh()
+{
+    rm -f "$1"
+    shift
+    "$@"
+}
+
+# seconds the program reports for its own run, without the start of mpirun
+seconds_of()
+{
+    sed -n -e 's/.*Total time was \([0-9.]*\) seconds.*/\1/p' -e 's/.*Time taken was *\([0-9.]*\) seconds.*/\1/p' \
+        -e 's/.*Using time: \([0-9.]*\).*/\1/p' "$1" | tail -1
+}
+
+# --- runs ----------------------------------------------------------------------------------------------
+
+# the plates of laplace_batch: the right side ramps up to the plate of laplace_serial, the last one
+awk -v n=$BATCH_PLATES 'BEGIN {
+    print "# left_from left_to right_from right_to top_from top_to bottom_from bottom_to"
+    for (p = 1; p <= n; p++) printf "0 0 0 %g 0 0 0 100\n", 100 * p / n }' > "$OUT/plates.txt"
+
+echo "suite,scaling,program,ranks,threads,size,repeat,seconds,valid,check" > "$OUT/runs.csv"
+
+# run scaling program ranks threads size check expected command...: REPEATS runs of the command,
+# with mpirun for ranks > 0 and OMP_NUM_THREADS=threads
+run()
+{
+    local scaling=$1 program=$2 ranks=$3 threads=$4 size=$5 check=$6 expected=$7
+    shift 7
+    local repeat log seconds valid found
+    for repeat in $(seq 1 "$REPEATS"); do
+        log=$OUT/logs/$scaling-$program-$ranks-$threads-$size-$repeat.log
+        if [ "$ranks" -gt 0 ]; then
+            OMP_NUM_THREADS=$threads $MPIRUN -np "$ranks" "$@" > "$log" 2>&1
+        else
+            OMP_NUM_THREADS=$threads "$@" > "$log" 2>&1
+        fi
+        seconds=$(seconds_of "$log")
+        if found=$($check "$log" "$expected") && [ -n "$seconds" ]; then
+            valid=1
+        else
+            valid=0
+            FAILED=1
+            echo "FAILED $scaling $program ranks=$ranks threads=$threads size=$size: $found (log $log)"
+        fi
+        echo "$SUITE,$scaling,$program,$ranks,$threads,$size,$repeat,${seconds:-NaN},$valid,$found" >> "$OUT/runs.csv"
+    done
+    printf "%-7s %-17s ranks %2d threads %2d size %-10s %s\n" "$scaling" "$program" "$ranks" "$threads" "$size" "$found"
+}
+
+# strong scaling: the same problem on more cores, checked against its reference
+strong()
+{
+    local r t
+    run strong pi_serial 0 1 $PI_TERMS check_pi 0.000001 "$BUILD/pi_serial" $PI_TERMS
+    run strong laplace_serial 0 1 $PLATE check_iterations $JACOBI_ITERATIONS "$PART5/laplace_serial" -n $PLATE -p 0
+    run strong laplace_toggle 0 1 $PLATE check_iterations $JACOBI_ITERATIONS "$PART5/laplace_toggle" -n $PLATE -p 0
+    for t in $THREADS; do
+        run strong pi_openmp 0 "$t" $PI_TERMS check_pi 0.000001 "$BUILD/pi_openmp" $PI_TERMS
+        run strong laplace_omp 0 "$t" $PLATE check_iterations $JACOBI_ITERATIONS "$PART5/laplace_omp" -n $PLATE -p 0
+        run strong laplace_ooc 0 "$t" $PLATE check_iterations $JACOBI_ITERATIONS \
+            fresh "$OUT/plate.ooc" "$PART5/laplace_ooc" -q -n $PLATE -p 0 -o "$OUT/plate.ooc"
+    done
+    for r in $RANKS; do
+        run strong pi_mpi "$r" 1 $PI_TERMS check_pi 0.000001 "$BUILD/pi_mpi" $PI_TERMS
+        run strong traffic_mpi "$r" 1 $ROAD check_velocities reference "$BUILD/traffic_mpi"
+        for t in $THREADS; do
+            run strong traffic_hybrid "$r" "$t" $ROAD check_velocities reference "$BUILD/traffic_hybrid"
+            run strong laplace_horizon "$r" "$t" $PLATE check_iterations $JACOBI_ITERATIONS "$PART5/laplace_horizon" -q -n $PLATE -p 0
+            run strong laplace_lean "$r" "$t" $PLATE check_iterations $JACOBI_ITERATIONS "$PART5/laplace_lean" -q -n $PLATE -p 0
+            run strong laplace_shared "$r" "$t" $PLATE check_iterations $JACOBI_ITERATIONS "$PART5/laplace_shared" -q -n $PLATE -p 0
+            run strong laplace_sor "$r" "$t" $PLATE check_iterations $SOR_ITERATIONS "$PART5/laplace_sor" -q -n $PLATE -p 0
+            run strong laplace_mixed "$r" "$t" $PLATE check_deviation $JACOBI_ITERATIONS:$MIXED_DIFFERENCE \
+                "$PART5/laplace_mixed" -q -n $PLATE -p 0 --validate 1
+            run strong laplace_cg "$r" "$t" $PLATE check_converged $CONVERGED "$PART5/laplace_cg" -q -n $PLATE -p 0
+            run strong laplace_multigrid "$r" "$t" $PLATE check_converged $CONVERGED \
+                "$PART5/laplace_multigrid" -q -n $PLATE -p 0
+            run strong laplace_tasks "$r" "$t" $PLATE check_iterations $JACOBI_ITERATIONS "$PART5/laplace_tasks" -q -n $PLATE -p 0
+            run strong laplace_active "$r" "$t" $PLATE check_deviation $JACOBI_ITERATIONS:$ACTIVE_DIFFERENCE \
+                "$PART5/laplace_active" -q -n $PLATE -p 0
+            run strong laplace_async "$r" "$t" $PLATE check_converged $CONVERGED "$PART5/laplace_async" -q -n $PLATE -p 0
+            run strong laplace_batch "$r" "$t" ${BATCH_PLATES}x$PLATE check_batch $JACOBI_ITERATIONS:$CONVERGED \
+                "$PART5/laplace_batch" -q -n $PLATE -p 0 "$OUT/plates.txt"
+            run strong laplace3d "$r" "$t" $CUBE check_iterations $CUBE_ITERATIONS "$PART5/laplace3d" -q -n $CUBE -p 0
+        done
+    done
+}
+
+# weak scaling: the problem grows with ranks x threads; the plates run a fixed number of iterations
+# (a tolerance nothing reaches), the road keeps its iterations
+weak()
+{
+    local r t cores rows
+    for t in $THREADS; do
+        run weak pi_openmp 0 "$t" $((PI_TERMS * t)) check_pi 0.000001 "$BUILD/pi_openmp" $((PI_TERMS * t))
+        rows=$((WEAK_ROWS * t))
+        run weak laplace_omp 0 "$t" ${rows}x$PLATE check_iterations $WEAK_ITERATIONS \
+            "$PART5/laplace_omp" -r $rows -c $PLATE -i $WEAK_ITERATIONS -t 1e-9 -p 0
+    done
+    for r in $RANKS; do
+        run weak pi_mpi "$r" 1 $((PI_TERMS * r)) check_pi 0.000001 "$BUILD/pi_mpi" $((PI_TERMS * r))
+        run weak traffic_mpi "$r" 1 $((ROAD * r)) check_velocities any "$BUILD/traffic_mpi" $((ROAD * r))
+        for t in $THREADS; do
+            cores=$((r * t))
+            rows=$((WEAK_ROWS * cores))
+            run weak traffic_hybrid "$r" "$t" $((ROAD * cores)) check_velocities any "$BUILD/traffic_hybrid" $((ROAD * cores))
+            run weak laplace_horizon "$r" "$t" ${rows}x$PLATE check_iterations $WEAK_ITERATIONS \
+                "$PART5/laplace_horizon" -q -r $rows -c $PLATE -i $WEAK_ITERATIONS -t 1e-9 -p 0
+            run weak laplace_sor "$r" "$t" ${rows}x$PLATE check_iterations $WEAK_ITERATIONS \
+                "$PART5/laplace_sor" -q -r $rows -c $PLATE -i $WEAK_ITERATIONS -t 1e-9 -p 0
+        done
+    done
+}
+
+strong
+weak
+if [ "$SUITE" = full ]; then
+    # the 10K plate of the README, once, on the most ranks and threads
+    set -- $RANKS; eval "r=\${$#}"
+    set -- $THREADS; eval "t=\${$#}"
+    run reference laplace_horizon "$r" "$t" $PLATE_10K check_iterations $ITERATIONS_10K \
+        "$PART5/laplace_horizon" -q -n $PLATE_10K -p 0
+fi
+
+# --- statistics --------------------------------------------------------------------------------------
+
+# per configuration: valid runs, min, median, mean, sample standard deviation and max of the seconds,
+# and the ratio to the median of the program's configuration with the fewest cores in that scaling
+sort -t, -k2,2 -k3,3 -k4,4n -k5,5n -k8,8g "$OUT/runs.csv" | awk -F, '
+    $1 == "suite" { next }
+    {
+        key = $1 "," $2 "," $3 "," $4 "," $5 "," $6
+        if (!(key in count)) { order[++keys] = key; group[key] = $2 "," $3; cores[key] = ($4 > 0 ? $4 : 1) * $5 }
+        count[key]++
+        valid[key] += $9
+        if ($9 == 1) { n = ++good[key]; t[key, n] = $8; sum[key] += $8; squares[key] += $8 * $8 }
+    }
+    END {
+        print "suite,scaling,program,ranks,threads,size,runs,valid,min,median,mean,stddev,max,relative"
+        for (k = 1; k <= keys; k++) {
+            key = order[k]; n = good[key] + 0
+            if (n == 0) { median[key] = ""; continue }
+            median[key] = n % 2 ? t[key, (n + 1) / 2] : (t[key, n / 2] + t[key, n / 2 + 1]) / 2
+            g = group[key]
+            if (!(g in base) || cores[key] < base_cores[g]) { base[g] = median[key]; base_cores[g] = cores[key] }
+        }
+        for (k = 1; k <= keys; k++) {
+            key = order[k]; n = good[key] + 0
+            if (n == 0) { printf "%s,%d,0,,,,,,\n", key, count[key]; continue }
+            mean = sum[key] / n
+            variance = n > 1 ? (squares[key] - n * mean * mean) / (n - 1) : 0
+            printf "%s,%d,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f\n", key, count[key], n, t[key, 1], median[key], mean,
+                   sqrt(variance > 0 ? variance : 0), t[key, n], (median[key] > 0 ? base[group[key]] / median[key] : 0)
+        }
+    }' > "$OUT/summary.csv"
+echo "Results in $OUT/runs.csv and $OUT/summary.csv"
+
+# --- regressions against a baseline summary -----------------------------------------------------------
+
+if [ -n "$BASELINE" ]; then
+    if ! awk -F, -v tolerance="$TOLERANCE" '
+        FNR == 1 { next }
+        NR == FNR { base[$1 "," $2 "," $3 "," $4 "," $5 "," $6] = $10; next }
+        {
+            key = $1 "," $2 "," $3 "," $4 "," $5 "," $6
+            if (key in base && base[key] != "" && $10 != "" && $10 > base[key] * (1 + tolerance / 100)) {
+                printf "REGRESSION %s: median %.6f s, baseline %.6f s (+%.1f%%)\n", key, $10, base[key],
+                       100 * ($10 / base[key] - 1)
+                slower = 1
+            }
+        }
+        END { exit slower }' "$BASELINE" "$OUT/summary.csv"; then
+        FAILED=1
+    else
+        echo "No configuration more than $TOLERANCE% slower than $BASELINE"
+    fi
+fi
+
+exit $FAILED
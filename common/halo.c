@@ -0,0 +1,314 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "halo.h"
+
+static const char *method_names[HALO_METHODS] = {"blocking", "nonblocking", "persistent", "neighbor", "rma"};
+
+// A message sent towards side k carries tag k, so the neighbour receives it on its side k ^ 1 with
+// that tag. With two ranks in a periodic dimension both sides are the same rank, the tags keep
+// the two messages apart.
+
+// rma: window over my ghost regions and the displacements of the neighbours' ghost regions that my
+// boundary regions go to; -1 if a region is not contiguous or the window cannot be made
+static int create_window(struct halo *halo)
+{
+    MPI_Aint addresses[HALO_SIDES], displs[HALO_SIDES], lb, extent, true_lb, true_extent;
+    MPI_Aint low = 0, high = 0;
+    int unique[HALO_SIDES];
+    int k, i, n = 0, size, usable = 1, all_usable;
+    char *base = NULL;
+    MPI_Group everybody;
+
+    for (k = 0; k < halo->sides; k++)
+    {
+        struct halo_side *s = &halo->side[k];
+        MPI_Type_size(s->type, &size);
+        MPI_Type_get_extent(s->type, &lb, &extent);
+        MPI_Type_get_true_extent(s->type, &true_lb, &true_extent);
+        if (extent != size || true_extent != size)
+        {
+            usable = 0;
+        }
+        if (halo->ranks[k] == MPI_PROC_NULL || s->count == 0)
+        {
+            addresses[k] = -1;
+            continue;
+        }
+        MPI_Get_address((char *)s->recv + true_lb, &addresses[k]);
+        if (base == NULL || addresses[k] < low)
+        {
+            low = addresses[k];
+            base = (char *)s->recv + true_lb;
+        }
+        if (addresses[k] + s->count * (MPI_Aint)size > high)
+        {
+            high = addresses[k] + s->count * (MPI_Aint)size;
+        }
+    }
+    MPI_Allreduce(&usable, &all_usable, 1, MPI_INT, MPI_MIN, halo->comm);
+    if (!all_usable)
+    {
+        return -1;
+    }
+
+    // not every one-sided component takes any memory (Open MPI's osc/rdma on a single rank does not)
+    MPI_Comm_set_errhandler(halo->comm, MPI_ERRORS_RETURN);
+    usable = MPI_Win_create(base, base == NULL ? 0 : high - low, 1, MPI_INFO_NULL, halo->comm,
+                            &halo->win) == MPI_SUCCESS;
+    MPI_Comm_set_errhandler(halo->comm, MPI_ERRORS_ARE_FATAL);
+    MPI_Allreduce(&usable, &all_usable, 1, MPI_INT, MPI_MIN, halo->comm);
+    if (!all_usable)
+    {
+        if (usable)
+        {
+            MPI_Win_free(&halo->win);
+        }
+        halo->win = MPI_WIN_NULL;
+        return -1;
+    }
+    for (k = 0; k < halo->sides; k++)
+    {
+        displs[k] = addresses[k] < 0 ? 0 : addresses[k] - low;
+    }
+    // the same shifts as the blocking exchange: the neighbour on side k ^ 1 tells me where its
+    // ghost region of my side lies
+    for (k = 0; k < halo->sides; k++)
+    {
+        MPI_Sendrecv(&displs[k], 1, MPI_AINT, halo->ranks[k], k, &halo->targets[k ^ 1], 1, MPI_AINT,
+                     halo->ranks[k ^ 1], k, halo->comm, MPI_STATUS_IGNORE);
+    }
+
+    // the epochs only involve the neighbours, each of them once
+    for (k = 0; k < halo->sides; k++)
+    {
+        if (halo->ranks[k] == MPI_PROC_NULL)
+        {
+            continue;
+        }
+        for (i = 0; i < n && unique[i] != halo->ranks[k]; i++)
+            ;
+        if (i == n)
+        {
+            unique[n++] = halo->ranks[k];
+        }
+    }
+    MPI_Comm_group(halo->comm, &everybody);
+    MPI_Group_incl(everybody, n, unique, &halo->group);
+    MPI_Group_free(&everybody);
+    return 0;
+}
+
+int halo_create(struct halo *halo, enum halo_method method, MPI_Comm comm, int dimensions,
+                const int *dims, const int *periods, const struct halo_side *side)
+{
+    int k, d;
+
+    memset(halo, 0, sizeof(*halo));
+    halo->method = method;
+    halo->sides = 2 * dimensions;
+    halo->win = MPI_WIN_NULL;
+    halo->group = MPI_GROUP_NULL;
+    // no reordering: the ranks keep the blocks the program gave them
+    MPI_Cart_create(comm, dimensions, dims, periods, 0, &halo->comm);
+    for (d = 0; d < dimensions; d++)
+    {
+        MPI_Cart_shift(halo->comm, d, 1, &halo->ranks[2 * d], &halo->ranks[2 * d + 1]);
+    }
+    memcpy(halo->side, side, sizeof(struct halo_side) * halo->sides);
+
+    switch (method)
+    {
+    case HALO_PERSISTENT:
+        for (k = 0; k < halo->sides; k++)
+        {
+            MPI_Recv_init(side[k].recv, side[k].count, side[k].type, halo->ranks[k], k ^ 1, halo->comm,
+                          &halo->requests[k]);
+            MPI_Send_init(side[k].send, side[k].count, side[k].type, halo->ranks[k], k, halo->comm,
+                          &halo->requests[halo->sides + k]);
+        }
+        break;
+    case HALO_NEIGHBOR:
+        // the order of the sides is the neighbour order of a Cartesian communicator
+        for (k = 0; k < halo->sides; k++)
+        {
+            halo->counts[k] = side[k].count;
+            halo->types[k] = side[k].type;
+            MPI_Get_address(side[k].send, &halo->send_displs[k]);
+            MPI_Get_address(side[k].recv, &halo->recv_displs[k]);
+        }
+        break;
+    case HALO_RMA:
+        if (create_window(halo) != 0)
+        {
+            MPI_Comm_free(&halo->comm);
+            return -1;
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+void halo_exchange(struct halo *halo)
+{
+    struct halo_side *s = halo->side;
+    int k, n = halo->sides;
+
+    switch (halo->method)
+    {
+    case HALO_BLOCKING:
+        // shift towards side k: my boundary goes there, the ghost region of the opposite side
+        // comes from the neighbour there, which shifts the same way
+        for (k = 0; k < n; k++)
+        {
+            MPI_Sendrecv(s[k].send, s[k].count, s[k].type, halo->ranks[k], k,
+                         s[k ^ 1].recv, s[k ^ 1].count, s[k ^ 1].type, halo->ranks[k ^ 1], k,
+                         halo->comm, MPI_STATUS_IGNORE);
+        }
+        break;
+    case HALO_NONBLOCKING:
+        for (k = 0; k < n; k++)
+        {
+            MPI_Irecv(s[k].recv, s[k].count, s[k].type, halo->ranks[k], k ^ 1, halo->comm, &halo->requests[k]);
+        }
+        for (k = 0; k < n; k++)
+        {
+            MPI_Isend(s[k].send, s[k].count, s[k].type, halo->ranks[k], k, halo->comm, &halo->requests[n + k]);
+        }
+        MPI_Waitall(2 * n, halo->requests, MPI_STATUSES_IGNORE);
+        break;
+    case HALO_PERSISTENT:
+        MPI_Startall(2 * n, halo->requests);
+        MPI_Waitall(2 * n, halo->requests, MPI_STATUSES_IGNORE);
+        break;
+    case HALO_NEIGHBOR:
+        MPI_Neighbor_alltoallw(MPI_BOTTOM, halo->counts, halo->send_displs, halo->types,
+                               MPI_BOTTOM, halo->counts, halo->recv_displs, halo->types, halo->comm);
+        break;
+    case HALO_RMA:
+        // my ghost regions are open to the neighbours until all of them have put theirs
+        MPI_Win_post(halo->group, 0, halo->win);
+        MPI_Win_start(halo->group, 0, halo->win);
+        for (k = 0; k < n; k++)
+        {
+            if (halo->ranks[k] != MPI_PROC_NULL && s[k].count > 0)
+            {
+                MPI_Put(s[k].send, s[k].count, s[k].type, halo->ranks[k], halo->targets[k],
+                        s[k].count, s[k].type, halo->win);
+            }
+        }
+        MPI_Win_complete(halo->win);
+        MPI_Win_wait(halo->win);
+        break;
+    default:
+        break;
+    }
+}
+
+void halo_free(struct halo *halo)
+{
+    int k;
+
+    if (halo->method == HALO_PERSISTENT)
+    {
+        for (k = 0; k < 2 * halo->sides; k++)
+        {
+            MPI_Request_free(&halo->requests[k]);
+        }
+    }
+    if (halo->win != MPI_WIN_NULL)
+    {
+        MPI_Win_free(&halo->win);
+    }
+    if (halo->group != MPI_GROUP_NULL)
+    {
+        MPI_Group_free(&halo->group);
+    }
+    MPI_Comm_free(&halo->comm);
+}
+
+const char *halo_method_name(enum halo_method method)
+{
+    return method >= 0 && method < HALO_METHODS ? method_names[method] : "unknown";
+}
+
+enum halo_method halo_method_env(enum halo_method fallback, int rank)
+{
+    const char *name = getenv("HALO");
+    int m;
+
+    if (name == NULL || *name == '\0')
+    {
+        return fallback;
+    }
+    for (m = 0; m < HALO_METHODS; m++)
+    {
+        if (strcmp(name, method_names[m]) == 0)
+        {
+            return m;
+        }
+    }
+    if (rank == 0)
+    {
+        printf("HALO=%s is none of blocking, nonblocking, persistent, neighbor, rma; using %s\n",
+               name, method_names[fallback]);
+    }
+    return fallback;
+}
+
+void halo_benchmark_env(MPI_Comm comm, int dimensions, const int *dims, const int *periods,
+                        const struct halo_side *side)
+{
+    const char *value = getenv("HALO_BENCHMARK");
+    int repeats = value != NULL ? atoi(value) : 0;
+    int rank, k, m, r, size, bytes = 0, most;
+    double seconds, slowest;
+    struct halo halo;
+
+    if (repeats <= 0)
+    {
+        return;
+    }
+    MPI_Comm_rank(comm, &rank);
+    for (k = 0; k < 2 * dimensions; k++)
+    {
+        MPI_Type_size(side[k].type, &size);
+        bytes = side[k].count * size > bytes ? side[k].count * size : bytes;
+    }
+    MPI_Reduce(&bytes, &most, 1, MPI_INT, MPI_MAX, 0, comm);
+    if (rank == 0)
+    {
+        printf("Halo exchange benchmark, %d exchanges, up to %d bytes a side\n", repeats, most);
+        printf("back-end        us per exchange (slowest rank)\n");
+    }
+
+    for (m = 0; m < HALO_METHODS; m++)
+    {
+        if (halo_create(&halo, m, comm, dimensions, dims, periods, side) != 0)
+        {
+            if (rank == 0)
+            {
+                printf("%-12s    not available for these regions\n", method_names[m]);
+            }
+            continue;
+        }
+        halo_exchange(&halo); // first-time setup of the connections
+        MPI_Barrier(comm);
+        seconds = MPI_Wtime();
+        for (r = 0; r < repeats; r++)
+        {
+            halo_exchange(&halo);
+        }
+        seconds = MPI_Wtime() - seconds;
+        MPI_Reduce(&seconds, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+        if (rank == 0)
+        {
+            printf("%-12s    %12.2f\n", method_names[m], 1e6 * slowest / repeats);
+        }
+        halo_free(&halo);
+    }
+}
@@ -0,0 +1,77 @@
+// nearest-neighbour halo exchange shared by the traffic model and the Laplace solvers.
+// The ranks form a Cartesian grid (1 to HALO_DIMENSIONS dimensions, periodic or not). Every side of
+// my block names the boundary region I send to the neighbour on that side and the ghost region it
+// fills, each a count of an MPI datatype anywhere in memory. The regions are bound when the exchange
+// is created, so one exchange object serves one set of buffers (create one per grid if grids swap).
+// Back-ends, chosen at run time (HALO=name in the environment with halo_method_env):
+//   blocking      MPI_Sendrecv shifts, one dimension and direction at a time
+//   nonblocking   MPI_Irecv / MPI_Isend of all sides, one MPI_Waitall
+//   persistent    the same as persistent requests, MPI_Startall / MPI_Waitall
+//   neighbor      MPI_Neighbor_alltoallw on the Cartesian communicator
+//   rma           MPI_Put into the ghost regions of the neighbours, post/start/complete/wait
+//                 epochs with the neighbours only (ghost regions must be contiguous)
+// HALO_BENCHMARK=N in the environment makes halo_benchmark_env time N exchanges of every back-end
+// on the actual regions of the program.
+
+#include <mpi.h>
+
+#define HALO_DIMENSIONS 3
+#define HALO_SIDES (2 * HALO_DIMENSIONS)
+
+enum halo_method
+{
+    HALO_BLOCKING,
+    HALO_NONBLOCKING,
+    HALO_PERSISTENT,
+    HALO_NEIGHBOR,
+    HALO_RMA,
+    HALO_METHODS
+};
+
+// one side of my block, in the order of the neighbourhood collectives:
+// dimension 0 towards lower coordinates, dimension 0 towards higher ones, dimension 1 ...
+struct halo_side
+{
+    void *send;        // my boundary region, goes to the neighbour on this side
+    void *recv;        // my ghost region on this side, filled by that neighbour
+    int count;
+    MPI_Datatype type; // the neighbour receives with its own type, the signatures must match
+};
+
+struct halo
+{
+    enum halo_method method;
+    MPI_Comm comm;                      // Cartesian, ranks as in the communicator it was made from
+    int sides;
+    int ranks[HALO_SIDES];              // neighbours, MPI_PROC_NULL at a non-periodic edge
+    struct halo_side side[HALO_SIDES];
+    MPI_Request requests[2 * HALO_SIDES];
+    // neighbor: absolute addresses relative to MPI_BOTTOM
+    int counts[HALO_SIDES];
+    MPI_Aint send_displs[HALO_SIDES], recv_displs[HALO_SIDES];
+    MPI_Datatype types[HALO_SIDES];
+    // rma: window over all my ghost regions, where my puts land in the windows of the neighbours
+    MPI_Win win;
+    MPI_Group group;
+    MPI_Aint targets[HALO_SIDES];
+};
+
+// collective over comm; dims and periods as for MPI_Cart_create, side[2 * dimensions] of my block;
+// returns -1 (on all ranks) if the method cannot serve these regions
+int halo_create(struct halo *halo, enum halo_method method, MPI_Comm comm, int dimensions,
+                const int *dims, const int *periods, const struct halo_side *side);
+
+// fill all ghost regions from the boundary regions of the neighbours, collective over the neighbours
+void halo_exchange(struct halo *halo);
+
+void halo_free(struct halo *halo);
+
+const char *halo_method_name(enum halo_method method);
+
+// the method HALO names, fallback if it is not set; rank 0 reports an unknown name
+enum halo_method halo_method_env(enum halo_method fallback, int rank);
+
+// if HALO_BENCHMARK=N is set: time N exchanges of every back-end on these regions, rank 0 prints
+// the slowest rank's time per exchange; the ghost regions end up exchanged
+void halo_benchmark_env(MPI_Comm comm, int dimensions, const int *dims, const int *periods,
+                        const struct halo_side *side);
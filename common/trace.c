@@ -0,0 +1,613 @@
+#define _GNU_SOURCE // syscall, open_memstream
+
+#include <linux/perf_event.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
+#if defined(__has_include)
+#if __has_include(<mpi.h>)
+#define TRACE_MPI 1 // merge the ranks at exit; without mpi.h (plain gcc) a process is on its own
+#include <mpi.h>
+#endif
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_EVENTS (1 << 16) // events kept per thread, older ones are overwritten
+#define TRACE_THREADS 256      // threads per rank that can trace
+#define TRACE_DEPTH 8          // deepest nesting of phases that is recorded
+#define COUNTERS 3             // cycles, instructions, cache misses
+#define PROBE_DOUBLES (1 << 22) // elements of each triad array, 32 MiB: beyond the last-level cache
+#define PROBE_LANES 32          // independent multiply-add chains, enough to hide the latency
+#define PROBE_ROUNDS (1 << 18)
+#define PROBE_REPEATS 5         // the fastest run counts
+#define ROOFLINE (3 + 3 * TRACE_PHASES) // doubles a rank reports: probe, then seconds, bytes, flops
+
+static const char *phase_names[TRACE_PHASES] = {"compute", "halo", "reduce", "io"};
+static const char *counter_names[COUNTERS] = {"cycles", "instructions", "cache_misses"};
+
+struct event
+{
+    uint64_t begin, end; // ns since trace_init
+    uint64_t counts[COUNTERS];
+    int phase;
+};
+
+// everything one thread records, only that thread writes it
+struct thread_trace
+{
+    struct event *events;      // ring of TRACE_EVENTS
+    uint64_t recorded;         // events ever recorded
+    int depth;                 // open phases
+    uint64_t open[TRACE_DEPTH];
+    uint64_t open_counts[TRACE_DEPTH][COUNTERS];
+    int fds[COUNTERS];         // perf_event group, fds[0] leads, -1 without counters
+    // totals of all events, also of those overwritten in the ring
+    double seconds[TRACE_PHASES];
+    long calls[TRACE_PHASES];
+    uint64_t counts[TRACE_PHASES][COUNTERS];
+    double bytes[TRACE_PHASES], flops[TRACE_PHASES];
+};
+
+int trace_enabled = 0;
+static int counters_wanted = 0;
+static int roofline_wanted = 0;
+static double probe_bandwidth = 0.0, probe_peak = 0.0; // bytes and flops per second of this rank
+static int probe_threads = 1;
+static volatile double probe_sink; // keeps the multiply-adds of the probe
+static int trace_rank = 0;
+static const char *trace_file = NULL;
+static uint64_t origin;
+static struct thread_trace *threads[TRACE_THREADS];
+static int thread_count = 0;
+static _Thread_local struct thread_trace *mine = NULL;
+static _Thread_local int untraced = 0; // the thread came after TRACE_THREADS others
+
+static uint64_t now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+}
+
+static int mpi_running(void)
+{
+    #if TRACE_MPI
+    int initialized, finalized;
+    MPI_Initialized(&initialized);
+    MPI_Finalized(&finalized);
+    return initialized && !finalized;
+    #else
+    return 0;
+    #endif
+}
+
+// all ranks probe at the same time, so each of them measures its share of the node
+static void probe_barrier(void)
+{
+    #if TRACE_MPI
+    if (mpi_running())
+        MPI_Barrier(MPI_COMM_WORLD);
+    #endif
+}
+
+// threads of the probe: OMP_NUM_THREADS, or the cores shared among the ranks of the node
+static int probe_team(void)
+{
+    #if defined(_OPENMP)
+    int threads = omp_get_max_threads(), node_ranks = 1;
+    #if TRACE_MPI
+    if (mpi_running() && getenv("OMP_NUM_THREADS") == NULL)
+    {
+        MPI_Comm node;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+        MPI_Comm_size(node, &node_ranks);
+        MPI_Comm_free(&node);
+    }
+    #endif
+    return threads > node_ranks ? threads / node_ranks : 1;
+    #else
+    return 1;
+    #endif
+}
+
+// STREAM triad for the sustainable memory bandwidth (reads and writes, no write-allocate, as STREAM
+// counts) and independent multiply-add chains for the peak flop rate, fastest of PROBE_REPEATS runs
+static void probe(void)
+{
+    double *a = (double *)malloc(sizeof(double) * PROBE_DOUBLES);
+    double *b = (double *)malloc(sizeof(double) * PROBE_DOUBLES);
+    double *c = (double *)malloc(sizeof(double) * PROBE_DOUBLES);
+    double seconds, triad = 0.0, fma = 0.0, sink = 0.0;
+    long i;
+    int r;
+
+    probe_threads = probe_team();
+    if (a == NULL || b == NULL || c == NULL)
+    {
+        free(a);
+        free(b);
+        free(c);
+        return;
+    }
+    // first touch by the threads that stream the arrays
+    #if defined(_OPENMP)
+    #pragma omp parallel for num_threads(probe_threads) schedule(static)
+    #endif
+    for (i = 0; i < PROBE_DOUBLES; i++)
+    {
+        a[i] = 0.0;
+        b[i] = 1.0;
+        c[i] = 2.0;
+    }
+    for (r = 0; r < PROBE_REPEATS; r++)
+    {
+        probe_barrier();
+        uint64_t start = now();
+        #if defined(_OPENMP)
+        #pragma omp parallel for num_threads(probe_threads) schedule(static)
+        #endif
+        for (i = 0; i < PROBE_DOUBLES; i++)
+        {
+            a[i] = b[i] + 3.0 * c[i];
+        }
+        seconds = (now() - start) * 1e-9;
+        triad = r == 0 || seconds < triad ? seconds : triad;
+    }
+    sink = a[PROBE_DOUBLES / 2];
+
+    for (r = 0; r < PROBE_REPEATS; r++)
+    {
+        probe_barrier();
+        uint64_t start = now();
+        #if defined(_OPENMP)
+        #pragma omp parallel num_threads(probe_threads) reduction(+:sink)
+        #endif
+        {
+            double lanes[PROBE_LANES];
+            int j, k;
+            for (j = 0; j < PROBE_LANES; j++)
+            {
+                lanes[j] = j;
+            }
+            for (k = 0; k < PROBE_ROUNDS; k++)
+            {
+                #if defined(_OPENMP)
+                #pragma omp simd
+                #endif
+                for (j = 0; j < PROBE_LANES; j++)
+                {
+                    lanes[j] = lanes[j] * 0.999999 + 1e-6;
+                }
+            }
+            for (j = 0; j < PROBE_LANES; j++)
+            {
+                sink += lanes[j];
+            }
+        }
+        seconds = (now() - start) * 1e-9;
+        fma = r == 0 || seconds < fma ? seconds : fma;
+    }
+    probe_sink = sink;
+
+    probe_bandwidth = 3.0 * sizeof(double) * PROBE_DOUBLES / triad;
+    probe_peak = 2.0 * PROBE_LANES * PROBE_ROUNDS * probe_threads / fma;
+    free(a);
+    free(b);
+    free(c);
+}
+
+// group of the hardware counters of the calling thread, user space only; all fds stay -1
+// if perf_event is not there (no PMU in the VM, perf_event_paranoid)
+static void open_counters(struct thread_trace *t)
+{
+    static const uint64_t configs[COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                               PERF_COUNT_HW_CACHE_MISSES};
+    struct perf_event_attr attr;
+    int i;
+
+    for (i = 0; i < COUNTERS; i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        t->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : t->fds[0], 0);
+        if (t->fds[i] < 0)
+        {
+            while (i-- > 0)
+            {
+                close(t->fds[i]);
+                t->fds[i] = -1;
+            }
+            return;
+        }
+    }
+}
+
+static void read_counters(struct thread_trace *t, uint64_t *counts)
+{
+    struct
+    {
+        uint64_t count;
+        uint64_t values[COUNTERS];
+    } group;
+
+    if (t->fds[0] < 0 || read(t->fds[0], &group, sizeof(group)) != sizeof(group))
+    {
+        memset(counts, 0, sizeof(uint64_t) * COUNTERS);
+        return;
+    }
+    memcpy(counts, group.values, sizeof(group.values));
+}
+
+// first event of a thread: a ring and a slot of its own, the slot number is its id in the trace
+static struct thread_trace *register_thread(void)
+{
+    int slot = __atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED);
+    if (slot >= TRACE_THREADS)
+    {
+        untraced = 1;
+        return NULL;
+    }
+    struct thread_trace *t = (struct thread_trace *)calloc(1, sizeof(struct thread_trace));
+    t->events = (struct event *)malloc(sizeof(struct event) * TRACE_EVENTS);
+    t->fds[0] = -1;
+    if (counters_wanted)
+    {
+        open_counters(t);
+    }
+    __atomic_store_n(&threads[slot], t, __ATOMIC_RELEASE);
+    return t;
+}
+
+void trace_init(int rank)
+{
+    const char *summary = getenv("TRACE"), *counters = getenv("TRACE_COUNTERS");
+    const char *roofline = getenv("TRACE_ROOFLINE");
+
+    trace_file = getenv("TRACE_FILE");
+    if (trace_file != NULL && trace_file[0] == '\0')
+    {
+        trace_file = NULL;
+    }
+    roofline_wanted = roofline != NULL && strcmp(roofline, "0") != 0 && roofline[0] != '\0';
+    trace_enabled = trace_file != NULL || roofline_wanted ||
+                    (summary != NULL && strcmp(summary, "0") != 0 && summary[0] != '\0');
+    counters_wanted = counters != NULL && strcmp(counters, "0") != 0 && counters[0] != '\0';
+    trace_rank = rank;
+    if (roofline_wanted)
+    {
+        // collective over MPI_COMM_WORLD: every rank gets the same environment
+        probe();
+        if (trace_rank == 0)
+            printf("Roofline probe on rank 0, %d thread%s: %.2f GB/s triad, %.2f GFLOP/s multiply-add\n",
+                   probe_threads, probe_threads > 1 ? "s" : "", probe_bandwidth * 1e-9, probe_peak * 1e-9);
+    }
+    origin = now();
+}
+
+void trace_record_begin(enum trace_phase phase)
+{
+    struct thread_trace *t = mine;
+    (void)phase;
+
+    if (t == NULL)
+    {
+        if (untraced || (t = mine = register_thread()) == NULL)
+            return;
+    }
+    if (t->depth < TRACE_DEPTH)
+    {
+        read_counters(t, t->open_counts[t->depth]);
+        t->open[t->depth] = now();
+    }
+    t->depth++;
+}
+
+void trace_record_end(enum trace_phase phase)
+{
+    struct thread_trace *t = mine;
+    uint64_t end, counts[COUNTERS];
+    int i;
+
+    if (t == NULL || t->depth == 0)
+        return;
+    t->depth--;
+    if (t->depth >= TRACE_DEPTH)
+        return;
+    end = now();
+    read_counters(t, counts);
+
+    struct event *e = &t->events[t->recorded % TRACE_EVENTS];
+    e->phase = phase;
+    e->begin = t->open[t->depth] - origin;
+    e->end = end - origin;
+    for (i = 0; i < COUNTERS; i++)
+    {
+        e->counts[i] = counts[i] - t->open_counts[t->depth][i];
+        t->counts[phase][i] += e->counts[i];
+    }
+    t->seconds[phase] += (e->end - e->begin) * 1e-9;
+    t->calls[phase]++;
+    t->recorded++;
+}
+
+void trace_record_work(enum trace_phase phase, double bytes, double flops)
+{
+    struct thread_trace *t = mine;
+
+    if (t == NULL)
+    {
+        if (untraced || (t = mine = register_thread()) == NULL)
+            return;
+    }
+    t->bytes[phase] += bytes;
+    t->flops[phase] += flops;
+}
+
+// achieved rates of every phase and rank against the probe of the rank: the attainable flop rate is
+// min(peak, intensity x bandwidth); without flops (cellular automata, copies) the bandwidth is the limit
+static void print_roofline(const double *all, int size)
+{
+    int r, p;
+
+    printf("\nRoofline, probe of every rank at startup (all ranks at once)\n");
+    printf("%-6s %8s %10s %10s %14s\n", "rank", "threads", "GB/s", "GFLOP/s", "ridge flop/B");
+    for (r = 0; r < size; r++)
+    {
+        const double *mine_all = all + r * ROOFLINE;
+        printf("%-6d %8d %10.2f %10.2f %14.2f\n", r, (int)mine_all[2], mine_all[0] * 1e-9, mine_all[1] * 1e-9,
+               mine_all[0] > 0.0 ? mine_all[1] / mine_all[0] : 0.0);
+    }
+    printf("%-8s %6s %12s %10s %10s %8s %11s  %s\n", "phase", "rank", "seconds", "GB/s", "GFLOP/s", "flop/B",
+           "% roofline", "bound");
+    for (p = 0; p < TRACE_PHASES; p++)
+    {
+        for (r = 0; r < size; r++)
+        {
+            const double *rank_all = all + r * ROOFLINE;
+            double seconds = rank_all[3 + p], bytes = rank_all[3 + TRACE_PHASES + p];
+            double flops = rank_all[3 + 2 * TRACE_PHASES + p];
+            double bandwidth = rank_all[0], peak = rank_all[1], percent, attainable;
+            const char *bound;
+
+            if (seconds <= 0.0 || (bytes <= 0.0 && flops <= 0.0))
+                continue;
+            if (flops > 0.0 && (bytes <= 0.0 || flops / bytes * bandwidth >= peak))
+            {
+                attainable = peak;
+                bound = "compute";
+            }
+            else if (flops > 0.0)
+            {
+                attainable = flops / bytes * bandwidth;
+                bound = "memory";
+            }
+            else
+            {
+                attainable = bandwidth;
+                bound = "memory";
+            }
+            percent = attainable > 0.0 ? 100.0 * (flops > 0.0 ? flops : bytes) / seconds / attainable : 0.0;
+            printf("%-8s %6d %12.6f %10.2f %10.2f ", phase_names[p], r, seconds, bytes / seconds * 1e-9,
+                   flops / seconds * 1e-9);
+            if (bytes > 0.0)
+                printf("%8.3f", flops / bytes);
+            else
+                printf("%8s", "-");
+            printf(" %10.1f%%  %s\n", percent, bound);
+        }
+    }
+}
+
+// my part of the Chrome trace: metadata and the events in the rings, oldest first; rank 0 opens
+// the JSON object and the last rank closes it, so the parts only need to be put side by side
+static char *trace_json(int first, int last, size_t *length)
+{
+    char *text = NULL;
+    int n = thread_count < TRACE_THREADS ? thread_count : TRACE_THREADS, i, c;
+    FILE *out = open_memstream(&text, length);
+
+    fprintf(out, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"rank %d\"}}",
+            first ? "{\"traceEvents\":[\n" : ",\n", trace_rank, trace_rank);
+    for (i = 0; i < n; i++)
+    {
+        struct thread_trace *t = threads[i];
+        uint64_t k = t->recorded > TRACE_EVENTS ? t->recorded - TRACE_EVENTS : 0;
+        for (; k < t->recorded; k++)
+        {
+            struct event *e = &t->events[k % TRACE_EVENTS];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    phase_names[e->phase], trace_rank, i, e->begin * 1e-3, (e->end - e->begin) * 1e-3);
+            if (t->fds[0] >= 0)
+            {
+                fprintf(out, ",\"args\":{");
+                for (c = 0; c < COUNTERS; c++)
+                {
+                    fprintf(out, "%s\"%s\":%llu", c ? "," : "", counter_names[c], (unsigned long long)e->counts[c]);
+                }
+                fprintf(out, "}");
+            }
+            fprintf(out, "}");
+        }
+    }
+    if (last)
+    {
+        fprintf(out, "\n]}\n");
+    }
+    fclose(out);
+    return text;
+}
+
+void trace_finish(void)
+{
+    int n = thread_count < TRACE_THREADS ? thread_count : TRACE_THREADS;
+    int i, p, c, mpi = 0, size = 1, counting = 0;
+    // per rank: the busiest thread for the time and the calls, all threads for the counters
+    double seconds[TRACE_PHASES] = {0}, seconds_sum[TRACE_PHASES], seconds_max[TRACE_PHASES];
+    long calls[TRACE_PHASES] = {0}, calls_max[TRACE_PHASES], lost = 0, lost_all;
+    unsigned long long counts[TRACE_PHASES][COUNTERS] = {{0}}, counts_all[TRACE_PHASES][COUNTERS];
+    // per rank: all threads for the work, the rates divide it by the busiest thread's seconds
+    double work[2][TRACE_PHASES] = {{0}}, work_all[2][TRACE_PHASES], working = 0.0;
+    double roofline[ROOFLINE], *roofline_all = NULL;
+
+    if (!trace_enabled)
+        return;
+    mpi = mpi_running();
+    #if !TRACE_MPI
+    (void)mpi;
+    #endif
+
+    for (i = 0; i < n; i++)
+    {
+        struct thread_trace *t = threads[i];
+        counting = counting || t->fds[0] >= 0;
+        lost += t->recorded > TRACE_EVENTS ? (long)(t->recorded - TRACE_EVENTS) : 0;
+        for (p = 0; p < TRACE_PHASES; p++)
+        {
+            seconds[p] = t->seconds[p] > seconds[p] ? t->seconds[p] : seconds[p];
+            calls[p] = t->calls[p] > calls[p] ? t->calls[p] : calls[p];
+            for (c = 0; c < COUNTERS; c++)
+            {
+                counts[p][c] += t->counts[p][c];
+            }
+            work[0][p] += t->bytes[p];
+            work[1][p] += t->flops[p];
+            working += t->bytes[p] + t->flops[p];
+        }
+    }
+    roofline[0] = probe_bandwidth;
+    roofline[1] = probe_peak;
+    roofline[2] = probe_threads;
+    memcpy(roofline + 3, seconds, sizeof(seconds));
+    memcpy(roofline + 3 + TRACE_PHASES, work, sizeof(work));
+
+    #if TRACE_MPI
+    if (mpi)
+    {
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+        MPI_Reduce(seconds, seconds_sum, TRACE_PHASES, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        MPI_Reduce(seconds, seconds_max, TRACE_PHASES, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        MPI_Reduce(calls, calls_max, TRACE_PHASES, MPI_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+        MPI_Reduce(&lost, &lost_all, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+        MPI_Reduce(counts, counts_all, TRACE_PHASES * COUNTERS, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+        MPI_Reduce(work, work_all, 2 * TRACE_PHASES, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &working, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        if (roofline_wanted)
+        {
+            if (trace_rank == 0)
+                roofline_all = (double *)malloc(sizeof(double) * ROOFLINE * size);
+            MPI_Gather(roofline, ROOFLINE, MPI_DOUBLE, roofline_all, ROOFLINE, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        }
+    }
+    else
+    #endif
+    {
+        memcpy(seconds_sum, seconds, sizeof(seconds));
+        memcpy(seconds_max, seconds, sizeof(seconds));
+        memcpy(calls_max, calls, sizeof(calls));
+        memcpy(counts_all, counts, sizeof(counts));
+        memcpy(work_all, work, sizeof(work));
+        lost_all = lost;
+        if (roofline_wanted)
+        {
+            roofline_all = (double *)malloc(sizeof(roofline));
+            memcpy(roofline_all, roofline, sizeof(roofline));
+        }
+    }
+
+    if (trace_rank == 0)
+    {
+        printf("\nTrace summary, %d rank%s, seconds of the busiest thread of a rank\n", size, size > 1 ? "s" : "");
+        printf("%-8s %10s %12s %12s", "phase", "calls", "mean s", "max s");
+        if (counting)
+            printf(" %16s %16s %6s %14s", "cycles", "instructions", "IPC", "cache misses");
+        if (working > 0.0)
+            printf(" %10s %10s", "GB/s", "GFLOP/s");
+        printf("\n");
+        for (p = 0; p < TRACE_PHASES; p++)
+        {
+            if (calls_max[p] == 0)
+                continue;
+            printf("%-8s %10ld %12.6f %12.6f", phase_names[p], calls_max[p], seconds_sum[p] / size, seconds_max[p]);
+            if (counting)
+                printf(" %16llu %16llu %6.2f %14llu", counts_all[p][0], counts_all[p][1],
+                       counts_all[p][0] ? (double)counts_all[p][1] / counts_all[p][0] : 0.0, counts_all[p][2]);
+            // all ranks together, over the slowest rank's time
+            if (working > 0.0 && work_all[0][p] + work_all[1][p] > 0.0)
+                printf(" %10.2f %10.2f", work_all[0][p] / seconds_max[p] * 1e-9, work_all[1][p] / seconds_max[p] * 1e-9);
+            else if (working > 0.0)
+                printf(" %10s %10s", "-", "-");
+            printf("\n");
+        }
+        if (counters_wanted && !counting)
+            printf("(no hardware counters: perf_event is not available)\n");
+        if (lost_all > 0)
+            printf("(%ld oldest events were overwritten in the rings and are missing from the trace)\n", lost_all);
+        if (roofline_wanted)
+            print_roofline(roofline_all, size);
+    }
+    free(roofline_all);
+
+    if (trace_file != NULL)
+    {
+        size_t length;
+        char *text = trace_json(trace_rank == 0, trace_rank == size - 1, &length);
+        #if TRACE_MPI
+        if (mpi)
+        {
+            MPI_File file;
+            long long mine_length = (long long)length, offset = 0, total;
+            MPI_Exscan(&mine_length, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+            MPI_Allreduce(&mine_length, &total, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+            if (trace_rank == 0)
+                offset = 0;
+            if (MPI_File_open(MPI_COMM_WORLD, trace_file, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) == MPI_SUCCESS)
+            {
+                MPI_File_set_size(file, total);
+                MPI_File_write_at_all(file, offset, text, (int)length, MPI_CHAR, MPI_STATUS_IGNORE);
+                MPI_File_close(&file);
+            }
+            else if (trace_rank == 0)
+            {
+                printf("Cannot write the trace to %s\n", trace_file);
+            }
+        }
+        else
+        #endif
+        {
+            FILE *file = fopen(trace_file, "w");
+            if (file == NULL || fwrite(text, 1, length, file) != length)
+                printf("Cannot write the trace to %s\n", trace_file);
+            if (file != NULL)
+                fclose(file);
+        }
+        if (trace_rank == 0)
+            printf("Trace written to %s\n", trace_file);
+        free(text);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        for (c = 0; c < COUNTERS && threads[i]->fds[0] >= 0; c++)
+        {
+            close(threads[i]->fds[c]);
+        }
+        free(threads[i]->events);
+        free(threads[i]);
+        threads[i] = NULL;
+    }
+    thread_count = 0;
+    trace_enabled = 0;
+}
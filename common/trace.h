@@ -0,0 +1,54 @@
+// phase tracing shared by the programs of all parts.
+// Every thread of every rank writes the begin and end of its phases into a ring buffer of its own,
+// nothing is locked and nothing is communicated while the program runs. trace_finish merges the
+// buffers at exit into a Chrome trace (chrome://tracing, ui.perfetto.dev) and prints a per-phase summary.
+// Off unless the environment asks for it:
+//   TRACE=1            per-phase summary at exit
+//   TRACE_FILE=x.json  summary and the trace of all ranks and threads in x.json
+//   TRACE_COUNTERS=1   also cycles, instructions and cache misses of every phase (perf_event)
+//   TRACE_ROOFLINE=1   measure the memory bandwidth and the peak flop rate of every rank at startup
+//                      and rate the work of every phase and rank against them (roofline)
+// Phases may nest, the summary then counts the inner time in both.
+
+enum trace_phase
+{
+    TRACE_COMPUTE,
+    TRACE_HALO,
+    TRACE_REDUCE,
+    TRACE_IO,
+    TRACE_PHASES
+};
+
+extern int trace_enabled;
+
+// read the environment, rank is the MPI rank or 0 (call it after MPI_Init)
+void trace_init(int rank);
+
+void trace_record_begin(enum trace_phase phase);
+void trace_record_end(enum trace_phase phase);
+void trace_record_work(enum trace_phase phase, double bytes, double flops);
+
+// begin and end a phase on the calling thread, a branch when tracing is off
+static inline void trace_begin(enum trace_phase phase)
+{
+    if (trace_enabled)
+        trace_record_begin(phase);
+}
+
+static inline void trace_end(enum trace_phase phase)
+{
+    if (trace_enabled)
+        trace_record_end(phase);
+}
+
+// add the memory traffic and the floating point operations of work done in phase, from any thread;
+// the summary divides them by the time of the busiest thread of the rank in that phase
+static inline void trace_work(enum trace_phase phase, double bytes, double flops)
+{
+    if (trace_enabled)
+        trace_record_work(phase, bytes, flops);
+}
+
+// merge and write everything, collective over MPI_COMM_WORLD if MPI is initialized and the library
+// was built with mpicc; call it outside parallel regions, before MPI_Finalize
+void trace_finish(void);
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE // gethostname
+
+#if defined(__has_include)
+#if __has_include(<mpi.h>)
+#define TUNE_MPI 1 // ranks calibrate together; without mpi.h (plain gcc) a process is on its own
+#include <mpi.h>
+#endif
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tune.h"
+
+#define TUNE_REPEATS 2     // runs of every candidate at least, the fastest counts
+#define TUNE_RUNS 50       // at most, short runs are repeated to take TUNE_SECONDS
+#define TUNE_SECONDS 0.02
+#define TUNE_PASSES 3      // rounds over all knobs at most
+#define TUNE_GAIN 0.98     // a candidate must be 2 % faster to replace the current value, not just noise
+#define TUNE_LINE 1024
+#define TUNE_CACHE "tune.cache"
+
+static int mpi_running(void)
+{
+#if TUNE_MPI
+    int initialized, finalized;
+    MPI_Initialized(&initialized);
+    MPI_Finalized(&finalized);
+    return initialized && !finalized;
+#else
+    return 0;
+#endif
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// the slowest rank's time of the fastest of repeats runs, the same on all ranks
+static double timed(struct tune_knob *knobs, tune_measure_fn measure, void *data, int repeats)
+{
+    double best = 0.0, seconds;
+    int r;
+
+    for (r = 0; r < repeats; r++)
+    {
+        seconds = measure(knobs, data);
+#if TUNE_MPI
+        if (mpi_running())
+        {
+            double mine = seconds;
+            MPI_Allreduce(&mine, &seconds, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+        }
+#endif
+        best = r == 0 || seconds < best ? seconds : best;
+    }
+    return best;
+}
+
+// "name=value ..." of all knobs, labels where there are some
+static void describe(const struct tune_knob *knobs, int count, char *text, size_t size)
+{
+    size_t used = 0;
+    int k, c;
+
+    text[0] = '\0';
+    for (k = 0; k < count && used < size; k++)
+    {
+        const char *label = NULL;
+        for (c = 0; c < knobs[k].count; c++)
+        {
+            if (knobs[k].values[c] == knobs[k].value)
+            {
+                label = knobs[k].labels[c];
+            }
+        }
+        if (label != NULL)
+        {
+            used += snprintf(text + used, size - used, "%s%s=%s", k ? " " : "", knobs[k].name, label);
+        }
+        else
+        {
+            used += snprintf(text + used, size - used, "%s%s=%d", k ? " " : "", knobs[k].name, knobs[k].value);
+        }
+    }
+}
+
+// "host/cpus|problem|", the start of the cache line of this machine and problem
+static void cache_key(const char *problem, char *key, size_t size)
+{
+    char host[256] = "unknown";
+
+    gethostname(host, sizeof(host) - 1);
+    snprintf(key, size, "%s/%ld|%s|", host, sysconf(_SC_NPROCESSORS_ONLN), problem);
+}
+
+static const char *cache_file(void)
+{
+    const char *file = getenv("TUNE_CACHE");
+    return file != NULL && *file != '\0' ? file : TUNE_CACHE;
+}
+
+// values of the last entry of key into values[], only candidates are taken; 1 if there is one
+static int load(const char *key, const struct tune_knob *knobs, int count, int *values)
+{
+    char line[TUNE_LINE];
+    size_t length = strlen(key);
+    int k, c, found = 0;
+    FILE *file = fopen(cache_file(), "r");
+
+    if (file == NULL)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, key, length) != 0)
+        {
+            continue;
+        }
+        found = 1;
+        for (k = 0; k < count; k++)
+        {
+            values[k] = knobs[k].value;
+        }
+        for (char *token = strtok(line + length, " \n"); token != NULL; token = strtok(NULL, " \n"))
+        {
+            char *text = strchr(token, '=');
+            if (text == NULL)
+            {
+                continue;
+            }
+            *text++ = '\0';
+            for (k = 0; k < count; k++)
+            {
+                if (strcmp(token, knobs[k].name) != 0)
+                {
+                    continue;
+                }
+                for (c = 0; c < knobs[k].count; c++)
+                {
+                    if (knobs[k].labels[c] != NULL ? strcmp(text, knobs[k].labels[c]) == 0
+                                                   : atoi(text) == knobs[k].values[c])
+                    {
+                        values[k] = knobs[k].values[c];
+                    }
+                }
+            }
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+// replace the entry of key, the other lines stay; written next to the cache and renamed
+static int store(const char *key, const char *settings)
+{
+    char line[TUNE_LINE], part[TUNE_LINE + 8];
+    const char *name = cache_file();
+    FILE *old = fopen(name, "r"), *new;
+
+    snprintf(part, sizeof(part), "%s.part", name);
+    new = fopen(part, "w");
+    if (new == NULL)
+    {
+        if (old != NULL)
+            fclose(old);
+        return -1;
+    }
+    while (old != NULL && fgets(line, sizeof(line), old) != NULL)
+    {
+        if (strncmp(line, key, strlen(key)) != 0)
+        {
+            fputs(line, new);
+        }
+    }
+    if (old != NULL)
+    {
+        fclose(old);
+    }
+    fprintf(new, "%s%s\n", key, settings);
+    if (fclose(new) != 0 || rename(part, name) != 0)
+    {
+        remove(part);
+        return -1;
+    }
+    return 0;
+}
+
+int tune(const char *problem, struct tune_knob *knobs, int count, tune_measure_fn measure, void *data)
+{
+    const char *wanted = getenv("TUNE");
+    int calibrate = wanted != NULL && *wanted != '\0' && strcmp(wanted, "0") != 0;
+    int rank = 0, found = 0, k, c, pass, changed, repeats;
+    int values[count > 0 ? count : 1];
+    char key[TUNE_LINE], settings[TUNE_LINE];
+    double start, best, seconds;
+
+#if TUNE_MPI
+    if (mpi_running())
+    {
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    }
+#endif
+    cache_key(problem, key, sizeof(key));
+
+    if (!calibrate)
+    {
+        if (rank == 0)
+        {
+            found = load(key, knobs, count, values);
+        }
+#if TUNE_MPI
+        if (mpi_running())
+        {
+            MPI_Bcast(&found, 1, MPI_INT, 0, MPI_COMM_WORLD);
+            MPI_Bcast(values, count, MPI_INT, 0, MPI_COMM_WORLD);
+        }
+#endif
+        if (!found)
+        {
+            return 0;
+        }
+        for (k = 0; k < count; k++)
+        {
+            knobs[k].value = values[k];
+        }
+        describe(knobs, count, settings, sizeof(settings));
+        if (rank == 0)
+        {
+            printf("Tuned settings from %s: %s\n", cache_file(), settings);
+        }
+        return 1;
+    }
+
+    // every rank sees the same reduced times, so all of them take the same decisions
+    start = now();
+    best = timed(knobs, measure, data, TUNE_REPEATS);
+    repeats = best > 0.0 && TUNE_SECONDS / best < TUNE_RUNS ? (int)(TUNE_SECONDS / best) : TUNE_RUNS;
+    repeats = repeats > TUNE_REPEATS ? repeats : TUNE_REPEATS;
+    best = timed(knobs, measure, data, repeats);
+    for (pass = 0; pass < TUNE_PASSES; pass++)
+    {
+        changed = 0;
+        for (k = 0; k < count; k++)
+        {
+            int keep = knobs[k].value;
+            for (c = 0; c < knobs[k].count; c++)
+            {
+                if (knobs[k].values[c] == keep)
+                {
+                    continue;
+                }
+                knobs[k].value = knobs[k].values[c];
+                seconds = timed(knobs, measure, data, repeats);
+                if (seconds < TUNE_GAIN * best)
+                {
+                    best = seconds;
+                    keep = knobs[k].values[c];
+                    changed = 1;
+                }
+            }
+            knobs[k].value = keep;
+        }
+        if (!changed)
+        {
+            break;
+        }
+    }
+
+    describe(knobs, count, settings, sizeof(settings));
+    if (rank == 0)
+    {
+        printf("Tuned in %f seconds, %f seconds a calibration run: %s\n", now() - start, best, settings);
+        if (store(key, settings) != 0)
+        {
+            printf("Cannot write the tuning cache %s\n", cache_file());
+        }
+    }
+    return 1;
+}
+
+int tune_value(const struct tune_knob *knobs, int count, const char *name, int fallback)
+{
+    int k;
+
+    for (k = 0; k < count; k++)
+    {
+        if (strcmp(knobs[k].name, name) == 0)
+        {
+            return knobs[k].value;
+        }
+    }
+    return fallback;
+}
@@ -0,0 +1,32 @@
+// empirical tuning shared by the programs of all parts.
+// A program names its knobs (threads, schedule, chunk, block sizes, kernel variant...) with their
+// candidate values and a measure function that times a short run of its kernel with the current
+// values. The best values depend on the machine and the problem, so they are kept in a tuning
+// cache, one line per machine and problem, that later runs load at startup:
+//   TUNE=1            calibrate now (one knob after the other, over again until nothing changes)
+//                     and store the fastest values
+//   TUNE_CACHE=file   the cache, tune.cache in the working directory by default
+// Without TUNE and without an entry, the knobs keep the program's defaults.
+
+#define TUNE_VALUES 8 // candidates per knob
+
+struct tune_knob
+{
+    const char *name;                // key in the cache
+    int count;                       // candidates
+    int values[TUNE_VALUES];
+    const char *labels[TUNE_VALUES]; // printed instead of the values, NULL for numbers
+    int value;                       // the default on entry, the chosen value on return
+};
+
+// run the kernel once with the current values of knobs, returns its seconds on this rank
+typedef double (*tune_measure_fn)(struct tune_knob *knobs, void *data);
+
+// problem: what the best values depend on besides the machine, e.g. "laplace_horizon 1000x1000 ranks=4".
+// Returns 1 if the knobs hold tuned values (calibrated or loaded), 0 for the defaults.
+// Collective over MPI_COMM_WORLD if MPI is initialized and the library was built with mpicc,
+// rank 0 decides and prints what it chose
+int tune(const char *problem, struct tune_knob *knobs, int count, tune_measure_fn measure, void *data);
+
+// the value of the knob called name, fallback if there is none
+int tune_value(const struct tune_knob *knobs, int count, const char *name, int fallback);
@@ -1,8 +1,9 @@
 // Pi calculation using the approximation formula.
 // $\frac{\pi}{4} = \int_{0}^{1}{\frac{dx}{1+x^{2}}} \approx \frac{1}{N}\sum_{i=1}^{N}{\frac{1}{1+(\frac{i-\frac{1}{2}}{N})^{2}}}$ 
 
-// compile command: mpicc pi_mpi.c -lm (-fopenmp if you want to use OpenMP) 
-// run command: mpirun -np $NUM_PROCESS ./a.out $N_VALUE(default 100000)
+// compile command: mpicc -O3 -march=native pi_mpi.c ../common/trace.c -lm (-fopenmp if you want to use OpenMP) 
+// run command: mpirun -np $NUM_PROCESS ./a.out $N_VALUE(default 100000), -x TRACE=1 for a phase summary,
+// -x TRACE_ROOFLINE=1 for the flop rate against the peak of every rank
 
 #include <stdio.h>  // printf
 #include <stdlib.h> // atoi
@@ -10,6 +11,8 @@
 #include <mpi.h>    // MPI
 #include <assert.h> // assert
 
+#include "../common/trace.h" // compute and reduce phases
+
 #if defined(_OPENMP)
 #include <omp.h>    // OpenMP
 #endif
@@ -30,6 +33,7 @@ int main (int argc, char* argv[])
     
     //Get process ID
     MPI_Comm_rank (comm, &rank);
+    trace_init(rank);
     
     //Get processes Number
     MPI_Comm_size (comm, &size);
@@ -60,15 +64,21 @@ int main (int argc, char* argv[])
     int istop = min(N, istart + part - 1);
     
     //Each process calculates a part of the sum
+    trace_begin(TRACE_COMPUTE);
     #if defined(_OPENMP)
     #pragma omp parallel for reduction(+:partial_pi)
     #endif
     for (int i = istart; i <= istop; i++) {
         partial_pi += 1.0/(1.0 + pow((double)(i - 0.5)/((double) N), 2.0));
     }
-    
+    // a subtraction, a division, the square, an addition, the reciprocal and the sum; nothing from memory
+    trace_work(TRACE_COMPUTE, 0.0, istop >= istart ? 6.0 * (istop - istart + 1) : 0.0);
+    trace_end(TRACE_COMPUTE);
+
     //Sum up all results
+    trace_begin(TRACE_REDUCE);
     MPI_Reduce(&partial_pi, &pi, 1, MPI_DOUBLE, MPI_SUM, 0, comm);
+    trace_end(TRACE_REDUCE);
     /* Using MPI_Reduce to sum up is better than using MPI_Send and MPI_Recv
      * the send and recv version is as below:
     if (rank == 0) { // main process
@@ -99,6 +109,7 @@ int main (int argc, char* argv[])
         printf("Using time: %lf\n", end - start);
     }
     
+    trace_finish();
     error = MPI_Finalize();
     assert(error == MPI_SUCCESS);
     
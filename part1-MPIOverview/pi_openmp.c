@@ -1,8 +1,9 @@
 // Pi calculation using the approximation formula.
 // $\frac{\pi}{4} = \int_{0}^{1}{\frac{dx}{1+x^{2}}} \approx \frac{1}{N}\sum_{i=1}^{N}{\frac{1}{1+(\frac{i-\frac{1}{2}}{N})^{2}}}$ 
 
-// compile command: gcc omp.c -lm -fopenmp
-// run command: ./a.out $N_VALUE(default 100000)
+// compile command: gcc -O3 -march=native pi_openmp.c ../common/trace.c -lm -fopenmp
+// run command: ./a.out $N_VALUE(default 100000), TRACE=1 for the time of every thread,
+// TRACE_ROOFLINE=1 for the flop rate against the peak
 
 
 #include <stdio.h>  // printf
@@ -12,6 +13,8 @@
 #include <assert.h> // assert
 #include <time.h>   // time 
 
+#include "../common/trace.h" // per thread phases
+
 typedef struct timespec timespec;
 
 timespec diff(timespec start, timespec end)
@@ -40,18 +43,27 @@ int main (int argc, char* argv[])
     } 
     printf("OpenMP version of Pi calculation.\n");
     printf("N value is %d\n", N);
+    trace_init(0);
     
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
-    #pragma omp parallel for reduction(+:pi)
-    for (int i = 1; i <= N; i++) {
-        pi += 1.0/(1.0 + pow((double)(i - 0.5)/((double) N), 2.0));
+    // wall time: CLOCK_PROCESS_CPUTIME_ID would add up the CPU time of all threads
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    #pragma omp parallel reduction(+:pi)
+    {
+        trace_begin(TRACE_COMPUTE);
+        #pragma omp for nowait
+        for (int i = 1; i <= N; i++) {
+            pi += 1.0/(1.0 + pow((double)(i - 0.5)/((double) N), 2.0));
+        }
+        trace_end(TRACE_COMPUTE);
     }
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    trace_work(TRACE_COMPUTE, 0.0, 6.0 * N); // see pi_mpi.c
     
     pi = 4.0/((double) N) * pi;
     printf("Calculated pi: %lf, Exact pi: %lf, Error: %lf\n", pi, exact_pi, fabs(pi - exact_pi));
     res = diff(start, end);
     printf("Using time: %lf\n", (double)(end.tv_sec-start.tv_sec)+(double)(end.tv_nsec-start.tv_nsec)/1e9);
+    trace_finish();
 
     return 0;
 }
\ No newline at end of file
@@ -3,6 +3,9 @@
 #include <stdlib.h>
 
 #include "traffic.h"
+#include "../../common/halo.h"
+#include "../../common/trace.h"
+#include "../../common/tune.h"
 
 #include <mpi.h>
 
@@ -11,32 +14,58 @@
 #endif
 
 #define NCELL 100000
+#define CALIBRATION_UPDATES 20 // CA updates of one tuning run
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// what a tuning run needs
+struct calibration
+{
+    int *oldroad, *newroad;
+    int irange;
+    int count; // knobs
+    int nmove; // of the last run, so the updates are not optimised away
+};
+
+double calibration_updates(struct tune_knob *knobs, void *data);
+
 int main(int argc, char **argv)
 {
 
     int rank, size, error;
     MPI_Comm comm = MPI_COMM_WORLD;
-    MPI_Request send_req, recv_req;
-    MPI_Status send_status, recv_status;
+    MPI_Status recv_status;
 
     error = MPI_Init(NULL, NULL);
     assert(error == MPI_SUCCESS);
 
     // Get process ID
     MPI_Comm_rank(comm, &rank);
+    trace_init(rank);
 
     // Get processes Number
     MPI_Comm_size(comm, &size);
 
+    // road length from the command line, NCELL by default
+    int ncell = argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : NCELL;
+
     #if defined(_OPENMP)
-    int n_threads = omp_get_num_procs() / size;
+    int n_threads = omp_get_num_procs() > size ? omp_get_num_procs() / size : 1;
+    // OMP_NUM_THREADS sets the threads per rank, for scaling runs
+    if (getenv("OMP_NUM_THREADS") != NULL)
+    {
+        n_threads = omp_get_max_threads();
+    }
+    // schedule(runtime) loops are static unless OMP_SCHEDULE or the tuning says otherwise
+    int scheduled = getenv("OMP_SCHEDULE") != NULL;
+    if (!scheduled)
+    {
+        omp_set_schedule(omp_sched_static, 0);
+    }
     #endif
 
     int *oldroad, *newroad;
 
-    int i, iter, nmove, ncars;
+    int iter, nmove, ncars;
     int maxiter, printfreq;
     int nmove_all = 0;
 
@@ -44,17 +73,15 @@ int main(int argc, char **argv)
 
     double tstart, tstop;
 
-    int PART_NCELL = (NCELL + size - 1) / size;
+    int PART_NCELL = (ncell + size - 1) / size;
     int istart = PART_NCELL * rank;
-    int istop = min(PART_NCELL * (rank + 1), NCELL);
+    int istop = min(PART_NCELL * (rank + 1), ncell);
     int irange = istop - istart;
-    int last_rank = (rank + size - 1) % size;
-    int next_rank = (rank + 1) % size;
     printf("Rank %d from %d to %d, range %d\n", rank, istart, istop, irange);
     if (rank == 0)
     {
-        oldroad = (int *)malloc((NCELL + 2) * sizeof(int));
-        newroad = (int *)malloc((NCELL + 2) * sizeof(int));
+        oldroad = (int *)malloc((ncell + 2) * sizeof(int));
+        newroad = (int *)malloc((ncell + 2) * sizeof(int));
     }
     else
     {
@@ -62,7 +89,7 @@ int main(int argc, char **argv)
         newroad = (int *)malloc((irange + 2) * sizeof(int));
     }
 
-    maxiter = 200000000 / NCELL;
+    maxiter = 200000000 / NCELL; // also for other road lengths, weak scaling runs keep the iterations
     // maxiter = 10;
     printfreq = maxiter / 10;
 
@@ -72,21 +99,21 @@ int main(int argc, char **argv)
 
     if (rank == 0)
     {
-        printf("Length of road is %d\n", NCELL);
+        printf("Length of road is %d\n", ncell);
         printf("Number of iterations is %d \n", maxiter);
         printf("Target density of cars is %f \n", density);
 
         // Initialise road accordingly using random number generator
         printf("Initialising road ...\n");
-        ncars = initroad(&oldroad[1], NCELL, density, SEED);
+        ncars = initroad(&oldroad[1], ncell, density, SEED);
         printf("...done\n");
-        printf("Actual density of cars is %f\n\n", (float)ncars / (float)NCELL);
+        printf("Actual density of cars is %f\n\n", (float)ncars / (float)ncell);
         for (int i = 1; i < size; i++)
         {
             printf("Sending %d data to rank %d\n",
-                   min(PART_NCELL, NCELL - i * PART_NCELL), i);
+                   min(PART_NCELL, ncell - i * PART_NCELL), i);
             MPI_Send(&oldroad[1] + PART_NCELL * i,
-                     min(PART_NCELL, NCELL - i * PART_NCELL), MPI_INT, i, 0, comm);
+                     min(PART_NCELL, ncell - i * PART_NCELL), MPI_INT, i, 0, comm);
         }
     }
     else
@@ -97,6 +124,46 @@ int main(int argc, char **argv)
         printf("Rank[%d] received initialized data from rank[0]\n", rank);
     }
 
+    // the road is a ring: cell 0 is the last cell of the previous rank, cell irange + 1 the first of the next
+    int periods[1] = {1};
+    struct halo_side sides[2] = {{&oldroad[1], &oldroad[0], 1, MPI_INT},
+                                 {&oldroad[irange], &oldroad[irange + 1], 1, MPI_INT}};
+    struct halo halo;
+    halo_benchmark_env(comm, 1, &size, periods, sides);
+    if (halo_create(&halo, halo_method_env(HALO_BLOCKING, rank), comm, 1, &size, periods, sides) != 0)
+    {
+        halo_create(&halo, HALO_BLOCKING, comm, 1, &size, periods, sides);
+    }
+    if (rank == 0)
+    {
+        printf("Halo exchange: %s\n", halo_method_name(halo.method));
+    }
+
+    #if defined(_OPENMP)
+    // threads, schedule and chunk from calibration updates (TUNE=1) or the tuning cache
+    struct tune_knob knobs[3] = {{"threads", 0, {0}, {NULL}, n_threads},
+                                 {"schedule", 3, {omp_sched_static, omp_sched_dynamic, omp_sched_guided},
+                                  {"static", "dynamic", "guided"}, omp_sched_static},
+                                 {"chunk", 4, {0, 64, 1024, 8192}, {NULL}, 0}};
+    struct calibration calibration = {oldroad, newroad, irange, scheduled ? 1 : 3, 0};
+    char problem[64];
+    // a quarter, half and all of the cores, and twice as many threads for hyperthreading
+    for (int t = n_threads >= 4 ? n_threads / 4 : 1; t <= 2 * n_threads; t *= 2)
+    {
+        knobs[0].values[knobs[0].count++] = t;
+    }
+    snprintf(problem, sizeof(problem), "traffic %d ranks=%d", ncell, size);
+    halo_exchange(&halo); // ghost cells for the calibration updates
+    if (tune(problem, knobs, calibration.count, calibration_updates, &calibration))
+    {
+        n_threads = knobs[0].value;
+        if (!scheduled)
+        {
+            omp_set_schedule(knobs[1].value, knobs[2].value);
+        }
+    }
+    #endif
+
     MPI_Barrier(comm);
     if (rank == 0)
     {
@@ -110,29 +177,15 @@ int main(int argc, char **argv)
             road[n + 1] = road[1];
           }
         */
-        if (rank % 2 == 0)
-        {
-            MPI_Send(&oldroad[irange], 1, MPI_INT, next_rank, 0, comm);
-            MPI_Send(&oldroad[1], 1, MPI_INT, last_rank, 0, comm);
-            MPI_Recv(&oldroad[0], 1, MPI_INT, last_rank, 0, comm,
-                     &recv_status);
-            MPI_Recv(&oldroad[irange + 1], 1, MPI_INT, next_rank, 0, comm,
-                     &recv_status);
-        }
-        else
-        {
-            MPI_Recv(&oldroad[0], 1, MPI_INT, last_rank, 0, comm,
-                     &recv_status);
-            MPI_Recv(&oldroad[irange + 1], 1, MPI_INT, next_rank, 0, comm,
-                     &recv_status);
-            MPI_Send(&oldroad[irange], 1, MPI_INT, next_rank, 0, comm);
-            MPI_Send(&oldroad[1], 1, MPI_INT, last_rank, 0, comm);
-        }
+        trace_begin(TRACE_HALO);
+        halo_exchange(&halo);
+        trace_end(TRACE_HALO);
         // Apply CA rules to all cells
+        trace_begin(TRACE_COMPUTE);
         nmove = 0;
 
 #if defined(_OPENMP)
-#pragma omp parallel for num_threads(n_threads) reduction(+:nmove)
+#pragma omp parallel for num_threads(n_threads) schedule(runtime) reduction(+:nmove)
 #endif
 #if 1
         // Simplicity version using bitwise operations
@@ -172,14 +225,19 @@ int main(int argc, char **argv)
 
 #endif
 #if defined(_OPENMP)
-#pragma omp parallel for num_threads(n_threads)
+#pragma omp parallel for num_threads(n_threads) schedule(runtime)
 #endif
         for (int i = 1; i <= irange; i++)
         {
             oldroad[i] = newroad[i];
         }
+        // the rules read and write every cell, so does the copy; integer logic, no flops
+        trace_work(TRACE_COMPUTE, 4.0 * sizeof(int) * irange, 0.0);
+        trace_end(TRACE_COMPUTE);
 
+        trace_begin(TRACE_REDUCE);
         MPI_Reduce(&nmove, &nmove_all, 1, MPI_INT, MPI_SUM, 0, comm);
+        trace_end(TRACE_REDUCE);
         if (rank == 0)
         {
             if (iter % printfreq == 0)
@@ -195,6 +253,7 @@ int main(int argc, char **argv)
         tstop = gettime();
     }
 
+    halo_free(&halo);
     free(oldroad);
     free(newroad);
 
@@ -203,10 +262,49 @@ int main(int argc, char **argv)
         printf("\nFinished\n");
         printf("\nTime taken was  %f seconds\n", tstop - tstart);
         printf("Update rate was %f MCOPs\n\n",
-               1.e-6 * ((double)NCELL) * ((double)maxiter) / (tstop - tstart));
+               1.e-6 * ((double)ncell) * ((double)maxiter) / (tstop - tstart));
     }
 
+    trace_finish();
     error = MPI_Finalize();
     assert(error == MPI_SUCCESS);
     return 0;
 }
+
+// one tuning run: CALIBRATION_UPDATES updates of my cells into newroad with the threads, schedule and
+// chunk of the knobs; oldroad is only read
+double calibration_updates(struct tune_knob *knobs, void *data)
+{
+    struct calibration *c = data;
+    int *oldroad = c->oldroad, *newroad = c->newroad;
+    int u, nmove = 0;
+    double start = MPI_Wtime();
+
+    #if defined(_OPENMP)
+    omp_sched_t kind;
+    int chunk;
+    omp_get_schedule(&kind, &chunk);
+    if (c->count > 1)
+    {
+        omp_set_schedule(knobs[1].value, knobs[2].value);
+    }
+    #endif
+    for (u = 0; u < CALIBRATION_UPDATES; u++)
+    {
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(knobs[0].value) schedule(runtime) reduction(+:nmove)
+#endif
+        for (int i = 1; i <= c->irange; i++)
+        {
+            newroad[i] = (oldroad[i] & oldroad[i + 1]) | (oldroad[i - 1] & (!oldroad[i]));
+            nmove += oldroad[i] & (!newroad[i]);
+        }
+    }
+    #if defined(_OPENMP)
+    omp_set_schedule(kind, chunk);
+    #else
+    (void)knobs;
+    #endif
+    c->nmove = nmove;
+    return MPI_Wtime() - start;
+}
@@ -0,0 +1,83 @@
+#include <mpi.h>
+#include <stddef.h>
+
+// run time configuration shared by the laplace programs
+struct laplace_config
+{
+    int rows, columns;     // size of plate
+    double max_temp_error; // largest permitted change in temp
+    int max_iterations;    // number of iterations (V-cycles for multigrid)
+    int progress;          // print test values every so many iterations, 0 for never
+    int quiet;             // no per iteration output (timings, residuals)
+    int huge_pages;        // back the grids with transparent huge pages
+    const char *checkpoint; // checkpoint file, NULL for none
+    int checkpoint_every;  // iterations between checkpoints
+    const char *restart;   // checkpoint to continue from, NULL to start from the initial plate
+    const char *output;    // file for the final field, NULL for none
+    const char *snapshot;  // prefix of in-situ snapshot frames, NULL for none
+    int snapshot_every;    // iterations between snapshots
+    int planes;            // depth of a 3D volume (laplace3d)
+    const char *cache;     // warm-start cache directory, NULL for none
+    int validate;          // compare with a reference solve afterwards (laplace_active, laplace_mixed)
+};
+
+// override the program defaults in config from a config file and then from the command line,
+// returns 0 to run, 1 if the usage was requested, -1 on a bad option; only report prints messages.
+// Arguments that are not options are left to the program, from argv[optind] on
+int laplace_configure(int argc, char **argv, struct laplace_config *config, int report);
+
+// Jacobi update of one row, out[j] = average of the four neighbours of in[j] for j = 1..columns,
+// in points at the middle row, the rows above and below are pitch elements away
+typedef void (*laplace_row_fn)(double *restrict out, const double *restrict in, int pitch, int columns);
+
+// kernel compiled for this plate width if it is a common one, generic otherwise
+laplace_row_fn laplace_row_kernel(int columns);
+
+// the generic kernel, for any width
+void laplace_row_any(double *restrict out, const double *restrict in, int pitch, int columns);
+
+// row length in elements of a grid width elements wide: whole cache lines,
+// one line more when rows would be a multiple of 4 KiB apart (4K aliasing of the stencil rows)
+int laplace_pitch(int width, size_t size);
+
+// what laplace_tune tunes besides the threads: the schedule of the kernel's schedule(runtime) loops,
+// and the row kernel (only with the Jacobi sweep of the calibration, sweep NULL)
+#define LAPLACE_TUNE_SCHEDULE 1
+#define LAPLACE_TUNE_KERNEL 2
+
+// one sweep of a solver over rows 1..range_row of grid with threads OpenMP threads, returns the
+// largest change; grid is a copy of the plate with its ghost rows, the sweep may update it in place
+typedef double (*laplace_sweep_fn)(double *grid, int threads, void *data);
+
+// Threads (at most *threads, which sized the grids and buffers) and, as tunable says, the schedule of
+// the schedule(runtime) loops and the row kernel for this machine and plate. TUNE=1 calibrates them
+// with short runs of the solver's own sweep (with data) on a copy of rows 0..range_row+1 of grid in
+// scratch; with sweep NULL, of two grid Jacobi sweeps from grid into scratch. scratch NULL: a grid of
+// its own for the calibration. The result goes into the tuning cache, later runs load it from there
+// (common/tune.h). The runtime schedule is static, the one the grids were first touched with, unless
+// OMP_SCHEDULE or the tuning says otherwise. Collective over MPI_COMM_WORLD in MPI programs
+void laplace_tune(const char *program, int rows, int columns, int ranks, int pitch, double *grid, double *scratch,
+                  int range_row, int tunable, int *threads, laplace_row_fn *stencil, laplace_sweep_fn sweep, void *data);
+
+// boundary conditions of the plate in my rows 0..range_row+1 of a zeroed grid (from laplace_alloc):
+// the right side rises linearly to 100 down the plate, the bottom row (on the last rank) from left to right
+void laplace_initialize(int rows, int columns, int pitch, double (*grid)[pitch], int range_row, int start_row, int last_rank);
+
+// print the diagonal in the bottom right corner of my rows, where most action is
+void laplace_track_progress(int columns, int pitch, double (*grid)[pitch], int iteration, int range_row, int start_row);
+
+// halo exchange of the row slabs, from common/halo.h (include it to use the exchange)
+struct halo;
+
+// set up the exchange of grid, rows of pitch elements of type: columns 1..columns of row 1 go to the
+// previous rank and of row range_row to the next one, ghost rows 0 and range_row + 1 come back.
+// HALO picks the back-end, nonblocking if it cannot serve these rows; aborts if neither can. The rows are bound to halo,
+// so grids that swap roles need one exchange each. Collective over comm
+void laplace_halo_create(struct halo *halo, void *grid, int pitch, int columns, int range_row, MPI_Datatype type,
+                         MPI_Comm comm);
+
+// zeroed grid of rows x pitch elements, rows start on cache lines (on 2 MiB pages with huge_pages);
+// rows 1..rows-2 are first touched by threads OpenMP threads (0 for the default team) with the
+// static schedule of the sweeps, so each slab of pages lands on the NUMA node of the thread updating it.
+// release with free()
+void *laplace_alloc(int rows, int pitch, size_t size, int threads, int huge_pages);
@@ -0,0 +1,446 @@
+#if defined(_OPENMP)
+#include "omp.h"
+#endif
+
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <assert.h>
+
+#include "laplace.h"
+#include "../common/trace.h"
+#include "../common/tune.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define rank_zero_only(statement) \
+    do                            \
+    {                             \
+        if (rank == 0)            \
+            statement;           \
+    } while (0);
+
+
+#define TIMING 1   // Timing macro
+#define HYPER 2    // enable hyperthreading
+
+// default cache block of the sweep in rows and columns, a block runs through all planes of the rank so
+// the three planes the 7-point stencil reads (3 x 16 x 256 doubles, 96 KiB) stay in L2; TUNE=1 picks
+// the block for the machine's caches
+#ifndef BLOCK_ROWS
+#define BLOCK_ROWS 16
+#endif
+#ifndef BLOCK_COLUMNS
+#define BLOCK_COLUMNS 256
+#endif
+
+// default size of volume
+#define PLANES  1000
+#define COLUMNS 1000
+#define ROWS    1000
+
+// largest permitted change in temp
+#define MAX_TEMP_ERROR 0.01
+
+// memory traffic and flops per cell of one sweep, for the roofline (TRACE_ROOFLINE=1);
+// the blocking keeps the neighbouring rows and planes in cache
+#define CELL_BYTES 16.0 // the stencil reads one grid and writes the other
+#define CELL_FLOPS 7.0  // 5 adds and a multiply of the stencil, the difference for dt
+
+// my part of the volume: planes x rows x columns cells from the global start cell on,
+// with a ghost layer on every face
+struct box
+{
+    int planes, rows, columns;
+    int start_plane, start_row, start_column;
+    int pitch;                 // padded row length
+    int neighbour[3][2];       // previous and next rank in planes, rows, columns, MPI_PROC_NULL at the boundary
+    MPI_Datatype face[3];      // my face in planes, rows, columns, from its first interior cell
+    int block_rows, block_columns; // cache block of the sweep
+};
+
+// what a tuning run needs
+struct calibration
+{
+    struct box *box;
+    double *grid, *last;
+};
+
+// helper routines
+void initialize(int planes, int rows, int columns, struct box *box, double (*Temperature)[box->rows + 2][box->pitch]);
+
+void track_progress(int planes, int rows, int columns, struct box *box, double (*Temperature)[box->rows + 2][box->pitch], int iteration);
+
+void exchange_halo(struct box *box, double (*Temperature)[box->rows + 2][box->pitch], MPI_Comm comm);
+
+double sweep(struct box *box, double (*Temperature)[box->rows + 2][box->pitch],
+             double (*Temperature_last)[box->rows + 2][box->pitch], int first_plane, int last_plane);
+
+double calibration_sweep(struct tune_knob *knobs, void *data);
+
+int main(int argc, char **argv)
+{
+
+    int iteration = 1;                                  // current iteration
+    double dt = 100;                                    // largest chaneg in t
+    struct timeval start_time, stop_time, elapsed_time; // timers
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 4000, .progress = 100};
+    struct box box;
+
+    int rank, size, error, d;
+    double start, end, duration, temp;
+    int dims[3] = {0, 0, 0}, periods[3] = {0, 0, 0}, coords[3];
+    MPI_Comm comm;
+
+    error = MPI_Init(NULL, NULL);
+    assert(error == MPI_SUCCESS);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // 3D Cartesian decomposition, MPI may renumber the ranks to fit the machine
+    MPI_Dims_create(size, 3, dims);
+    MPI_Cart_create(MPI_COMM_WORLD, 3, dims, periods, 1, &comm);
+    MPI_Comm_rank(comm, &rank);
+    trace_init(rank);
+    MPI_Cart_coords(comm, rank, 3, coords);
+
+    // every rank parses the same arguments, only rank 0 reports problems
+    config.planes = PLANES;
+    int status = laplace_configure(argc, argv, &config, rank == 0);
+    if (status != 0)
+    {
+        MPI_Finalize();
+        return status < 0;
+    }
+    int planes = config.planes, rows = config.rows, columns = config.columns;
+
+    #if defined(_OPENMP)
+    int total_cores = omp_get_num_procs()*HYPER;
+    int local_cores = total_cores > size ? total_cores / size : 1;
+    rank_zero_only(printf("Openmp total_cores: %d local_cores: %d\n", total_cores, local_cores));
+    #else
+    int local_cores = 1;
+    #endif
+
+    int global[3] = {planes, rows, columns}, start_cell[3], count[3];
+    for (d = 0; d < 3; d++)
+    {
+        int part = (global[d] + dims[d] - 1) / dims[d];
+        start_cell[d] = coords[d] * part;
+        count[d] = min(start_cell[d] + part, global[d]) - start_cell[d];
+        MPI_Cart_shift(comm, d, 1, &box.neighbour[d][0], &box.neighbour[d][1]);
+    }
+    box.planes = count[0];
+    box.rows = count[1];
+    box.columns = count[2];
+    box.start_plane = start_cell[0];
+    box.start_row = start_cell[1];
+    box.start_column = start_cell[2];
+    box.pitch = laplace_pitch(box.columns + 2, sizeof(double));
+    box.block_rows = BLOCK_ROWS;
+    box.block_columns = BLOCK_COLUMNS;
+    rank_zero_only(printf("%d x %d x %d ranks, %d x %d x %d cells on rank 0\n",
+                          dims[0], dims[1], dims[2], box.planes, box.rows, box.columns));
+
+    // faces as derived datatypes on the grid itself, no packing
+    int plane_size = (box.rows + 2) * box.pitch;
+    MPI_Datatype column;
+    MPI_Type_vector(box.rows, box.columns, box.pitch, MPI_DOUBLE, &box.face[0]);     // one plane
+    MPI_Type_vector(box.planes, box.columns, plane_size, MPI_DOUBLE, &box.face[1]);  // one row of every plane
+    MPI_Type_vector(box.rows, 1, box.pitch, MPI_DOUBLE, &column);                    // one column of every plane
+    MPI_Type_create_hvector(box.planes, 1, sizeof(double) * plane_size, column, &box.face[2]);
+    MPI_Type_free(&column);
+    for (d = 0; d < 3; d++)
+    {
+        MPI_Type_commit(&box.face[d]);
+    }
+
+    // rows of all planes in one sequence, the threads first touch whole planes as the sweeps use them
+    double(*Temperature)[box.rows + 2][box.pitch] =
+        laplace_alloc((box.planes + 2) * (box.rows + 2), box.pitch, sizeof(double), local_cores, config.huge_pages);      // temperature grid
+    double(*Temperature_last)[box.rows + 2][box.pitch] =
+        laplace_alloc((box.planes + 2) * (box.rows + 2), box.pitch, sizeof(double), local_cores, config.huge_pages);      // temperature grid from last iteration
+    if (Temperature == NULL || Temperature_last == NULL)
+    {
+        printf("Rank %d cannot allocate the grids of its %d x %d x %d box\n", rank, box.planes, box.rows, box.columns);
+        MPI_Abort(comm, 1);
+    }
+
+    gettimeofday(&start_time, NULL); // Unix timer
+
+    #if TIMING
+    start = MPI_Wtime();
+    #endif
+    // both grids carry the boundary, the sweeps toggle them
+    initialize(planes, rows, columns, &box, Temperature_last);
+    initialize(planes, rows, columns, &box, Temperature);
+    #if TIMING
+    end = MPI_Wtime();
+    duration = end - start;
+    if (!config.quiet)
+    {
+        MPI_Allreduce(&duration, &temp, 1, MPI_DOUBLE, MPI_SUM, comm);
+        rank_zero_only(printf("initialization: %lf ", temp/size));
+    }
+    #endif
+
+    // threads and cache block from a calibration sweep (TUNE=1) or the tuning cache
+    struct tune_knob knobs[3] = {{"threads", 0, {0}, {NULL}, local_cores},
+                                 {"block_rows", 5, {4, 8, 16, 32, 64}, {NULL}, BLOCK_ROWS},
+                                 {"block_columns", 6, {64, 128, 256, 512, 1024, 2048}, {NULL}, BLOCK_COLUMNS}};
+    struct calibration calibration = {&box, &Temperature[0][0][0], &Temperature_last[0][0][0]};
+    char problem[96];
+    // a quarter, half and all of the cores; the first touch above keeps local_cores
+    for (int t = local_cores >= 4 ? local_cores / 4 : 1; t <= local_cores; t *= 2)
+    {
+        knobs[0].values[knobs[0].count++] = t;
+    }
+    snprintf(problem, sizeof(problem), "laplace3d %dx%dx%d ranks=%d", planes, rows, columns, size);
+    if (tune(problem, knobs, 3, calibration_sweep, &calibration))
+    {
+        local_cores = knobs[0].value;
+        box.block_rows = knobs[1].value;
+        box.block_columns = knobs[2].value;
+    }
+
+    if (!config.quiet)
+        printf("This is rank %d (%d, %d, %d), world_size: %d max_iter: %d\n", rank, coords[0], coords[1], coords[2], size, config.max_iterations);
+    // do util error is minimal of until max steps
+    while (dt > config.max_temp_error && iteration <= config.max_iterations)
+    {
+        #if TIMING
+        start = MPI_Wtime();
+        #endif
+
+        // main calculation: average my six neighbors, each thread takes a slab of planes
+        trace_begin(TRACE_COMPUTE);
+        dt = 0.0;
+        #if defined(_OPENMP)
+        #pragma omp parallel num_threads(local_cores) reduction(max:dt)
+        #endif
+        {
+            #if defined(_OPENMP)
+            int threads = omp_get_num_threads(), thread = omp_get_thread_num();
+            #else
+            int threads = 1, thread = 0;
+            #endif
+            int first = 1 + (int)((long)box.planes * thread / threads);
+            int last = (int)((long)box.planes * (thread + 1) / threads);
+            dt = sweep(&box, Temperature, Temperature_last, first, last);
+        }
+        trace_work(TRACE_COMPUTE, CELL_BYTES * box.planes * box.rows * box.columns,
+                   CELL_FLOPS * box.planes * box.rows * box.columns);
+        trace_end(TRACE_COMPUTE);
+
+        // the new grid is the old one of the next iteration
+        double(*swap)[box.rows + 2][box.pitch] = Temperature;
+        Temperature = Temperature_last;
+        Temperature_last = swap;
+
+        #if TIMING
+        end = MPI_Wtime();
+        duration = end - start;
+        if (!config.quiet)
+        {
+            MPI_Allreduce(&duration, &temp, 1, MPI_DOUBLE, MPI_SUM, comm);
+            rank_zero_only(printf("computation: %lf ", temp/size));
+        }
+        #endif
+
+        trace_begin(TRACE_REDUCE);
+        temp = dt;
+        error = MPI_Allreduce(&temp, &dt, 1, MPI_DOUBLE, MPI_MAX, comm);
+        // assert(error == MPI_SUCCESS);
+        trace_end(TRACE_REDUCE);
+
+        // periodically print test values
+        if (config.progress && iteration % config.progress == 0)
+        {
+            track_progress(planes, rows, columns, &box, Temperature_last, iteration);
+        }
+
+        start = MPI_Wtime();
+        trace_begin(TRACE_HALO);
+        exchange_halo(&box, Temperature_last, comm);
+        trace_end(TRACE_HALO);
+        #if TIMING
+        end = MPI_Wtime();
+        duration = end - start;
+        if (!config.quiet)
+        {
+            MPI_Allreduce(&duration, &temp, 1, MPI_DOUBLE, MPI_SUM, comm);
+            rank_zero_only(printf(" communication: %lf\n", temp/size));
+        }
+        #endif
+
+        iteration++;
+    }
+
+    gettimeofday(&stop_time, NULL); // Unix timer
+    timersub(&stop_time, &start_time,
+             &elapsed_time); // Unix timer substraction routine
+
+    rank_zero_only(printf("\nMax error at iteration %d was %f\n", iteration - 1, dt));
+    rank_zero_only(printf("Total time was %f seconds\n",
+           elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0)));
+
+    trace_finish();
+    for (d = 0; d < 3; d++)
+    {
+        MPI_Type_free(&box.face[d]);
+    }
+    MPI_Comm_free(&comm);
+    MPI_Finalize();
+    free(Temperature);
+    free(Temperature_last);
+
+    return 0;
+}
+
+// initialize volume and boundary conditions, the plate of laplace_serial.c drawn through all planes:
+// the front and back planes, the top and the left side are 0, the right side increases linearly
+// with the row and the bottom with the column
+void initialize(int planes, int rows, int columns, struct box *box, double (*Temperature)[box->rows + 2][box->pitch])
+{
+    int k, i, j;
+    (void)planes;
+    // the grid comes zeroed from laplace_alloc, only the boundaries need values,
+    // the front and back planes stay 0 (the stencil never reads where they meet the sides)
+
+    // these boundary conditions never change thoughout run
+    if (box->start_column + box->columns == columns)
+    {
+        for (k = 0; k <= box->planes + 1; k++)
+        {
+            for (i = 0; i <= box->rows + 1; i++)
+            {
+                Temperature[k][i][box->columns + 1] = (100.0 / rows) * (i + box->start_row);
+            }
+        }
+    }
+
+    if (box->start_row + box->rows == rows)
+    {
+        for (k = 0; k <= box->planes + 1; k++)
+        {
+            for (j = 0; j <= box->columns + 1; j++)
+            {
+                Temperature[k][box->rows + 1][j] = (100.0 / columns) * (j + box->start_column);
+            }
+        }
+    }
+
+}
+
+// print diagonal in bottom right corner of the middle plane where most action is,
+// by the rank that holds the corner
+void track_progress(int planes, int rows, int columns, struct box *box, double (*Temperature)[box->rows + 2][box->pitch], int iteration)
+{
+    int i, t;
+    int k = planes / 2 + 1 - box->start_plane;
+
+    if (k < 1 || k > box->planes || box->start_row + box->rows != rows || box->start_column + box->columns != columns)
+    {
+        return;
+    }
+    printf("--------- Iteration number: %d ---------\n", iteration);
+    for (t = 5; t >= 0; t--)
+    {
+        i = box->rows - t;
+        if (i >= 1 && box->columns - t >= 1)
+        {
+            printf("[%d,%d,%d]: %5.2f ", planes / 2 + 1, rows - t, columns - t, Temperature[k][i][box->columns - t]);
+        }
+    }
+    printf("\n");
+}
+
+// exchange the six faces with the neighbouring ranks, the faces go straight from the grid
+// through the derived datatypes; ghost layers at the boundary of the volume have MPI_PROC_NULL
+void exchange_halo(struct box *box, double (*Temperature)[box->rows + 2][box->pitch], MPI_Comm comm)
+{
+    MPI_Request requests[12];
+    int d, n = 0;
+    int last[3] = {box->planes, box->rows, box->columns};
+
+    for (d = 0; d < 3; d++)
+    {
+        // first interior cell of the face at layer index l in dimension d
+        #define FACE(l) (d == 0 ? &Temperature[l][1][1] : d == 1 ? &Temperature[1][l][1] : &Temperature[1][1][l])
+        MPI_Irecv(FACE(0), 1, box->face[d], box->neighbour[d][0], 2 * d + 1, comm, &requests[n++]);
+        MPI_Irecv(FACE(last[d] + 1), 1, box->face[d], box->neighbour[d][1], 2 * d, comm, &requests[n++]);
+        MPI_Isend(FACE(1), 1, box->face[d], box->neighbour[d][0], 2 * d, comm, &requests[n++]);
+        MPI_Isend(FACE(last[d]), 1, box->face[d], box->neighbour[d][1], 2 * d + 1, comm, &requests[n++]);
+        #undef FACE
+    }
+    MPI_Waitall(n, requests, MPI_STATUSES_IGNORE);
+}
+
+// 7-point Jacobi sweep of planes first_plane..last_plane into Temperature, returns the largest change.
+// Blocked in rows and columns: each block goes through all the planes before the next one starts,
+// so the three planes of the block the stencil needs are still in cache when a plane is reused
+double sweep(struct box *box, double (*Temperature)[box->rows + 2][box->pitch],
+             double (*Temperature_last)[box->rows + 2][box->pitch], int first_plane, int last_plane)
+{
+    int k, i, j, ib, jb;
+    double dt = 0.0;
+
+    for (ib = 1; ib <= box->rows; ib += box->block_rows)
+    {
+        int ie = min(ib + box->block_rows - 1, box->rows);
+        for (jb = 1; jb <= box->columns; jb += box->block_columns)
+        {
+            int je = min(jb + box->block_columns - 1, box->columns);
+            for (k = first_plane; k <= last_plane; k++)
+            {
+                for (i = ib; i <= ie; i++)
+                {
+                    const double *restrict mid = Temperature_last[k][i];
+                    const double *restrict up = Temperature_last[k][i - 1];
+                    const double *restrict down = Temperature_last[k][i + 1];
+                    const double *restrict front = Temperature_last[k - 1][i];
+                    const double *restrict back = Temperature_last[k + 1][i];
+                    double *restrict row = Temperature[k][i];
+                    #pragma omp simd reduction(max:dt)
+                    for (j = jb; j <= je; j++)
+                    {
+                        row[j] = (1.0 / 6.0) * (down[j] + up[j] + mid[j + 1] + mid[j - 1] + front[j] + back[j]);
+                        double change = fabs(row[j] - mid[j]);
+                        dt = change > dt ? change : dt; // fmax would stay scalar without -ffast-math
+                    }
+                }
+            }
+        }
+    }
+    return dt;
+}
+
+// one tuning run: a sweep of Temperature_last into Temperature with the threads and block of the
+// knobs, the first iteration overwrites it
+double calibration_sweep(struct tune_knob *knobs, void *data)
+{
+    struct calibration *c = data;
+    struct box box = *c->box;
+    double(*Temperature)[box.rows + 2][box.pitch] = (double(*)[box.rows + 2][box.pitch])c->grid;
+    double(*Temperature_last)[box.rows + 2][box.pitch] = (double(*)[box.rows + 2][box.pitch])c->last;
+    double start = MPI_Wtime(), dt = 0.0;
+
+    box.block_rows = knobs[1].value;
+    box.block_columns = knobs[2].value;
+    #if defined(_OPENMP)
+    #pragma omp parallel num_threads(knobs[0].value) reduction(max:dt)
+    #endif
+    {
+        #if defined(_OPENMP)
+        int threads = omp_get_num_threads(), thread = omp_get_thread_num();
+        #else
+        int threads = 1, thread = 0;
+        #endif
+        int first = 1 + (int)((long)box.planes * thread / threads);
+        int last = (int)((long)box.planes * (thread + 1) / threads);
+        dt = sweep(&box, Temperature, Temperature_last, first, last);
+    }
+    (void)dt;
+    return MPI_Wtime() - start;
+}
@@ -0,0 +1,299 @@
+#if defined(_OPENMP)
+#include "omp.h"
+#endif
+
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <assert.h>
+
+#include "laplace.h"
+#include "laplaceio.h"
+#include "../common/trace.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define rank_zero_only(statement) \
+    do                            \
+    {                             \
+        if (rank == 0)            \
+            statement;           \
+    } while (0);
+
+
+#define HYPER 2    // enable hyperthreading
+#define QUIET_SWEEPS 10 // local sweeps in a row below MAX_TEMP_ERROR before a rank votes to stop
+
+// default size of plate
+#define COLUMNS 10000
+#define ROWS 10000
+
+// largest permitted change in temp (This value takes about 3400 steps)
+#define MAX_TEMP_ERROR 0.01
+
+// memory traffic and flops per cell of one sweep, for the roofline (TRACE_ROOFLINE=1)
+#define CELL_BYTES 16.0 // the stencil reads one grid and writes the other, dt finds the row still in cache
+#define CELL_FLOPS 5.0  // 3 adds and a multiply of the stencil, the difference for dt
+
+// helper routines
+double sweep(int columns, int pitch, double (*Temperature)[pitch], double (*Temperature_last)[pitch],
+             int range_row, int local_cores, laplace_row_fn stencil);
+
+void publish(int columns, int pitch, double (*Temperature)[pitch], int range_row, int rank, int last_rank, MPI_Win win);
+
+void take_ghosts(int columns, int pitch, double (*Temperature)[pitch], const double *ghost, int range_row, int rank, int last_rank, MPI_Win win);
+
+int main(int argc, char **argv)
+{
+
+    int iteration = 0;                                  // my local sweeps
+    double dt = 100;                                    // largest chaneg in t
+    struct timeval start_time, stop_time, elapsed_time; // timers
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 4000, .progress = 100};
+    struct laplace_io output = {.active = 0};           // final field
+
+    int rank, size, error, last_rank;
+    double start;
+    MPI_Comm comm = MPI_COMM_WORLD;
+
+    error = MPI_Init(NULL, NULL);
+    assert(error == MPI_SUCCESS);
+
+    // Get process ID
+    MPI_Comm_rank(comm, &rank);
+    trace_init(rank);
+
+    // Get processes Number
+    MPI_Comm_size(comm, &size);
+
+    // every rank parses the same arguments, only rank 0 reports problems
+    int status = laplace_configure(argc, argv, &config, rank == 0);
+    if (status != 0)
+    {
+        MPI_Finalize();
+        return status < 0;
+    }
+    int rows = config.rows, columns = config.columns;
+    laplace_row_fn stencil = laplace_row_kernel(columns);
+
+    #if defined(_OPENMP)
+    int total_cores = omp_get_num_procs()*HYPER;
+    int local_cores = total_cores > size ? total_cores / size : 1;
+    rank_zero_only(printf("Openmp total_cores: %d local_cores: %d\n", total_cores, local_cores));
+    #else
+    int local_cores = 1;
+    #endif
+
+    int PART_ROW = (rows + size - 1) / size;
+    int start_row = rank * PART_ROW;
+    int stop_row = min((rank + 1) * PART_ROW, rows);
+    int range_row = stop_row - start_row;
+    last_rank = (rank == (size - 1));
+    int pitch = laplace_pitch(columns + 2, sizeof(double)); // padded row length
+
+    double(*Temperature_last)[pitch] = laplace_alloc(range_row + 2, pitch, sizeof(double), local_cores, config.huge_pages); // temperature grid from last iteration
+    double(*Temperature)[pitch] = laplace_alloc(range_row + 2, pitch, sizeof(double), local_cores, config.huge_pages);      // temperature grid
+    if (Temperature == NULL || Temperature_last == NULL)
+    {
+        printf("Rank %d cannot allocate the grids of its %d x %d slab\n", rank, range_row, columns);
+        MPI_Abort(comm, 1);
+    }
+
+    // the neighbours put their boundary rows here whenever they have new ones:
+    // the row above my slab, then the row below it
+    double *ghost;
+    MPI_Win win;
+    MPI_Win_allocate(sizeof(double) * 2 * columns, sizeof(double), MPI_INFO_NULL, comm, &ghost, &win);
+    memset(ghost, 0, sizeof(double) * 2 * columns);
+    MPI_Barrier(comm);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+
+    gettimeofday(&start_time, NULL); // Unix timer
+
+    laplace_initialize(rows, columns, pitch, Temperature_last, range_row, start_row, last_rank);
+    laplace_initialize(rows, columns, pitch, Temperature, range_row, start_row, last_rank);
+
+    int quiet = 0;            // my sweeps in a row below the tolerance
+    int vote, votes;          // stop votes, combined with MPI_MIN in the background
+    int voting = 0;           // a vote is in flight
+    int checks = 0, polls = 0;
+    MPI_Request request;
+
+    if (!config.quiet)
+        printf("This is rank %d, world_size: %d max_iter: %d\n", rank, size, config.max_iterations);
+
+    // Every rank sweeps at its own pace with the latest ghost rows it has, and publishes its own
+    // boundary rows with MPI_Put after each sweep, nobody waits for a neighbour. Termination: a rank
+    // votes to stop once QUIET_SWEEPS sweeps in a row changed it by less than the tolerance (or it
+    // reached the iteration cap), the votes are combined by an MPI_Iallreduce that is polled between
+    // sweeps. A unanimous vote only means every rank was quiet at some point, so it is followed by a
+    // synchronous check: all puts are completed, and one more sweep on the consistent plate must
+    // change it by less than the tolerance everywhere, which is the stopping test of plain Jacobi.
+    // Otherwise the ranks go on asynchronously.
+    while (1)
+    {
+        take_ghosts(columns, pitch, Temperature_last, ghost, range_row, rank, last_rank, win);
+        dt = sweep(columns, pitch, Temperature, Temperature_last, range_row, local_cores, stencil);
+        double(*swap)[pitch] = Temperature;
+        Temperature = Temperature_last;
+        Temperature_last = swap;
+        iteration++;
+        publish(columns, pitch, Temperature_last, range_row, rank, last_rank, win);
+
+        // periodically print test values
+        if (last_rank && config.progress && iteration % config.progress == 0)
+        {
+            laplace_track_progress(columns, pitch, Temperature_last, iteration, range_row, start_row);
+        }
+
+        quiet = dt <= config.max_temp_error ? quiet + 1 : 0;
+        trace_begin(TRACE_REDUCE);
+        if (!voting)
+        {
+            vote = quiet >= QUIET_SWEEPS || iteration >= config.max_iterations;
+            MPI_Iallreduce(&vote, &votes, 1, MPI_INT, MPI_MIN, comm, &request);
+            trace_end(TRACE_REDUCE);
+            voting = 1;
+            polls++;
+            continue;
+        }
+        MPI_Test(&request, &voting, MPI_STATUS_IGNORE);
+        trace_end(TRACE_REDUCE);
+        voting = !voting;
+        if (voting || !votes)
+        {
+            continue;
+        }
+
+        // everybody voted to stop: one synchronous Jacobi sweep decides
+        checks++;
+        trace_begin(TRACE_HALO);
+        MPI_Win_flush_all(win);
+        MPI_Barrier(comm);
+        trace_end(TRACE_HALO);
+        take_ghosts(columns, pitch, Temperature_last, ghost, range_row, rank, last_rank, win);
+        dt = sweep(columns, pitch, Temperature, Temperature_last, range_row, local_cores, stencil);
+        swap = Temperature;
+        Temperature = Temperature_last;
+        Temperature_last = swap;
+        iteration++;
+
+        int capped = iteration >= config.max_iterations, any_capped;
+        double temp = dt;
+        trace_begin(TRACE_REDUCE);
+        MPI_Allreduce(&temp, &dt, 1, MPI_DOUBLE, MPI_MAX, comm);
+        MPI_Allreduce(&capped, &any_capped, 1, MPI_INT, MPI_MAX, comm);
+        trace_end(TRACE_REDUCE);
+        if (dt <= config.max_temp_error || any_capped)
+        {
+            break;
+        }
+        // still moving somewhere, back to the asynchronous sweeps; nobody reads the ghost
+        // window before the last flush of the neighbours
+        publish(columns, pitch, Temperature_last, range_row, rank, last_rank, win);
+        trace_begin(TRACE_HALO);
+        MPI_Win_flush_all(win);
+        MPI_Barrier(comm);
+        trace_end(TRACE_HALO);
+        quiet = 0;
+    }
+    MPI_Win_unlock_all(win);
+
+    gettimeofday(&stop_time, NULL); // Unix timer
+    timersub(&stop_time, &start_time,
+             &elapsed_time); // Unix timer substraction routine
+
+    int fewest, most;
+    MPI_Reduce(&iteration, &fewest, 1, MPI_INT, MPI_MIN, 0, comm);
+    MPI_Reduce(&iteration, &most, 1, MPI_INT, MPI_MAX, 0, comm);
+    rank_zero_only(printf("\nSweeps per rank: %d to %d, %d votes, %d synchronous checks\n", fewest, most, polls, checks));
+    rank_zero_only(printf("Max error of the final synchronous sweep was %f\n", dt));
+    rank_zero_only(printf("Total time was %f seconds\n",
+           elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0)));
+
+    if (config.output != NULL)
+    {
+        trace_begin(TRACE_IO);
+        start = MPI_Wtime();
+        if (laplace_write_start(&output, config.output, most, dt, rows, columns, pitch,
+                                &Temperature_last[0][0], range_row, start_row, comm) != 0)
+        {
+            rank_zero_only(printf("Cannot write %s\n", config.output));
+        }
+        laplace_write_wait(&output, comm);
+        trace_end(TRACE_IO);
+        rank_zero_only(printf("Field written to %s in %f seconds\n", config.output, MPI_Wtime() - start));
+    }
+
+    trace_finish();
+    MPI_Win_free(&win);
+    MPI_Finalize();
+    free(Temperature);
+    free(Temperature_last);
+
+    return 0;
+}
+
+// one Jacobi sweep of my slab into Temperature, returns my largest change
+double sweep(int columns, int pitch, double (*Temperature)[pitch], double (*Temperature_last)[pitch],
+             int range_row, int local_cores, laplace_row_fn stencil)
+{
+    int i, j;
+    double dt = 0.0;
+
+    trace_begin(TRACE_COMPUTE);
+    #if defined(_OPENMP)
+    #pragma omp parallel for num_threads(local_cores) schedule(static) private(j) reduction(max:dt)
+    #else
+    (void)local_cores;
+    #endif
+    for (i = 1; i <= range_row; i++)
+    {
+        stencil(Temperature[i], Temperature_last[i], pitch, columns);
+        for (j = 1; j <= columns; j++)
+        {
+            dt = fmax(fabs(Temperature[i][j] - Temperature_last[i][j]), dt);
+        }
+    }
+    trace_work(TRACE_COMPUTE, CELL_BYTES * range_row * columns, CELL_FLOPS * range_row * columns);
+    trace_end(TRACE_COMPUTE);
+    return dt;
+}
+
+// put my first row into the lower ghost row of the previous rank and my last row into the upper
+// ghost row of the next one; the puts complete locally, so the rows may change right after
+void publish(int columns, int pitch, double (*Temperature)[pitch], int range_row, int rank, int last_rank, MPI_Win win)
+{
+    trace_begin(TRACE_HALO);
+    if (rank > 0)
+    {
+        MPI_Put(&Temperature[1][1], columns, MPI_DOUBLE, rank - 1, columns, columns, MPI_DOUBLE, win);
+        MPI_Win_flush_local(rank - 1, win);
+    }
+    if (!last_rank)
+    {
+        MPI_Put(&Temperature[range_row][1], columns, MPI_DOUBLE, rank + 1, 0, columns, MPI_DOUBLE, win);
+        MPI_Win_flush_local(rank + 1, win);
+    }
+    trace_end(TRACE_HALO);
+}
+
+// copy the latest rows the neighbours put into my window into the ghost rows of the grid; a row
+// that is being overwritten right now mixes two of their sweeps, which asynchronous relaxation allows
+void take_ghosts(int columns, int pitch, double (*Temperature)[pitch], const double *ghost, int range_row, int rank, int last_rank, MPI_Win win)
+{
+    trace_begin(TRACE_HALO);
+    MPI_Win_sync(win);
+    if (rank > 0)
+    {
+        memcpy(&Temperature[0][1], ghost, sizeof(double) * columns);
+    }
+    if (!last_rank)
+    {
+        memcpy(&Temperature[range_row + 1][1], ghost + columns, sizeof(double) * columns);
+    }
+    trace_end(TRACE_HALO);
+}
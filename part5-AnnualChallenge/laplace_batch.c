@@ -0,0 +1,367 @@
+#if defined(_OPENMP)
+#include "omp.h"
+#endif
+
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "laplace.h"
+#include "../common/trace.h"
+
+#define rank_zero_only(statement) \
+    do                            \
+    {                             \
+        if (rank == 0)            \
+            statement;           \
+    } while (0);
+
+
+#define HYPER 2      // enable hyperthreading
+#define LANES 8      // plates advanced by one sweep, one AVX-512 vector (two AVX2 ones) of doubles
+#define BATCH_PLATES 32 // plates of the built-in sweep when no plate file is given
+
+// default size of plate
+#define COLUMNS 1000
+#define ROWS    1000
+
+// largest permitted change in temp (This value takes about 3400 steps)
+#define MAX_TEMP_ERROR 0.01
+
+// memory traffic and flops per cell and lane of one sweep, for the roofline (TRACE_ROOFLINE=1)
+#define CELL_BYTES 16.0 // the stencil reads one grid and writes the other, dt finds the row still in cache
+#define CELL_FLOPS 5.0  // 3 adds and a multiply of the stencil, the difference for dt
+
+// boundary conditions of one plate: every edge is a linear ramp, value = from + (to - from) * k / n
+// along it, k the row (left, right) or column (top, bottom) and n the rows or columns;
+// laplace_serial's plate is left 0 0, right 0 100, top 0 0, bottom 0 100
+struct plate
+{
+    double left[2], right[2], top[2], bottom[2];
+};
+
+// what is kept of a converged plate
+struct result
+{
+    double iterations, dt, corner; // corner: bottom right cell, where track_progress looks
+};
+
+// one thread's plates, lane p of cell [i][j] is element (i * pitch + j * LANES + p)
+struct pack
+{
+    double *grid[2];     // toggled, sweeps read grid[current]
+    int current;
+    int plate[LANES];    // plate in each lane, -1 for an empty lane
+    int iterations[LANES];
+};
+
+int read_plates(const char *path, struct plate **plates);
+void sweep_plates(int rows, int columns, struct plate **plates);
+void load_plate(int rows, int columns, int pitch, struct pack *pack, int lane, const struct plate *plate);
+int refill(int rows, int columns, int pitch, struct pack *pack, int lane, const struct plate *plates,
+           int *next, int mine, int rank, int size);
+void sweep(int rows, int columns, int pitch, double *restrict out, const double *restrict in, double *restrict dt);
+
+int main(int argc, char **argv)
+{
+    struct timeval start_time, stop_time, elapsed_time; // timers
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 4000, .progress = 100};
+    struct plate *plates;
+    int rank, size, error, count;
+
+    error = MPI_Init(NULL, NULL);
+    assert(error == MPI_SUCCESS);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    trace_init(rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // every rank parses the same arguments, only rank 0 reports problems
+    int status = laplace_configure(argc, argv, &config, rank == 0);
+    if (status != 0)
+    {
+        rank_zero_only(printf("Batch: %s [options] [PLATES], PLATES has one plate per line:\n"
+                              "  left_from left_to right_from right_to top_from top_to bottom_from bottom_to\n", argv[0]));
+        MPI_Finalize();
+        return status < 0;
+    }
+    int rows = config.rows, columns = config.columns;
+
+    // the plate list is the first argument that is not an option, a built-in sweep otherwise
+    if (optind < argc)
+    {
+        count = read_plates(argv[optind], &plates);
+        if (count <= 0)
+        {
+            rank_zero_only(printf("No plates in %s\n", argv[optind]));
+            MPI_Finalize();
+            return 1;
+        }
+    }
+    else
+    {
+        count = BATCH_PLATES;
+        sweep_plates(rows, columns, &plates);
+    }
+
+    // plates go round robin over the ranks, the threads of a rank take them from a shared queue
+    int mine = (count - rank + size - 1) / size;
+    int packs = (mine + LANES - 1) / LANES;
+    #if defined(_OPENMP)
+    int total_cores = omp_get_num_procs()*HYPER;
+    int local_cores = total_cores > size ? total_cores / size : 1;
+    #else
+    int local_cores = 1;
+    #endif
+    int threads = packs < local_cores ? (packs > 0 ? packs : 1) : local_cores;
+    int pitch = laplace_pitch((columns + 2) * LANES, sizeof(double)); // padded row length
+    rank_zero_only(printf("%d plates of %d x %d, %d lanes per sweep, %d ranks x %d threads\n",
+                          count, rows, columns, LANES, size, threads));
+
+    struct result *results = (struct result *)calloc(count, sizeof(struct result));
+    struct result *all = (struct result *)calloc(count, sizeof(struct result));
+    int next = 0; // my next plate to start, plate rank + next * size
+    long sweeps = 0;
+
+    gettimeofday(&start_time, NULL); // Unix timer
+
+    #if defined(_OPENMP)
+    #pragma omp parallel num_threads(threads) reduction(+:sweeps)
+    #endif
+    {
+        struct pack pack;
+        double dt[LANES];
+        int p, active = 0;
+
+        // each thread first touches and owns its pack
+        pack.grid[0] = laplace_alloc(rows + 2, pitch, sizeof(double), 1, config.huge_pages);
+        pack.grid[1] = laplace_alloc(rows + 2, pitch, sizeof(double), 1, config.huge_pages);
+        if (pack.grid[0] == NULL || pack.grid[1] == NULL)
+        {
+            printf("Rank %d cannot allocate the grids of a pack\n", rank);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        pack.current = 0;
+
+        for (p = 0; p < LANES; p++)
+        {
+            active += refill(rows, columns, pitch, &pack, p, plates, &next, mine, rank, size);
+        }
+
+        while (active > 0)
+        {
+            double *in = pack.grid[pack.current], *out = pack.grid[1 - pack.current];
+            trace_begin(TRACE_COMPUTE);
+            sweep(rows, columns, pitch, out, in, dt);
+            trace_work(TRACE_COMPUTE, CELL_BYTES * LANES * rows * columns, CELL_FLOPS * LANES * rows * columns);
+            trace_end(TRACE_COMPUTE);
+            pack.current = 1 - pack.current;
+            sweeps++;
+
+            // retire every plate as soon as it has converged, the same test as laplace_serial
+            for (p = 0; p < LANES; p++)
+            {
+                if (pack.plate[p] < 0)
+                {
+                    continue;
+                }
+                pack.iterations[p]++;
+                if (dt[p] > config.max_temp_error && pack.iterations[p] < config.max_iterations)
+                {
+                    continue;
+                }
+                struct result *result = &results[pack.plate[p]];
+                result->iterations = pack.iterations[p];
+                result->dt = dt[p];
+                result->corner = out[(size_t)rows * pitch + columns * LANES + p];
+                if (!config.quiet)
+                {
+                    printf("plate %d: %d iterations, dt %f, corner %f\n", pack.plate[p], pack.iterations[p], dt[p], result->corner);
+                }
+                active--;
+                active += refill(rows, columns, pitch, &pack, p, plates, &next, mine, rank, size);
+            }
+        }
+
+        free(pack.grid[0]);
+        free(pack.grid[1]);
+    }
+
+    // every plate has exactly one owner, the others leave it zero
+    trace_begin(TRACE_REDUCE);
+    MPI_Reduce(results, all, 3 * count, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    long sweeps_all;
+    MPI_Reduce(&sweeps, &sweeps_all, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    trace_end(TRACE_REDUCE);
+
+    gettimeofday(&stop_time, NULL); // Unix timer
+    timersub(&stop_time, &start_time, &elapsed_time); // Unix timer substraction routine
+    double seconds = elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0);
+
+    if (rank == 0)
+    {
+        double iterations = 0.0;
+        int p;
+        printf("\nplate  iterations        dt    corner\n");
+        for (p = 0; p < count; p++)
+        {
+            printf("%5d %11.0f %9f %9f\n", p, all[p].iterations, all[p].dt, all[p].corner);
+            iterations += all[p].iterations;
+        }
+        // lanes whose plate had converged or that had none left still went through the sweeps
+        printf("\nLane occupancy: %.1f%%\n", 100.0 * iterations / ((double)sweeps_all * LANES));
+        printf("Total time was %f seconds\n", seconds);
+        printf("Throughput: %.1f plates per hour\n", count * 3600.0 / seconds);
+    }
+
+    trace_finish();
+    MPI_Finalize();
+    free(results);
+    free(all);
+    free(plates);
+    return 0;
+}
+
+// one plate per line, 8 numbers, # starts a comment; returns the number of plates, -1 on an error
+int read_plates(const char *path, struct plate **plates)
+{
+    char line[256];
+    int count = 0, allocated = 16;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        return -1;
+    }
+    *plates = (struct plate *)malloc(sizeof(struct plate) * allocated);
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        struct plate plate;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+        int n = sscanf(line, "%lf %lf %lf %lf %lf %lf %lf %lf", &plate.left[0], &plate.left[1], &plate.right[0], &plate.right[1],
+                       &plate.top[0], &plate.top[1], &plate.bottom[0], &plate.bottom[1]);
+        if (n <= 0)
+        {
+            continue;
+        }
+        if (n != 8)
+        {
+            fclose(file);
+            return -1;
+        }
+        if (count == allocated)
+        {
+            allocated *= 2;
+            *plates = (struct plate *)realloc(*plates, sizeof(struct plate) * allocated);
+        }
+        (*plates)[count++] = plate;
+    }
+    fclose(file);
+    return count;
+}
+
+// built-in sweep: the plate of laplace_serial with the right side ramping up to 100 (p + 1) / BATCH_PLATES,
+// the last plate is laplace_serial's own
+void sweep_plates(int rows, int columns, struct plate **plates)
+{
+    int p;
+    (void)rows;
+    (void)columns;
+    *plates = (struct plate *)calloc(BATCH_PLATES, sizeof(struct plate));
+    for (p = 0; p < BATCH_PLATES; p++)
+    {
+        (*plates)[p].right[1] = 100.0 * (p + 1) / BATCH_PLATES;
+        (*plates)[p].bottom[1] = 100.0;
+    }
+}
+
+// put a plate into one lane of both grids: zero inside, its ramps on the boundary,
+// laid out as initialize() in laplace_serial.c does it
+void load_plate(int rows, int columns, int pitch, struct pack *pack, int lane, const struct plate *plate)
+{
+    int g, i, j;
+
+    for (g = 0; g < 2; g++)
+    {
+        double *grid = pack->grid[g];
+        #define AT(i, j) grid[(size_t)(i) * pitch + (j) * LANES + lane]
+        for (i = 1; i <= rows; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                AT(i, j) = 0.0;
+            }
+        }
+        for (i = 0; i <= rows + 1; i++)
+        {
+            AT(i, 0) = plate->left[0] + (plate->left[1] - plate->left[0]) / rows * i;
+            AT(i, columns + 1) = plate->right[0] + (plate->right[1] - plate->right[0]) / rows * i;
+        }
+        for (j = 0; j <= columns + 1; j++)
+        {
+            AT(0, j) = plate->top[0] + (plate->top[1] - plate->top[0]) / columns * j;
+            AT(rows + 1, j) = plate->bottom[0] + (plate->bottom[1] - plate->bottom[0]) / columns * j;
+        }
+        #undef AT
+    }
+}
+
+// a lane that is empty or whose plate converged takes the next of my plates from the queue
+// shared by the threads, returns 1 if there was one left, 0 if the lane stays empty
+int refill(int rows, int columns, int pitch, struct pack *pack, int lane, const struct plate *plates,
+           int *next, int mine, int rank, int size)
+{
+    int taken;
+
+    #pragma omp atomic capture
+    taken = (*next)++;
+
+    pack->iterations[lane] = 0;
+    if (taken >= mine)
+    {
+        pack->plate[lane] = -1;
+        return 0;
+    }
+    pack->plate[lane] = rank + taken * size;
+    load_plate(rows, columns, pitch, pack, lane, &plates[pack->plate[lane]]);
+    return 1;
+}
+
+// one Jacobi sweep of all lanes, dt gets the largest change of every lane;
+// the lanes of a cell are adjacent, so the inner loop is one vector per cell
+void sweep(int rows, int columns, int pitch, double *restrict out, const double *restrict in, double *restrict dt)
+{
+    double change[LANES] = {0.0};
+    int i, j, p;
+
+    for (i = 1; i <= rows; i++)
+    {
+        const double *restrict up = in + (size_t)(i - 1) * pitch;
+        const double *restrict mid = in + (size_t)i * pitch;
+        const double *restrict down = in + (size_t)(i + 1) * pitch;
+        double *restrict row = out + (size_t)i * pitch;
+        for (j = LANES; j <= columns * LANES; j += LANES)
+        {
+            #pragma omp simd
+            for (p = 0; p < LANES; p++)
+            {
+                row[j + p] = 0.25 * (down[j + p] + up[j + p] + mid[j + p + LANES] + mid[j + p - LANES]);
+                double d = fabs(row[j + p] - mid[j + p]);
+                change[p] = d > change[p] ? d : change[p]; // fmax would stay scalar without -ffast-math
+            }
+        }
+    }
+    for (p = 0; p < LANES; p++)
+    {
+        dt[p] = change[p];
+    }
+}
@@ -0,0 +1,531 @@
+#if defined(_OPENMP)
+#include "omp.h"
+#endif
+
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <assert.h>
+
+#include "laplace.h"
+#include "laplaceio.h"
+#include "../common/halo.h"
+#include "../common/trace.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define rank_zero_only(statement) \
+    do                            \
+    {                             \
+        if (rank == 0)            \
+            statement;           \
+    } while (0);
+
+#define JACOBI 0
+#define SSOR 1
+
+#define TIMING 1              // Timing macro
+#define PRECONDITIONER SSOR   // JACOBI (diagonal) or SSOR (red-black, local to each rank)
+#define SSOR_OMEGA 1.0        // relaxation factor of the SSOR preconditioner
+#define PIPELINED 1           // pipelined CG, one MPI_Iallreduce per iteration hidden behind M^-1 and A
+
+// default size of plate
+#define COLUMNS 10000
+#define ROWS 10000
+
+// largest permitted change in temp (This value takes about 3400 steps)
+// here: the largest change one more Jacobi sweep would make, i.e. max |residual| / 4
+#define MAX_TEMP_ERROR 0.01
+
+// memory traffic and flops per cell of one iteration, for the roofline (TRACE_ROOFLINE=1);
+// reads and writes of memory as STREAM counts them, neighbour rows that stay in cache are free
+#if PRECONDITIONER == SSOR
+#define PRECONDITION_BYTES 104.0 // z is zeroed, then four half-sweeps read r and z and write z back
+#define PRECONDITION_FLOPS 14.0  // 7 of an update, every cell is updated twice
+#else
+#define PRECONDITION_BYTES 16.0
+#define PRECONDITION_FLOPS 1.0
+#endif
+#if PIPELINED
+#define CELL_BYTES (184.0 + PRECONDITION_BYTES) // the dot products read r, z and w, A m reads m and writes n,
+                                                // the fused recurrences read ten vectors and write eight
+#define CELL_FLOPS (27.0 + PRECONDITION_FLOPS)
+#else
+#define CELL_BYTES (120.0 + PRECONDITION_BYTES) // A p, (p,q), the updates of x and r, (r,z) and the new p
+#define CELL_FLOPS (17.0 + PRECONDITION_FLOPS)
+#endif
+
+// helper routines
+void *new_grid(int range_row, int pitch, int huge_pages);
+
+double residual(int columns, int pitch, double (*r)[pitch], double (*Temperature)[pitch], int range_row);
+
+void laplacian(int columns, int pitch, double (*q)[pitch], double (*p)[pitch], int range_row);
+
+void precondition(int columns, int pitch, double (*z)[pitch], double (*r)[pitch], int range_row, int start_row);
+
+void sum_sum_max(void *in, void *inout, int *len, MPI_Datatype *type);
+
+int main(int argc, char **argv)
+{
+
+    int i, j;                                           // grid indexes
+    int iteration = 1;                                  // current iteration
+    double dt = 100;                                    // largest scaled residual
+    struct timeval start_time, stop_time, elapsed_time; // timers
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 4000, .progress = 100};
+
+    int rank, size, error, last_rank;
+    double start, end, duration, temp;
+    double alpha, beta, gamma_old = 0.0, alpha_old = 0.0;
+    double rz, second, rmax;                            // local (r,z), second dot product and max |r| / 4
+    double local[3], global[3];                         // the three of them packed for the reduction
+    MPI_Comm comm = MPI_COMM_WORLD;
+    MPI_Op reduce_op;
+
+    error = MPI_Init(NULL, NULL);
+    assert(error == MPI_SUCCESS);
+
+    // Get process ID
+    MPI_Comm_rank(comm, &rank);
+    trace_init(rank);
+
+    // Get processes Number
+    MPI_Comm_size(comm, &size);
+
+    // both dot products and the residual norm in a single reduction
+    MPI_Op_create(sum_sum_max, 1, &reduce_op);
+
+    // every rank parses the same arguments, only rank 0 reports problems
+    int status = laplace_configure(argc, argv, &config, rank == 0);
+    if (status != 0)
+    {
+        MPI_Op_free(&reduce_op);
+        MPI_Finalize();
+        return status < 0;
+    }
+    int rows = config.rows, columns = config.columns;
+
+    int PART_ROW = (rows + size - 1) / size;
+    int start_row = rank * PART_ROW;
+    int stop_row = min((rank + 1) * PART_ROW, rows);
+    int range_row = stop_row - start_row;
+    last_rank = (rank == (size - 1));
+    int pitch = laplace_pitch(columns + 2, sizeof(double)); // padded row length
+
+    // one grid sized vector of the slab with a ghost frame, ghost values are zero or halos
+    typedef double (*grid_t)[pitch];
+
+    grid_t Temperature = new_grid(range_row, pitch, config.huge_pages); // temperature grid, the CG iterate x
+    grid_t r = new_grid(range_row, pitch, config.huge_pages);           // residual b - A x
+    grid_t z = new_grid(range_row, pitch, config.huge_pages);           // preconditioned residual M^-1 r (u in the pipelined method)
+    grid_t p = new_grid(range_row, pitch, config.huge_pages);           // search direction
+    grid_t q = new_grid(range_row, pitch, config.huge_pages);           // A p
+    #if PIPELINED
+    grid_t w = new_grid(range_row, pitch, config.huge_pages);           // A u
+    grid_t m = new_grid(range_row, pitch, config.huge_pages);           // M^-1 w
+    grid_t n = new_grid(range_row, pitch, config.huge_pages);           // A m
+    grid_t s = new_grid(range_row, pitch, config.huge_pages);           // A p kept by recurrence (q holds M^-1 s)
+    grid_t y = new_grid(range_row, pitch, config.huge_pages);           // A q
+    MPI_Request reduce_req;
+    #endif
+
+    // one halo exchange for each grid that needs ghost rows, HALO picks the back-end
+    struct halo x_halo;
+    laplace_halo_create(&x_halo, Temperature, pitch, columns, range_row, MPI_DOUBLE, comm);
+    #if PIPELINED
+    struct halo z_halo, m_halo;
+    laplace_halo_create(&z_halo, z, pitch, columns, range_row, MPI_DOUBLE, comm);
+    laplace_halo_create(&m_halo, m, pitch, columns, range_row, MPI_DOUBLE, comm);
+    #else
+    struct halo p_halo;
+    laplace_halo_create(&p_halo, p, pitch, columns, range_row, MPI_DOUBLE, comm);
+    #endif
+    rank_zero_only(printf("Halo exchange: %s\n", halo_method_name(x_halo.method)));
+
+    gettimeofday(&start_time, NULL); // Unix timer
+
+    laplace_initialize(rows, columns, pitch, Temperature,
+                       range_row, start_row, last_rank); // initialize Temperature including boundary conditions
+    rank_zero_only(printf("Preconditioner: %s, %s CG\n", PRECONDITIONER == SSOR ? "SSOR" : "Jacobi",
+                          PIPELINED ? "pipelined" : "classic"));
+
+    // the boundary values are the right hand side: r = b - A x is the 5-point residual of the plate
+    halo_exchange(&x_halo);
+    residual(columns, pitch, r, Temperature, range_row);
+    precondition(columns, pitch, z, r, range_row, start_row);
+    #if PIPELINED
+    halo_exchange(&z_halo);
+    laplacian(columns, pitch, w, z, range_row);
+    #else
+    memcpy(p, z, sizeof(double) * (range_row + 2) * pitch);
+    rz = rmax = 0.0;
+    #if defined(_OPENMP)
+    #pragma omp parallel for private(j) reduction(+:rz) reduction(max:rmax)
+    #endif
+    for (i = 1; i <= range_row; i++)
+    {
+        for (j = 1; j <= columns; j++)
+        {
+            rz += r[i][j] * z[i][j];
+            rmax = fmax(fabs(r[i][j]) * 0.25, rmax);
+        }
+    }
+    local[0] = rz;
+    local[1] = 0.0;
+    local[2] = rmax;
+    MPI_Allreduce(local, global, 3, MPI_DOUBLE, reduce_op, comm);
+    dt = global[2];
+    #endif
+
+    if (!config.quiet)
+        printf("This is rank %d, world_size: %d max_iter: %d\n", rank, size, config.max_iterations);
+    // do util error is minimal of until max steps
+    while (iteration <= config.max_iterations)
+    {
+        #if TIMING
+        start = MPI_Wtime();
+        #endif
+
+        #if PIPELINED
+        // gamma = (r,u), delta = (w,u) and the residual norm in one nonblocking reduction,
+        // overlapped with the preconditioner and the matrix-vector product
+        trace_begin(TRACE_COMPUTE);
+        rz = second = rmax = 0.0;
+        #if defined(_OPENMP)
+        #pragma omp parallel for private(j) reduction(+:rz, second) reduction(max:rmax)
+        #endif
+        for (i = 1; i <= range_row; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                rz += r[i][j] * z[i][j];
+                second += w[i][j] * z[i][j];
+                rmax = fmax(fabs(r[i][j]) * 0.25, rmax);
+            }
+        }
+        local[0] = rz;
+        local[1] = second;
+        local[2] = rmax;
+        trace_end(TRACE_COMPUTE);
+
+        trace_begin(TRACE_REDUCE);
+        MPI_Iallreduce(local, global, 3, MPI_DOUBLE, reduce_op, comm, &reduce_req);
+        trace_end(TRACE_REDUCE);
+
+        trace_begin(TRACE_COMPUTE);
+        precondition(columns, pitch, m, w, range_row, start_row);
+        trace_end(TRACE_COMPUTE);
+        trace_begin(TRACE_HALO);
+        halo_exchange(&m_halo);
+        trace_end(TRACE_HALO);
+        trace_begin(TRACE_COMPUTE);
+        laplacian(columns, pitch, n, m, range_row);
+        trace_end(TRACE_COMPUTE);
+
+        trace_begin(TRACE_REDUCE);
+        MPI_Wait(&reduce_req, MPI_STATUS_IGNORE);
+        trace_end(TRACE_REDUCE);
+        dt = global[2];
+        if (dt <= config.max_temp_error)
+        {
+            break;
+        }
+        if (iteration == 1)
+        {
+            beta = 0.0;
+            alpha = global[0] / global[1];
+        }
+        else
+        {
+            beta = global[0] / gamma_old;
+            alpha = global[0] / (global[1] - beta * global[0] / alpha_old);
+        }
+        gamma_old = global[0];
+        alpha_old = alpha;
+
+        // all recurrences fused into one pass over the grids
+        trace_begin(TRACE_COMPUTE);
+        #if defined(_OPENMP)
+        #pragma omp parallel for private(j)
+        #endif
+        for (i = 1; i <= range_row; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                y[i][j] = n[i][j] + beta * y[i][j];
+                q[i][j] = m[i][j] + beta * q[i][j];
+                s[i][j] = w[i][j] + beta * s[i][j];
+                p[i][j] = z[i][j] + beta * p[i][j];
+                Temperature[i][j] += alpha * p[i][j];
+                r[i][j] -= alpha * s[i][j];
+                z[i][j] -= alpha * q[i][j];
+                w[i][j] -= alpha * y[i][j];
+            }
+        }
+        trace_work(TRACE_COMPUTE, CELL_BYTES * range_row * columns, CELL_FLOPS * range_row * columns);
+        trace_end(TRACE_COMPUTE);
+        #else
+        if (dt <= config.max_temp_error)
+        {
+            break;
+        }
+        // q = A p, alpha = (r,z) / (p,q)
+        trace_begin(TRACE_HALO);
+        halo_exchange(&p_halo);
+        trace_end(TRACE_HALO);
+        trace_begin(TRACE_COMPUTE);
+        laplacian(columns, pitch, q, p, range_row);
+        second = 0.0;
+        #if defined(_OPENMP)
+        #pragma omp parallel for private(j) reduction(+:second)
+        #endif
+        for (i = 1; i <= range_row; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                second += p[i][j] * q[i][j];
+            }
+        }
+        trace_end(TRACE_COMPUTE);
+        trace_begin(TRACE_REDUCE);
+        MPI_Allreduce(&second, &temp, 1, MPI_DOUBLE, MPI_SUM, comm);
+        trace_end(TRACE_REDUCE);
+        gamma_old = global[0];
+        alpha = gamma_old / temp;
+
+        trace_begin(TRACE_COMPUTE);
+        #if defined(_OPENMP)
+        #pragma omp parallel for private(j)
+        #endif
+        for (i = 1; i <= range_row; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                Temperature[i][j] += alpha * p[i][j];
+                r[i][j] -= alpha * q[i][j];
+            }
+        }
+
+        // z = M^-1 r, (r,z) and the residual norm in one reduction
+        precondition(columns, pitch, z, r, range_row, start_row);
+        rz = rmax = 0.0;
+        #if defined(_OPENMP)
+        #pragma omp parallel for private(j) reduction(+:rz) reduction(max:rmax)
+        #endif
+        for (i = 1; i <= range_row; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                rz += r[i][j] * z[i][j];
+                rmax = fmax(fabs(r[i][j]) * 0.25, rmax);
+            }
+        }
+        local[0] = rz;
+        local[1] = 0.0;
+        local[2] = rmax;
+        trace_end(TRACE_COMPUTE);
+        trace_begin(TRACE_REDUCE);
+        MPI_Allreduce(local, global, 3, MPI_DOUBLE, reduce_op, comm);
+        trace_end(TRACE_REDUCE);
+        dt = global[2];
+        beta = global[0] / gamma_old;
+
+        trace_begin(TRACE_COMPUTE);
+        #if defined(_OPENMP)
+        #pragma omp parallel for private(j)
+        #endif
+        for (i = 1; i <= range_row; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                p[i][j] = z[i][j] + beta * p[i][j];
+            }
+        }
+        trace_work(TRACE_COMPUTE, CELL_BYTES * range_row * columns, CELL_FLOPS * range_row * columns);
+        trace_end(TRACE_COMPUTE);
+        #endif
+
+        #if TIMING
+        end = MPI_Wtime();
+        duration = end - start;
+        if (!config.quiet)
+        {
+            MPI_Allreduce(&duration, &temp, 1, MPI_DOUBLE, MPI_SUM, comm);
+            rank_zero_only(printf("iteration: %lf residual: %lf\n", temp/size, dt));
+        }
+        #endif
+
+        // periodically print test values
+        if (last_rank && config.progress && iteration % config.progress == 0)
+        {
+            laplace_track_progress(columns, pitch, Temperature, iteration, range_row, start_row);
+        }
+
+        iteration++;
+    }
+
+    // the recurrences drift from b - A x, report the true residual as well
+    halo_exchange(&x_halo);
+    temp = residual(columns, pitch, r, Temperature, range_row);
+    MPI_Allreduce(&temp, &duration, 1, MPI_DOUBLE, MPI_MAX, comm);
+
+    gettimeofday(&stop_time, NULL); // Unix timer
+    timersub(&stop_time, &start_time,
+             &elapsed_time); // Unix timer substraction routine
+
+    if (last_rank)
+    {
+        laplace_track_progress(columns, pitch, Temperature, iteration - 1, range_row, start_row);
+    }
+    rank_zero_only(printf("\nMax error at iteration %d was %f (true residual %f)\n", iteration - 1, dt, duration));
+    rank_zero_only(printf("Total time was %f seconds\n",
+           elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0)));
+
+    trace_finish();
+    MPI_Op_free(&reduce_op);
+    halo_free(&x_halo);
+    #if PIPELINED
+    halo_free(&z_halo);
+    halo_free(&m_halo);
+    #else
+    halo_free(&p_halo);
+    #endif
+    MPI_Finalize();
+    free(Temperature);
+    free(r);
+    free(z);
+    free(p);
+    free(q);
+    #if PIPELINED
+    free(w);
+    free(m);
+    free(n);
+    free(s);
+    free(y);
+    #endif
+
+    return 0;
+}
+
+// zeroed vector of the slab, ghost rows and columns stay zero unless halos are exchanged into it,
+// its pages are first touched by the threads that sweep the rows
+void *new_grid(int range_row, int pitch, int huge_pages)
+{
+    void *grid = laplace_alloc(range_row + 2, pitch, sizeof(double), 0, huge_pages);
+    if (grid == NULL)
+    {
+        printf("Cannot allocate a vector of %d rows\n", range_row);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return grid;
+}
+
+// r = b - A x, the boundary values of the plate act as b, returns max |r| / 4
+double residual(int columns, int pitch, double (*r)[pitch], double (*Temperature)[pitch], int range_row)
+{
+    int i, j;
+    double dt = 0.0;
+
+    #if defined(_OPENMP)
+    #pragma omp parallel for private(j) reduction(max:dt)
+    #endif
+    for (i = 1; i <= range_row; i++)
+    {
+        for (j = 1; j <= columns; j++)
+        {
+            r[i][j] = Temperature[i + 1][j] + Temperature[i - 1][j] +
+                      Temperature[i][j + 1] + Temperature[i][j - 1] - 4.0 * Temperature[i][j];
+            dt = fmax(fabs(r[i][j]) * 0.25, dt);
+        }
+    }
+    return dt;
+}
+
+// q = A p with the 5-point Laplacian, p needs up to date halos and zero boundary values
+void laplacian(int columns, int pitch, double (*q)[pitch], double (*p)[pitch], int range_row)
+{
+    int i, j;
+
+    #if defined(_OPENMP)
+    #pragma omp parallel for private(j)
+    #endif
+    for (i = 1; i <= range_row; i++)
+    {
+        for (j = 1; j <= columns; j++)
+        {
+            q[i][j] = 4.0 * p[i][j] - (p[i + 1][j] + p[i - 1][j] + p[i][j + 1] + p[i][j - 1]);
+        }
+    }
+}
+
+// z = M^-1 r
+// JACOBI: M is the diagonal 4
+// SSOR: one symmetric red-black Gauss-Seidel pass (red, black, black, red) from z = 0 on my rows only,
+// neighbouring ranks are not coupled so M stays symmetric and needs no communication
+void precondition(int columns, int pitch, double (*z)[pitch], double (*r)[pitch], int range_row, int start_row)
+{
+    int i, j;
+
+    #if PRECONDITIONER == SSOR
+    const int order[4] = {0, 1, 1, 0};
+    int half;
+
+    memset(z[0], 0, sizeof(double) * (columns + 2));
+    memset(z[range_row + 1], 0, sizeof(double) * (columns + 2));
+    #if defined(_OPENMP)
+    #pragma omp parallel for private(j)
+    #endif
+    for (i = 1; i <= range_row; i++)
+    {
+        for (j = 1; j <= columns; j++)
+        {
+            z[i][j] = 0.0;
+        }
+    }
+    for (half = 0; half < 4; half++)
+    {
+        int colour = order[half];
+        #if defined(_OPENMP)
+        #pragma omp parallel for private(j)
+        #endif
+        for (i = 1; i <= range_row; i++)
+        {
+            // colour is the parity of the global (row + column), first j of this colour
+            for (j = 1 + (i + start_row + 1 + colour) % 2; j <= columns; j += 2)
+            {
+                z[i][j] += SSOR_OMEGA * (0.25 * (r[i][j] + z[i + 1][j] + z[i - 1][j] + z[i][j + 1] + z[i][j - 1]) - z[i][j]);
+            }
+        }
+    }
+    #else
+    #if defined(_OPENMP)
+    #pragma omp parallel for private(j)
+    #endif
+    for (i = 1; i <= range_row; i++)
+    {
+        for (j = 1; j <= columns; j++)
+        {
+            z[i][j] = 0.25 * r[i][j];
+        }
+    }
+    #endif
+}
+
+// reduction of (dot product, dot product, norm): sum, sum, max
+void sum_sum_max(void *in, void *inout, int *len, MPI_Datatype *type)
+{
+    double *a = (double *)in;
+    double *b = (double *)inout;
+    int k;
+    (void)type; // MPI_DOUBLE, the signature of MPI_User_function
+    for (k = 0; k + 2 < *len; k += 3)
+    {
+        b[k] += a[k];
+        b[k + 1] += a[k + 1];
+        b[k + 2] = fmax(a[k + 2], b[k + 2]);
+    }
+}
@@ -6,9 +6,16 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/time.h>
 #include <assert.h>
 
+#include "laplace.h"
+#include "laplaceio.h"
+#include "../common/halo.h"
+#include "../common/trace.h"
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define rank_zero_only(statement) \
     do                            \
@@ -18,234 +25,421 @@
     } while (0);
 
 
-#define TIMING 1   // Timing macro
-#define NONBLOCK 1 // Non-block communication
 #define HYPER 2    // enable hyperthreading
+#define SNAPSHOT_PIXELS 512 // largest side of a snapshot frame
 
-// size of plate
+// red-black Gauss-Seidel / SOR instead of Jacobi (build with -DREDBLACK=1)
+#ifndef REDBLACK
+#define REDBLACK 0
+#endif
+// Jacobi on a single grid updated in place (build with -DSINGLE_GRID=1), the old values
+// the stencil still needs are kept in a few rolling row buffers per thread
+#ifndef SINGLE_GRID
+#define SINGLE_GRID 0
+#endif
+// grids in MPI-3 shared windows of the node (build with -DSHARED_HALO=1): neighbours on the same
+// node read each other's boundary rows in place, only off-node neighbours exchange messages
+#ifndef SHARED_HALO
+#define SHARED_HALO 0
+#endif
+#if SHARED_HALO && SINGLE_GRID
+#error "SHARED_HALO reads the rows of the neighbours in place, SINGLE_GRID overwrites them while they do"
+#endif
+#define CACHE_LINE 64 // bytes, rows of the shared grids start on cache lines
+// over-relaxation factor for REDBLACK, 1.0 is plain Gauss-Seidel, 0 estimates the optimum
+#ifndef OMEGA
+#define OMEGA 0.0
+#endif
+
+// default size of plate
 #define COLUMNS 10000
 #define ROWS 10000
 
 // largest permitted change in temp (This value takes about 3400 steps)
 #define MAX_TEMP_ERROR 0.01
 
+// warm-start cache key of the boundary conditions of initialize
+#define BOUNDARY "ramp100"
+
+// tuning cache key of the build
+#if REDBLACK
+#define PROGRAM "laplace_sor"
+#elif SINGLE_GRID
+#define PROGRAM "laplace_lean"
+#elif SHARED_HALO
+#define PROGRAM "laplace_shared"
+#else
+#define PROGRAM "laplace_horizon"
+#endif
+
+// memory traffic and flops per cell of one compute phase, for the roofline (TRACE_ROOFLINE=1);
+// reads and writes of memory as STREAM counts them, rows that stay in cache are free
+#if REDBLACK
+#define CELL_BYTES 16.0 // a half-sweep reads and writes back every cache line, though only half the cells change
+#define CELL_FLOPS 3.5  // 7 of an updated cell: 3 adds and 0.25 x of the average, the relaxed change and its addition
+#elif SINGLE_GRID
+#define CELL_BYTES 16.0 // read and written in place, the rolling buffers stay in cache
+#define CELL_FLOPS 5.0  // 3 adds and a multiply of the stencil, the difference for dt
+#elif SHARED_HALO
+#define CELL_BYTES 32.0 // the stencil reads one grid and writes the other, dt reads both
+#define CELL_FLOPS 5.0
+#else
+#define CELL_BYTES 40.0 // the stencil reads one grid and writes the other, the copy reads both and writes one
+#define CELL_FLOPS 5.0
+#endif
+
 // helper routines
-void initialize(double (*Temperature_last)[COLUMNS + 2],
-                int range_row, int start_row, int last_rank);
+double optimal_omega(int rows, int columns);
 
-void track_progress(double (*Temperature)[COLUMNS + 2], int iteration, int range_row, int start_row);
+double sweep_in_place(int columns, int pitch, double (*Temperature)[pitch], int range_row, double (*rolling)[pitch]);
+
+double sweep_colour(int columns, int pitch, double (*Temperature)[pitch], int range_row, int start_row,
+                    double omega, int colour, int threads);
+
+// what the calibration of the in-place sweeps needs
+struct solver_sweep
+{
+    int columns, pitch, range_row, start_row;
+    double omega;    // red-black
+    double *rolling; // single grid
+};
+
+double calibration_sweep(double *grid, int threads, void *data);
+
+void shared_neighbours(int rank, MPI_Comm comm, MPI_Comm *node, int *shared_up, int *shared_down);
+
+int shared_alloc(void **grids, MPI_Win *windows, int count, int range_row, int pitch, int threads,
+                 int shared_up, int shared_down, MPI_Comm node);
+
+void exchange_shared(int columns, int pitch, double (*Temperature)[pitch], int range_row, int rank, int last_rank,
+                     int shared_up, int shared_down, MPI_Win *windows, int count, MPI_Comm node, MPI_Comm comm);
 
 int main(int argc, char **argv)
 {
 
+    #if !REDBLACK && !SINGLE_GRID
     int i, j;                                           // grid indexes
-    int max_iterations;                                 // number of iterations
+    #elif SHARED_HALO
+    int i;                                              // shared windows
+    #endif
     int iteration = 1;                                  // current iteration
     double dt = 100;                                    // largest chaneg in t
     struct timeval start_time, stop_time, elapsed_time; // timers
-
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 4000, .progress = 100};
+    struct laplace_io checkpoint = {.active = 0};       // checkpoint being written
+    struct laplace_io output = {.active = 0};           // final field
+    struct laplace_snapshots snapshots = {.active = 0}; // in-situ frames
 
     int rank, size, error, last_rank;
-    double start, end, duration, temp;
+    double start, temp;
     MPI_Comm comm = MPI_COMM_WORLD;
-    MPI_Request send_head_req, recv_head_req, send_tail_req, recv_tail_req;
-    MPI_Status send_status, recv_status;
-    int send_head_tag, send_tail_tag, recv_tail_tag, recv_head_tag;
-    send_head_tag = recv_tail_tag = 1;
-    send_tail_tag = recv_head_tag = 2;
+    char found[256];                                    // warm-start cache entry
+    #if REDBLACK
+    int colour;                                         // 0 red, 1 black
+    double omega;                                       // over-relaxation factor
+    #endif
 
     error = MPI_Init(NULL, NULL);
     assert(error == MPI_SUCCESS);
 
     // Get process ID
     MPI_Comm_rank(comm, &rank);
+    trace_init(rank);
 
     // Get processes Number
     MPI_Comm_size(comm, &size);
 
-    rank_zero_only(printf("Maximum iterations [100-4000]?\n"));
-    rank_zero_only(scanf("%d", &max_iterations));
-    MPI_Bcast(&max_iterations, 1, MPI_INT, 0, comm);
+    // every rank parses the same arguments, only rank 0 reports problems
+    int status = laplace_configure(argc, argv, &config, rank == 0);
+    if (status != 0)
+    {
+        MPI_Finalize();
+        return status < 0;
+    }
+    int rows = config.rows, columns = config.columns;
+    laplace_row_fn stencil = laplace_row_kernel(columns);
+    #if REDBLACK
+    omega = OMEGA > 0.0 ? OMEGA : optimal_omega(rows, columns);
+    #endif
 
     #if defined(_OPENMP)
     int total_cores = omp_get_num_procs()*HYPER;
-    int local_cores = total_cores / size;
+    int local_cores = total_cores > size ? total_cores / size : 1;
+    // OMP_NUM_THREADS sets the threads per rank, for scaling runs
+    if (getenv("OMP_NUM_THREADS") != NULL)
+    {
+        local_cores = omp_get_max_threads();
+    }
     rank_zero_only(printf("Openmp total_cores: %d local_cores: %d\n", total_cores, local_cores));
+    #else
+    int local_cores = 1;
     #endif
 
-    int PART_ROW = (ROWS + size - 1) / size;
+    int PART_ROW = (rows + size - 1) / size;
     int start_row = rank * PART_ROW;
-    int stop_row = min((rank + 1) * PART_ROW, ROWS);
+    int stop_row = min((rank + 1) * PART_ROW, rows);
     int range_row = stop_row - start_row;
     last_rank = (rank == (size - 1));
+    int pitch = laplace_pitch(columns + 2, sizeof(double)); // padded row length
+
+    #if SHARED_HALO
+    // my slab in a shared window of the node; where the neighbour is next to me in that window,
+    // its boundary row is my ghost row and the halo of that side needs no message
+    MPI_Comm node;
+    MPI_Win windows[2];
+    int shared_up, shared_down, shared_pairs;
+    int shared_count = REDBLACK ? 1 : 2;
+    void *grids[2];
+    shared_neighbours(rank, comm, &node, &shared_up, &shared_down);
+    if (shared_alloc(grids, windows, shared_count, range_row, pitch, local_cores, shared_up, shared_down, node) != 0)
+    {
+        // the segments of the node are not contiguous, every slab gets its own ghost rows
+        shared_up = shared_down = 0;
+        shared_alloc(grids, windows, shared_count, range_row, pitch, local_cores, 0, 0, node);
+    }
+    MPI_Reduce(&shared_down, &shared_pairs, 1, MPI_INT, MPI_SUM, 0, comm);
+    rank_zero_only(printf("Shared memory halos between %d of %d neighbour pairs\n", shared_pairs, size - 1));
+    double(*Temperature_last)[pitch] = grids[0];                                              // temperature grid from last iteration
+    #else
+    double(*Temperature_last)[pitch] = laplace_alloc(range_row + 2, pitch, sizeof(double), local_cores, config.huge_pages); // temperature grid from last iteration
+    #endif
+    #if REDBLACK
+    double(*Temperature)[pitch] = Temperature_last;                                           // updated in place, one grid is enough
+    rank_zero_only(printf("Red-black %s, omega: %f\n", omega == 1.0 ? "Gauss-Seidel" : "SOR", omega));
+    #elif SINGLE_GRID
+    double(*Temperature)[pitch] = Temperature_last;                                           // updated in place, one grid is enough
+    // per thread: old values of the row above and of the current row, and of my first and last row
+    double(*rolling)[pitch] = laplace_alloc(4 * local_cores, pitch, sizeof(double), local_cores, 0);
+    if (rolling == NULL)
+    {
+        printf("Rank %d cannot allocate its rolling rows\n", rank);
+        MPI_Abort(comm, 1);
+    }
+    rank_zero_only(printf("Single grid Jacobi, %d rolling rows\n", 4 * local_cores));
+    #elif SHARED_HALO
+    double(*Temperature)[pitch] = grids[1];                                                   // temperature grid
+    #else
+    double(*Temperature)[pitch] = laplace_alloc(range_row + 2, pitch, sizeof(double), local_cores, config.huge_pages);      // temperature grid
+    #endif
+    if (Temperature_last == NULL || Temperature == NULL)
+    {
+        printf("Rank %d cannot allocate the grids of its %d x %d slab\n", rank, range_row, columns);
+        MPI_Abort(comm, 1);
+    }
 
-    double(*Temperature)[COLUMNS + 2] = (double(*)[COLUMNS + 2]) malloc(sizeof(double) * (range_row + 2) * (COLUMNS + 2));      // temperature grid
-    double(*Temperature_last)[COLUMNS + 2] = (double(*)[COLUMNS + 2]) malloc(sizeof(double) * (range_row + 2) * (COLUMNS + 2)); // temperature grid from last iteration
+    #if !SHARED_HALO
+    // every grid that is exchanged is Temperature_last, HALO picks the back-end
+    struct halo halo;
+    laplace_halo_create(&halo, &Temperature_last[0][0], pitch, columns, range_row, MPI_DOUBLE, comm);
+    rank_zero_only(printf("Halo exchange: %s\n", halo_method_name(halo.method)));
+    #endif
 
     gettimeofday(&start_time, NULL); // Unix timer
 
-    #if TIMING
-    start = MPI_Wtime();
+    laplace_initialize(rows, columns, pitch, Temperature_last,
+                       range_row, start_row, last_rank); // initialize Temp_last including boundary conditions
+    #if SHARED_HALO && !REDBLACK
+    // the grids swap roles every iteration, both need the boundary
+    laplace_initialize(rows, columns, pitch, Temperature, range_row, start_row, last_rank);
     #endif
-    initialize(Temperature_last,
-               range_row, start_row, last_rank); // initialize Temp_last including boundary conditions
-    #if TIMING
-    end = MPI_Wtime();
-    duration = end - start;
-    MPI_Allreduce(&duration, &temp, 1, MPI_DOUBLE, MPI_SUM, comm);
-    rank_zero_only(printf("initialization: %lf ", temp/size));
+
+    // or continue from a checkpoint, which brings the boundary and my ghost rows along
+    if (config.restart != NULL)
+    {
+        if (laplace_read(config.restart, &iteration, &dt, rows, columns, pitch, &Temperature_last[0][0],
+                         range_row, start_row, comm) != 0)
+        {
+            rank_zero_only(printf("Cannot restart from %s\n", config.restart));
+            MPI_Finalize();
+            return 1;
+        }
+        rank_zero_only(printf("Restarted from %s after iteration %d, dt %f\n", config.restart, iteration, dt));
+        iteration++;
+    }
+    // or start from the closest converged field in the warm-start cache, with its ghost rows
+    else if (config.cache != NULL &&
+             laplace_cache_load(config.cache, BOUNDARY, rows, columns, pitch, &Temperature_last[0][0],
+                                range_row, start_row, found, sizeof(found), comm) == 0)
+    {
+        rank_zero_only(printf("Warm start from %s\n", found));
+        #if !SHARED_HALO
+        halo_exchange(&halo);
+        #endif
+    }
+
+    if (config.snapshot != NULL)
+    {
+        laplace_snapshot_init(&snapshots, config.snapshot, SNAPSHOT_PIXELS, rows, columns, range_row, start_row, comm);
+        rank_zero_only(printf("Snapshots of %d x %d every %d iterations\n", snapshots.width, snapshots.height, config.snapshot_every));
+    }
+
+    #if SHARED_HALO
+    // ghost rows of the first sweep: the neighbours' rows must be initialized (or read) first
+    exchange_shared(columns, pitch, Temperature_last, range_row, rank, last_rank,
+                    shared_up, shared_down, windows, shared_count, node, comm);
+    #else
+    // HALO_BENCHMARK: time the back-ends on my rows, the ghost rows already hold what they bring
+    int periods[1] = {0};
+    halo_benchmark_env(comm, 1, &size, periods, halo.side);
+    #endif
+
+    // threads, schedule and row kernel from calibration sweeps (TUNE=1) or the tuning cache
+    #if REDBLACK || SINGLE_GRID
+    // the in-place sweeps calibrate themselves; the single grid one splits the rows statically,
+    // only the red-black loops have a schedule to tune
+    struct solver_sweep own = {columns, pitch, range_row, start_row, 0.0, NULL};
+    #if REDBLACK
+    own.omega = omega;
+    #else
+    own.rolling = &rolling[0][0];
+    #endif
+    laplace_tune(PROGRAM, rows, columns, size, pitch, &Temperature_last[0][0], NULL, range_row,
+                 REDBLACK ? LAPLACE_TUNE_SCHEDULE : 0, &local_cores, &stencil, calibration_sweep, &own);
+    #else
+    laplace_tune(PROGRAM, rows, columns, size, pitch, &Temperature_last[0][0], &Temperature[0][0], range_row,
+                 LAPLACE_TUNE_SCHEDULE | LAPLACE_TUNE_KERNEL, &local_cores, &stencil, NULL, NULL);
     #endif
 
-    printf("This is rank %d, world_size: %d max_iter: %d\n", rank, size, max_iterations);
+    if (!config.quiet)
+        printf("This is rank %d, world_size: %d max_iter: %d\n", rank, size, config.max_iterations);
     // do util error is minimal of until max steps
-    while (dt > MAX_TEMP_ERROR && iteration <= max_iterations)
+    while (dt > config.max_temp_error && iteration <= config.max_iterations)
     {
-        #if TIMING
-        start = MPI_Wtime();
+        #if REDBLACK
+        // two half-sweeps over the single grid, each followed by a halo update,
+        // so the black cells already see the new red values of the neighbour ranks
+        dt = 0.0;
+        for (colour = 0; colour <= 1; colour++)
+        {
+            trace_begin(TRACE_COMPUTE);
+            dt = fmax(sweep_colour(columns, pitch, Temperature, range_row, start_row, omega, colour, local_cores), dt);
+            trace_work(TRACE_COMPUTE, CELL_BYTES * range_row * columns, CELL_FLOPS * range_row * columns);
+            trace_end(TRACE_COMPUTE);
+
+            trace_begin(TRACE_HALO);
+            #if SHARED_HALO
+            exchange_shared(columns, pitch, Temperature, range_row, rank, last_rank,
+                            shared_up, shared_down, windows, shared_count, node, comm);
+            #else
+            halo_exchange(&halo);
+            #endif
+            trace_end(TRACE_HALO);
+        }
+        #elif SINGLE_GRID
+        // main calculation in place, no copy loop and no second grid
+        trace_begin(TRACE_COMPUTE);
+        dt = 0.0;
+        #if defined(_OPENMP)
+        #pragma omp parallel num_threads(local_cores) reduction(max:dt)
         #endif
-
+        {
+            dt = sweep_in_place(columns, pitch, Temperature, range_row, rolling);
+        }
+        #else
         // main calculation: average my four neighbors
+        trace_begin(TRACE_COMPUTE);
         #if defined(_OPENMP)
         #pragma omp parallel for num_threads(local_cores) schedule(runtime)
         #endif
         for (i = 1; i <= range_row; i++)
         {
-            for (j = 1; j <= COLUMNS; j++)
-            {
-                Temperature[i][j] =
-                    0.25 * (Temperature_last[i + 1][j] + Temperature_last[i - 1][j] +
-                            Temperature_last[i][j + 1] + Temperature_last[i][j - 1]);
-            }
+            stencil(Temperature[i], Temperature_last[i], pitch, columns);
         }
 
         dt = 0.0; // reset largest temperature change
 
-        // copy grid to old grid for next iteration and find latest dt
+        #if SHARED_HALO
+        // the neighbours read my rows of Temperature_last in place, so the grids swap roles
+        // instead of a copy: nobody overwrites a row a neighbour may still be reading
         #if defined(_OPENMP)
-        double *dtt = (double *)calloc(local_cores, sizeof(double));
-        #pragma omp parallel for num_threads(local_cores) schedule(runtime)
+        #pragma omp parallel for num_threads(local_cores) schedule(runtime) private(j) reduction(max:dt)
+        #endif
         for (i = 1; i <= range_row; i++)
         {
-            for (j = 1; j <= COLUMNS; j++)
+            for (j = 1; j <= columns; j++)
             {
-                dtt[omp_get_thread_num()] = fmax(fabs(Temperature[i][j] - Temperature_last[i][j]), dtt[omp_get_thread_num()]);
-                Temperature_last[i][j] = Temperature[i][j];
+                double change = fabs(Temperature[i][j] - Temperature_last[i][j]);
+                dt = change > dt ? change : dt; // fmax would stay scalar without -ffast-math
             }
         }
-        dt = 0.0;
-        for (int i = 0; i < local_cores; i++) {
-            dt = fmax(dt, dtt[i]);
-        }
-        #else   
+        double(*swap)[pitch] = Temperature;
+        Temperature = Temperature_last;
+        Temperature_last = swap;
+        #else
+        // copy grid to old grid for next iteration and find latest dt
+        #if defined(_OPENMP)
+        #pragma omp parallel for num_threads(local_cores) schedule(runtime) private(j) reduction(max:dt)
+        #endif
         for (i = 1; i <= range_row; i++)
         {
-            for (j = 1; j <= COLUMNS; j++)
+            for (j = 1; j <= columns; j++)
             {
                 dt = fmax(fabs(Temperature[i][j] - Temperature_last[i][j]), dt);
                 Temperature_last[i][j] = Temperature[i][j];
             }
         }
         #endif
-
-        #if TIMING
-        end = MPI_Wtime();
-        duration = end - start;
-        MPI_Allreduce(&duration, &temp, 1, MPI_DOUBLE, MPI_SUM, comm);
-        rank_zero_only(printf("computation: %lf ", temp/size));
+        #endif
+        #if !REDBLACK
+        trace_work(TRACE_COMPUTE, CELL_BYTES * range_row * columns, CELL_FLOPS * range_row * columns);
+        trace_end(TRACE_COMPUTE);
         #endif
 
+        trace_begin(TRACE_REDUCE);
         temp = dt;
         error = MPI_Allreduce(&temp, &dt, 1, MPI_DOUBLE, MPI_MAX, comm);
         // assert(error == MPI_SUCCESS);
+        trace_end(TRACE_REDUCE);
 
         // rank_zero_only(printf("iter: %d dt: %lf\n", iteration, dt));
 
         // periodically print test values
-        if (last_rank && iteration % 100 == 0)
+        if (last_rank && config.progress && iteration % config.progress == 0)
         {
-            track_progress(Temperature, iteration, range_row, start_row);
+            laplace_track_progress(columns, pitch, Temperature_last, iteration, range_row, start_row);
         }
 
-        start = MPI_Wtime();
-        #if NONBLOCK
-        if (!last_rank) {
-            // send tail to next rank
-            error = MPI_Isend(&(Temperature[range_row][1]), COLUMNS, MPI_DOUBLE, rank + 1, send_tail_tag, comm, &send_tail_req);
-            // assert(error == MPI_SUCCESS);
-            // receive tail from next rank
-            error = MPI_Irecv(&(Temperature_last[range_row+1][1]), COLUMNS, MPI_DOUBLE, rank + 1, recv_tail_tag, comm, &recv_tail_req);
-            // assert(error == MPI_SUCCESS);
-        }
-        if (rank > 0) {
-            // receive head from last rank
-            error = MPI_Irecv(&(Temperature_last[0][1]), COLUMNS, MPI_DOUBLE, rank - 1, recv_head_tag, comm, &recv_head_req);
-            // assert(error == MPI_SUCCESS);
-            // send head to last rank
-            error = MPI_Isend(&(Temperature_last[1][1]), COLUMNS, MPI_DOUBLE, rank - 1, send_head_tag, comm, &send_head_req);
-            // assert(error == MPI_SUCCESS);
-        }
-        if (!last_rank) {
-            // wait for send and receive to complete
-            error = MPI_Wait(&send_tail_req, &send_status);
-            // assert(error == MPI_SUCCESS);
-            error = MPI_Wait(&recv_tail_req, &recv_status);
-            // assert(error == MPI_SUCCESS);
-        }
-        if (rank > 0) {
-            // wait for send and receive to complete
-            error = MPI_Wait(&send_head_req, &send_status);
-            // assert(error == MPI_SUCCESS);
-            error = MPI_Wait(&recv_head_req, &recv_status);
-            // assert(error == MPI_SUCCESS);
-        }
+        #if !REDBLACK
+        trace_begin(TRACE_HALO);
+        #if SHARED_HALO
+        exchange_shared(columns, pitch, Temperature_last, range_row, rank, last_rank,
+                        shared_up, shared_down, windows, shared_count, node, comm);
         #else
-        if (rank % 2 == 0)
+        halo_exchange(&halo);
+        #endif
+        trace_end(TRACE_HALO);
+        #endif
+
+        // checkpoint, the collective write goes on behind the next iterations
+        if (config.checkpoint != NULL && iteration % config.checkpoint_every == 0)
         {
-            if (!last_rank)
-            {
-                error = MPI_Send(&(Temperature[range_row][1]), COLUMNS, MPI_DOUBLE, rank + 1, send_tail_tag, comm);
-                assert(error == MPI_SUCCESS);
-                error = MPI_Recv(&(Temperature_last[range_row + 1][1]), COLUMNS, MPI_DOUBLE, rank + 1, recv_tail_tag, comm, &recv_status);
-                assert(recv_status.MPI_SOURCE == rank + 1);
-                assert(error == MPI_SUCCESS);
-            }
-            if (rank > 0)
+            trace_begin(TRACE_IO);
+            if (laplace_write_start(&checkpoint, config.checkpoint, iteration, dt, rows, columns, pitch,
+                                    &Temperature_last[0][0], range_row, start_row, comm) != 0)
             {
-                error = MPI_Recv(&(Temperature_last[0][1]), COLUMNS, MPI_DOUBLE, rank - 1, recv_head_tag, comm, &recv_status);
-                assert(error == MPI_SUCCESS);
-                assert(recv_status.MPI_SOURCE == rank - 1);
-                error = MPI_Send(&(Temperature_last[1][1]), COLUMNS, MPI_DOUBLE, rank - 1, send_head_tag, comm);
-                assert(error == MPI_SUCCESS);
+                rank_zero_only(printf("Cannot write checkpoint %s\n", config.checkpoint));
             }
+            trace_end(TRACE_IO);
         }
-        else
+        laplace_write_progress(&checkpoint);
+
+        // downsampled frame of the plate, gathered and written while the solver goes on
+        if (config.snapshot != NULL && iteration % config.snapshot_every == 0)
         {
-            if (rank > 0)
-            {
-                error = MPI_Recv(&(Temperature_last[0][1]), COLUMNS, MPI_DOUBLE, rank - 1, recv_head_tag, comm, &recv_status);
-                assert(recv_status.MPI_SOURCE == rank - 1);
-                assert(error == MPI_SUCCESS);
-                error = MPI_Send(&(Temperature_last[1][1]), COLUMNS, MPI_DOUBLE, rank - 1, send_head_tag, comm);
-                assert(error == MPI_SUCCESS);
-            }
-            if (!last_rank)
-            {
-                error = MPI_Send(&(Temperature[range_row][1]), COLUMNS, MPI_DOUBLE, rank + 1, send_tail_tag, comm);
-                assert(error == MPI_SUCCESS);
-                error = MPI_Recv(&(Temperature_last[range_row + 1][1]), COLUMNS, MPI_DOUBLE, rank + 1, recv_tail_tag, comm, &recv_status);
-                assert(recv_status.MPI_SOURCE == rank + 1);
-                assert(error == MPI_SUCCESS);
-            }
+            trace_begin(TRACE_IO);
+            laplace_snapshot_take(&snapshots, iteration, pitch, &Temperature_last[0][0], comm);
+            trace_end(TRACE_IO);
         }
-        #endif
-        #if TIMING
-        end = MPI_Wtime();
-        duration = end - start;
-        MPI_Allreduce(&duration, &temp, 1, MPI_DOUBLE, MPI_SUM, comm);
-        rank_zero_only(printf(" communication: %lf\n", temp/size));
-        #endif
+        laplace_snapshot_progress(&snapshots);
         iteration++;
     }
+    laplace_write_wait(&checkpoint, comm);
+    if (config.snapshot != NULL)
+    {
+        laplace_snapshot_finish(&snapshots, comm);
+        rank_zero_only(printf("%d snapshots, %f seconds in the solver\n", snapshots.frames, snapshots.time));
+    }
 
     gettimeofday(&stop_time, NULL); // Unix timer
     timersub(&stop_time, &start_time,
@@ -255,53 +449,268 @@ int main(int argc, char **argv)
     rank_zero_only(printf("Total time was %f seconds\n",
            elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0)));
 
+    if (config.output != NULL)
+    {
+        trace_begin(TRACE_IO);
+        start = MPI_Wtime();
+        if (laplace_write_start(&output, config.output, iteration - 1, dt, rows, columns, pitch,
+                                &Temperature_last[0][0], range_row, start_row, comm) != 0)
+        {
+            rank_zero_only(printf("Cannot write %s\n", config.output));
+        }
+        laplace_write_wait(&output, comm);
+        trace_end(TRACE_IO);
+        rank_zero_only(printf("Field written to %s in %f seconds\n", config.output, MPI_Wtime() - start));
+    }
+
+    // a converged field goes into the warm-start cache
+    if (config.cache != NULL && dt <= config.max_temp_error &&
+        laplace_cache_store(config.cache, BOUNDARY, iteration - 1, dt, rows, columns, pitch,
+                            &Temperature_last[0][0], range_row, start_row, comm))
+    {
+        rank_zero_only(printf("Field added to the warm-start cache %s\n", config.cache));
+    }
+
+    trace_finish();
+    #if SHARED_HALO
+    for (i = 0; i < shared_count; i++)
+    {
+        MPI_Win_unlock_all(windows[i]);
+        MPI_Win_free(&windows[i]);
+    }
+    MPI_Comm_free(&node);
     MPI_Finalize();
+    #else
+    halo_free(&halo);
+    MPI_Finalize();
+    #if SINGLE_GRID
+    free(rolling);
+    #elif !REDBLACK
     free(Temperature);
+    #endif
     free(Temperature_last);
+    #endif
 
     return 0;
 }
 
-// initialize plate and boundary conditions
-// Temp_last is used tp start first iteration
-void initialize(double (*Temperature_last)[COLUMNS + 2],
-                int range_row, int start_row, int last_rank)
+
+// SOR factor for the 5-point Laplacian on the whole plate,
+// from the spectral radius of Jacobi: rho = (cos(pi/(rows+1)) + cos(pi/(columns+1))) / 2
+double optimal_omega(int rows, int columns)
+{
+    double rho = 0.5 * (cos(M_PI / (rows + 1)) + cos(M_PI / (columns + 1)));
+    return 2.0 / (1.0 + sqrt(1.0 - rho * rho));
+}
+
+// Jacobi sweep of the rows of this thread in place, returns the largest change; call it from
+// every thread of a parallel region. The rows are those schedule(static) gives the thread, the
+// ones it first touched. Before a row is overwritten its old values go into a rolling buffer, where
+// they serve as the row above of the next one; the old first and last rows of every thread are saved
+// before anybody writes, for the threads next door. Same arithmetic as the two grid sweep.
+double sweep_in_place(int columns, int pitch, double (*Temperature)[pitch], int range_row, double (*rolling)[pitch])
 {
     int i, j;
-    for (i = 0; i <= range_row + 1; i++)
+    double dt = 0.0;
+    size_t bytes = sizeof(double) * (columns + 2);
+    #if defined(_OPENMP)
+    int threads = omp_get_num_threads(), thread = omp_get_thread_num();
+    #else
+    int threads = 1, thread = 0;
+    #endif
+    int share = range_row / threads, extra = range_row % threads;
+    int first = 1 + thread * share + min(thread, extra);
+    int last = first + share - 1 + (thread < extra);
+    double *buffer[2] = {rolling[4 * thread], rolling[4 * thread + 1]};
+
+    if (first <= last)
+    {
+        memcpy(rolling[4 * thread + 2], Temperature[first], bytes);
+        memcpy(rolling[4 * thread + 3], Temperature[last], bytes);
+    }
+    #if defined(_OPENMP)
+    #pragma omp barrier
+    #endif
+
+    // above my first row: the ghost row, or the old last row of the previous thread
+    const double *up = first > 1 ? rolling[4 * (thread - 1) + 3] : Temperature[first - 1];
+    for (i = first; i <= last; i++)
     {
-        for (j = 0; j <= COLUMNS + 1; j++)
+        // below my last row: the ghost row, or the old first row of the next thread
+        const double *restrict down = i == last && last < range_row ? rolling[4 * (thread + 1) + 2] : Temperature[i + 1];
+        double *restrict mid = buffer[i % 2];
+        double *restrict row = Temperature[i];
+        memcpy(mid, row, bytes);
+        for (j = 1; j <= columns; j++)
         {
-            Temperature_last[i][j] = 0.0;
+            row[j] = 0.25 * (down[j] + up[j] + mid[j + 1] + mid[j - 1]);
+            double change = fabs(row[j] - mid[j]);
+            dt = change > dt ? change : dt; // fmax would stay scalar without -ffast-math
         }
+        up = mid;
     }
+    return dt;
+}
 
-    // these boundary conditions never change thoughout run
-    // set left side to 0 and right side to a linear increase
+// one colour of the red-black sweep over my rows in place with threads threads, returns the largest change
+double sweep_colour(int columns, int pitch, double (*Temperature)[pitch], int range_row, int start_row,
+                    double omega, int colour, int threads)
+{
+    int i, j;
+    double dt = 0.0;
+    #if defined(_OPENMP)
+    #pragma omp parallel for num_threads(threads) schedule(runtime) private(j) reduction(max:dt)
+    #else
+    (void)threads;
+    #endif
+    for (i = 1; i <= range_row; i++)
+    {
+        // colour is the parity of the global (row + column), first j of this colour
+        for (j = 1 + (i + start_row + 1 + colour) % 2; j <= columns; j += 2)
+        {
+            double change = omega * (0.25 * (Temperature[i + 1][j] + Temperature[i - 1][j] +
+                                             Temperature[i][j + 1] + Temperature[i][j - 1]) -
+                                     Temperature[i][j]);
+            Temperature[i][j] += change;
+            dt = fmax(fabs(change), dt);
+        }
+    }
+    return dt;
+}
+
+// one sweep of this build for laplace_tune, without the halo updates: both colours of the red-black
+// sweep, or the single grid Jacobi sweep; the two grid builds calibrate with the sweep of laplacelib
+double calibration_sweep(double *grid, int threads, void *data)
+{
+    struct solver_sweep *own = data;
+    int pitch = own->pitch;
+    double (*Temperature)[pitch] = (double (*)[pitch])grid;
+    double dt = 0.0;
+    #if REDBLACK
+    for (int colour = 0; colour <= 1; colour++)
+    {
+        dt = fmax(sweep_colour(own->columns, pitch, Temperature, own->range_row, own->start_row,
+                               own->omega, colour, threads), dt);
+    }
+    #elif SINGLE_GRID
+    double (*rolling)[pitch] = (double (*)[pitch])own->rolling;
+    #if defined(_OPENMP)
+    #pragma omp parallel num_threads(threads) reduction(max:dt)
+    #else
+    (void)threads;
+    #endif
+    {
+        dt = sweep_in_place(own->columns, pitch, Temperature, own->range_row, rolling);
+    }
+    #else
+    (void)Temperature;
+    (void)threads;
+    #endif
+    return dt;
+}
+
+// node communicator, ranked in the order of comm; my previous (next) rank shares my memory if it is
+// the previous (next) rank of the node, which is the case for the usual block placement of ranks
+void shared_neighbours(int rank, MPI_Comm comm, MPI_Comm *node, int *shared_up, int *shared_down)
+{
+    int node_rank, node_size;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, node);
+    MPI_Comm_rank(*node, &node_rank);
+    MPI_Comm_size(*node, &node_size);
+
+    int *ranks = (int *)malloc(sizeof(int) * node_size);
+    MPI_Allgather(&rank, 1, MPI_INT, ranks, 1, MPI_INT, *node);
+    *shared_up = node_rank > 0 && ranks[node_rank - 1] == rank - 1;
+    *shared_down = node_rank < node_size - 1 && ranks[node_rank + 1] == rank + 1;
+    free(ranks);
+}
 
-    for (i = 0; i <= range_row + 1; i++)
+// count grids of my rows 0..range_row+1 in shared windows of the node, collective on node.
+// The segments of a window follow each other in node rank order, so with shared_up my segment starts
+// with row 1 and row 0 is the last row of the previous rank, with shared_down the next rank's first
+// row is my row range_row+1; otherwise the segment has a ghost row of its own. All segments but
+// those ending in a ghost row are whole rows, so one shift puts the rows of everybody on cache lines,
+// and a spare line at the end of those segments makes room for it. The rows are zeroed, first touched
+// by threads OpenMP threads. Returns -1 on every rank of the node, with nothing allocated, if the
+// segments turn out not to be contiguous; 0 with the windows locked for MPI_Win_sync.
+int shared_alloc(void **grids, MPI_Win *windows, int count, int range_row, int pitch, int threads,
+                 int shared_up, int shared_down, MPI_Comm node)
+{
+    int g, i, node_rank, contiguous = 1, everywhere;
+    size_t row_bytes = sizeof(double) * pitch;
+    int own_rows = range_row + !shared_up + !shared_down;
+    MPI_Aint bytes = own_rows * row_bytes + (shared_down ? 0 : CACHE_LINE);
+    char *base[2];
+
+    MPI_Comm_rank(node, &node_rank);
+    for (g = 0; g < count; g++)
+    {
+        MPI_Win_allocate_shared(bytes, 1, MPI_INFO_NULL, node, &base[g], &windows[g]);
+        if (shared_up)
+        {
+            MPI_Aint previous_bytes;
+            int unit;
+            char *previous;
+            MPI_Win_shared_query(windows[g], node_rank - 1, &previous_bytes, &unit, &previous);
+            contiguous = contiguous && previous + previous_bytes == base[g];
+        }
+    }
+    MPI_Allreduce(&contiguous, &everywhere, 1, MPI_INT, MPI_LAND, node);
+    if (!everywhere)
     {
-        Temperature_last[i][COLUMNS + 1] = (100.0 / ROWS) * (i + start_row);
+        for (g = 0; g < count; g++)
+        {
+            MPI_Win_free(&windows[g]);
+        }
+        return -1;
     }
 
-    // set top to 0 and bottom to linear increase (only need to set in last rank)
-    if (last_rank)
+    for (g = 0; g < count; g++)
     {
-        for (j = 0; j <= COLUMNS + 1; j++)
+        char *first = base[g] + (CACHE_LINE - (uintptr_t)base[g] % CACHE_LINE) % CACHE_LINE;
+        #if defined(_OPENMP)
+        #pragma omp parallel for num_threads(threads) schedule(static)
+        #else
+        (void)threads;
+        #endif
+        for (i = 0; i < own_rows; i++)
         {
-            Temperature_last[range_row + 1][j] = (100.0 / COLUMNS) * j;
+            memset(first + i * row_bytes, 0, row_bytes);
         }
+        grids[g] = first - (shared_up ? row_bytes : 0);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, windows[g]);
     }
+    return 0;
 }
 
-// print diagonal in bottom right corner where most action is
-void track_progress(double (*Temperature)[COLUMNS + 2], int iteration, int range_row, int start_row)
+// halo update of the shared grids: off-node neighbours exchange boundary rows as nonblocking halos do,
+// on-node neighbours only wait for each other (MPI_Win_sync orders the stores around the node
+// barrier), after which the boundary rows they wrote are my ghost rows
+void exchange_shared(int columns, int pitch, double (*Temperature)[pitch], int range_row, int rank, int last_rank,
+                     int shared_up, int shared_down, MPI_Win *windows, int count, MPI_Comm node, MPI_Comm comm)
 {
-    int i;
-    printf("--------- Iteration number: %d ---------\n", iteration);
-    for (i = range_row - 5; i <= range_row; i++)
+    int g, n = 0;
+    MPI_Request requests[4];
+
+    if (!last_rank && !shared_down)
+    {
+        MPI_Isend(&(Temperature[range_row][1]), columns, MPI_DOUBLE, rank + 1, 2, comm, &requests[n++]);
+        MPI_Irecv(&(Temperature[range_row + 1][1]), columns, MPI_DOUBLE, rank + 1, 1, comm, &requests[n++]);
+    }
+    if (rank > 0 && !shared_up)
+    {
+        MPI_Irecv(&(Temperature[0][1]), columns, MPI_DOUBLE, rank - 1, 2, comm, &requests[n++]);
+        MPI_Isend(&(Temperature[1][1]), columns, MPI_DOUBLE, rank - 1, 1, comm, &requests[n++]);
+    }
+
+    for (g = 0; g < count; g++)
+    {
+        MPI_Win_sync(windows[g]);
+    }
+    MPI_Barrier(node);
+    for (g = 0; g < count; g++)
     {
-        printf("[%d,%d]: %5.2f ", i + start_row, i + start_row, Temperature[i][COLUMNS+i-range_row]);
+        MPI_Win_sync(windows[g]);
     }
-    printf("\n");
+    MPI_Waitall(n, requests, MPI_STATUSES_IGNORE);
 }
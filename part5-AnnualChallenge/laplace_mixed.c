@@ -0,0 +1,372 @@
+#if defined(_OPENMP)
+#include "omp.h"
+#endif
+
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <assert.h>
+
+#include "laplace.h"
+#include "laplaceio.h"
+#include "../common/halo.h"
+#include "../common/trace.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define rank_zero_only(statement) \
+    do                            \
+    {                             \
+        if (rank == 0)            \
+            statement;           \
+    } while (0);
+
+#define TIMING 1         // Timing macro
+#define REFINE_EVERY 100 // FP32 sweeps between FP64 refinement passes
+
+// default size of plate
+#define COLUMNS 10000
+#define ROWS 10000
+
+// largest permitted change in temp (This value takes about 3400 steps)
+#define MAX_TEMP_ERROR 0.01
+
+// memory traffic and flops per cell, for the roofline (TRACE_ROOFLINE=1)
+#define CELL_BYTES 12.0   // an FP32 sweep reads Correction_last and Residual and writes Correction
+#define CELL_FLOPS 6.0    // 4 adds and a multiply of the stencil, the difference for the change
+#define REFINE_BYTES 36.0 // Temperature += Correction, the FP64 residual into Residual, Correction cleared
+#define REFINE_FLOPS 8.0
+
+// helper routines
+void track_progress(int columns, int pitch, int fpitch, double (*Temperature)[pitch], float (*Correction)[fpitch],
+                    int iteration, int range_row, int start_row);
+
+double refine(int columns, int pitch, int fpitch, double (*Temperature)[pitch], float (*Correction)[fpitch], float (*Residual)[fpitch],
+              int range_row, struct halo *halo, MPI_Comm comm);
+
+void *solve_double(int rows, int columns, int pitch, double max_temp_error, int max_iterations, int *iterations,
+                   int range_row, int start_row, int last_rank, MPI_Comm comm);
+
+int main(int argc, char **argv)
+{
+
+    int i, j;                                           // grid indexes
+    int iteration = 1;                                  // current iteration
+    int refinements = 0;                                // FP64 passes
+    double dt = 100;                                    // largest change in t
+    float change, change_all;                           // largest change of one FP32 sweep
+    struct timeval start_time, stop_time, elapsed_time; // timers
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 4000, .progress = 100};
+
+    int rank, size, error, last_rank;
+    double start, sweep_time = 0.0, halo_time = 0.0, refine_time = 0.0;
+    MPI_Comm comm = MPI_COMM_WORLD;
+
+    error = MPI_Init(NULL, NULL);
+    assert(error == MPI_SUCCESS);
+
+    // Get process ID
+    MPI_Comm_rank(comm, &rank);
+    trace_init(rank);
+
+    // Get processes Number
+    MPI_Comm_size(comm, &size);
+
+    // every rank parses the same arguments, only rank 0 reports problems
+    int status = laplace_configure(argc, argv, &config, rank == 0);
+    if (status != 0)
+    {
+        MPI_Finalize();
+        return status < 0;
+    }
+    int rows = config.rows, columns = config.columns;
+    int max_iterations = config.max_iterations;
+
+    int PART_ROW = (rows + size - 1) / size;
+    int start_row = rank * PART_ROW;
+    int stop_row = min((rank + 1) * PART_ROW, rows);
+    int range_row = stop_row - start_row;
+    last_rank = (rank == (size - 1));
+
+    // the solution stays in double, Jacobi runs in float on the correction A e = r of the latest residual,
+    // which gives exactly the Jacobi iterates of the solution, u_k = u_0 + e_k
+    int pitch = laplace_pitch(columns + 2, sizeof(double)); // padded row lengths
+    int fpitch = laplace_pitch(columns + 2, sizeof(float));
+    double(*Temperature)[pitch] = laplace_alloc(range_row + 2, pitch, sizeof(double), 0, config.huge_pages);     // temperature grid
+    float(*Correction)[fpitch] = laplace_alloc(range_row + 2, fpitch, sizeof(float), 0, config.huge_pages);      // correction
+    float(*Correction_last)[fpitch] = laplace_alloc(range_row + 2, fpitch, sizeof(float), 0, config.huge_pages); // correction from last iteration
+    float(*Residual)[fpitch] = laplace_alloc(range_row + 2, fpitch, sizeof(float), 0, config.huge_pages);        // residual of the last refinement
+    if (Temperature == NULL || Correction == NULL || Correction_last == NULL || Residual == NULL)
+    {
+        printf("Rank %d cannot allocate the grids of its %d x %d slab\n", rank, range_row, columns);
+        MPI_Abort(comm, 1);
+    }
+
+    // halo exchanges of the solution in double and of both correction grids in float, HALO picks the back-end
+    struct halo halo, corrections[2];
+    int latest = 1;                                     // exchange of Correction_last
+    laplace_halo_create(&halo, Temperature, pitch, columns, range_row, MPI_DOUBLE, comm);
+    laplace_halo_create(&corrections[0], Correction, fpitch, columns, range_row, MPI_FLOAT, comm);
+    laplace_halo_create(&corrections[1], Correction_last, fpitch, columns, range_row, MPI_FLOAT, comm);
+    rank_zero_only(printf("Halo exchange: %s\n", halo_method_name(halo.method)));
+
+    gettimeofday(&start_time, NULL); // Unix timer
+
+    laplace_initialize(rows, columns, pitch, Temperature,
+                       range_row, start_row, last_rank); // initialize Temperature including boundary conditions
+    halo_exchange(&halo);
+    dt = refine(columns, pitch, fpitch, Temperature, Correction_last, Residual, range_row, &halo, comm);
+
+    if (!config.quiet)
+        printf("This is rank %d, world_size: %d max_iter: %d\n", rank, size, max_iterations);
+    // do util error is minimal of until max steps
+    while (dt > config.max_temp_error && iteration <= max_iterations)
+    {
+        int sweeps;
+        for (sweeps = 0; sweeps < REFINE_EVERY && iteration <= max_iterations; sweeps++)
+        {
+            start = MPI_Wtime();
+            trace_begin(TRACE_COMPUTE);
+            change = 0.0f;
+
+            // main calculation: average my four neighbors, in float
+            #if defined(_OPENMP)
+            #pragma omp parallel for private(j) reduction(max:change)
+            #endif
+            for (i = 1; i <= range_row; i++)
+            {
+                #if defined(_OPENMP)
+                #pragma omp simd reduction(max:change)
+                #endif
+                for (j = 1; j <= columns; j++)
+                {
+                    Correction[i][j] = 0.25f * (Correction_last[i + 1][j] + Correction_last[i - 1][j] +
+                                                Correction_last[i][j + 1] + Correction_last[i][j - 1] + Residual[i][j]);
+                    float d = fabsf(Correction[i][j] - Correction_last[i][j]);
+                    change = d > change ? d : change;
+                }
+            }
+
+            // toggle the grids instead of copying
+            float(*swap)[fpitch] = Correction;
+            Correction = Correction_last;
+            Correction_last = swap;
+            latest = 1 - latest;
+            trace_work(TRACE_COMPUTE, CELL_BYTES * range_row * columns, CELL_FLOPS * range_row * columns);
+            trace_end(TRACE_COMPUTE);
+            sweep_time += MPI_Wtime() - start;
+
+            start = MPI_Wtime();
+            trace_begin(TRACE_REDUCE);
+            MPI_Allreduce(&change, &change_all, 1, MPI_FLOAT, MPI_MAX, comm);
+            trace_end(TRACE_REDUCE);
+            trace_begin(TRACE_HALO);
+            halo_exchange(&corrections[latest]);
+            trace_end(TRACE_HALO);
+            halo_time += MPI_Wtime() - start;
+
+            // periodically print test values
+            if (last_rank && config.progress && iteration % config.progress == 0)
+            {
+                track_progress(columns, pitch, fpitch, Temperature, Correction_last, iteration, range_row, start_row);
+            }
+
+            iteration++;
+            if (change_all <= config.max_temp_error)
+            {
+                break;
+            }
+        }
+
+        // FP64 refinement: fold the correction into the solution and take a fresh residual,
+        // the change the next double precision sweep would make decides about convergence
+        start = MPI_Wtime();
+        dt = refine(columns, pitch, fpitch, Temperature, Correction_last, Residual, range_row, &halo, comm);
+        refine_time += MPI_Wtime() - start;
+        refinements++;
+        if (!config.quiet)
+            rank_zero_only(printf("refinement %d at iteration %d: FP32 change %f, FP64 residual %f\n",
+                                  refinements, iteration - 1, change_all, dt));
+    }
+
+    gettimeofday(&stop_time, NULL); // Unix timer
+    timersub(&stop_time, &start_time,
+             &elapsed_time); // Unix timer substraction routine
+
+    rank_zero_only(printf("\nMax error at iteration %d was %f\n", iteration - 1, dt));
+    rank_zero_only(printf("Total time was %f seconds\n",
+           elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0)));
+    #if TIMING
+    rank_zero_only(printf("FP32 sweeps: %lf communication: %lf FP64 refinement: %lf\n", sweep_time, halo_time, refine_time));
+    #endif
+
+    trace_finish();
+    halo_free(&corrections[0]);
+    halo_free(&corrections[1]);
+    free(Correction);
+    free(Correction_last);
+    free(Residual);
+
+    // validation report (--validate 1): the same plate all in double precision, as laplace_horizon.c does it
+    if (config.validate)
+    {
+        int iterations_double;
+        double diff = 0.0, diff_all, sum = 0.0, sum_all;
+        start = MPI_Wtime();
+        double(*Reference)[pitch] = solve_double(rows, columns, pitch, config.max_temp_error, max_iterations, &iterations_double,
+                                                       range_row, start_row, last_rank, comm);
+        double double_time = MPI_Wtime() - start;
+        for (i = 1; i <= range_row; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                double d = fabs(Temperature[i][j] - Reference[i][j]);
+                diff = fmax(d, diff);
+                sum += d * d;
+            }
+        }
+        MPI_Allreduce(&diff, &diff_all, 1, MPI_DOUBLE, MPI_MAX, comm);
+        MPI_Allreduce(&sum, &sum_all, 1, MPI_DOUBLE, MPI_SUM, comm);
+        rank_zero_only(printf("\nValidation against double precision\n"));
+        rank_zero_only(printf("iterations: mixed %d double %d\n", iteration - 1, iterations_double));
+        rank_zero_only(printf("time: mixed %f double %f seconds\n",
+                              elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0), double_time));
+        rank_zero_only(printf("max |difference|: %e rms difference: %e\n", diff_all, sqrt(sum_all / ((double)rows * columns))));
+        rank_zero_only(printf("grid storage per cell: mixed %d bytes double %d bytes, halo row: %d bytes instead of %d\n",
+                              (int)(sizeof(double) + 3 * sizeof(float)), (int)(2 * sizeof(double)),
+                              (int)(columns * sizeof(float)), (int)(columns * sizeof(double))));
+        free(Reference);
+    }
+
+    halo_free(&halo);
+    MPI_Finalize();
+    free(Temperature);
+
+    return 0;
+}
+
+// print diagonal in bottom right corner where most action is
+void track_progress(int columns, int pitch, int fpitch, double (*Temperature)[pitch], float (*Correction)[fpitch],
+                    int iteration, int range_row, int start_row)
+{
+    int i;
+    printf("--------- Iteration number: %d ---------\n", iteration);
+    for (i = range_row - 5; i <= range_row; i++)
+    {
+        printf("[%d,%d]: %5.2f ", i + start_row, i + start_row,
+               Temperature[i][columns + i - range_row] + Correction[i][columns + i - range_row]);
+    }
+    printf("\n");
+}
+
+// FP64 refinement pass: Temperature += Correction, then Residual = b - A Temperature rounded to float
+// and Correction = 0 for the next FP32 solve. Returns the global max |residual| / 4,
+// i.e. the largest change of one more double precision Jacobi sweep
+double refine(int columns, int pitch, int fpitch, double (*Temperature)[pitch], float (*Correction)[fpitch], float (*Residual)[fpitch],
+              int range_row, struct halo *halo, MPI_Comm comm)
+{
+    int i, j;
+    double dt = 0.0, dt_all;
+
+    trace_begin(TRACE_COMPUTE);
+    #if defined(_OPENMP)
+    #pragma omp parallel for private(j)
+    #endif
+    for (i = 1; i <= range_row; i++)
+    {
+        for (j = 1; j <= columns; j++)
+        {
+            Temperature[i][j] += Correction[i][j];
+        }
+    }
+    trace_end(TRACE_COMPUTE);
+    trace_begin(TRACE_HALO);
+    halo_exchange(halo);
+    trace_end(TRACE_HALO);
+
+    trace_begin(TRACE_COMPUTE);
+    #if defined(_OPENMP)
+    #pragma omp parallel for private(j) reduction(max:dt)
+    #endif
+    for (i = 1; i <= range_row; i++)
+    {
+        for (j = 1; j <= columns; j++)
+        {
+            double r = Temperature[i + 1][j] + Temperature[i - 1][j] +
+                       Temperature[i][j + 1] + Temperature[i][j - 1] - 4.0 * Temperature[i][j];
+            Residual[i][j] = (float)r;
+            dt = fmax(fabs(r) * 0.25, dt);
+        }
+    }
+    memset(Correction, 0, sizeof(float) * (range_row + 2) * fpitch);
+    trace_work(TRACE_COMPUTE, REFINE_BYTES * range_row * columns, REFINE_FLOPS * range_row * columns);
+    trace_end(TRACE_COMPUTE);
+
+    trace_begin(TRACE_REDUCE);
+    MPI_Allreduce(&dt, &dt_all, 1, MPI_DOUBLE, MPI_MAX, comm);
+    trace_end(TRACE_REDUCE);
+    return dt_all;
+}
+
+// reference solve all in double: Jacobi with two toggled grids until the same criterion, the
+// vectorised sweep of the float correction written in double, so the times differ by the precision;
+// returns the solution grid of pitch doubles per row
+void *solve_double(int rows, int columns, int pitch, double max_temp_error, int max_iterations, int *iterations,
+                   int range_row, int start_row, int last_rank, MPI_Comm comm)
+{
+    int i, j;
+    int iteration = 1;
+    double dt = 100, dt_local;
+    double(*Temperature)[pitch] = laplace_alloc(range_row + 2, pitch, sizeof(double), 0, 0);
+    double(*Temperature_last)[pitch] = laplace_alloc(range_row + 2, pitch, sizeof(double), 0, 0);
+    if (Temperature == NULL || Temperature_last == NULL)
+    {
+        printf("Cannot allocate the grids of the reference solve\n");
+        MPI_Abort(comm, 1);
+    }
+
+    laplace_initialize(rows, columns, pitch, Temperature, range_row, start_row, last_rank);
+    laplace_initialize(rows, columns, pitch, Temperature_last, range_row, start_row, last_rank);
+    struct halo halos[2];
+    laplace_halo_create(&halos[0], Temperature, pitch, columns, range_row, MPI_DOUBLE, comm);
+    laplace_halo_create(&halos[1], Temperature_last, pitch, columns, range_row, MPI_DOUBLE, comm);
+    int toggle = 1;                                     // exchange of Temperature_last
+
+    while (dt > max_temp_error && iteration <= max_iterations)
+    {
+        dt_local = 0.0;
+        #if defined(_OPENMP)
+        #pragma omp parallel for private(j) reduction(max:dt_local)
+        #endif
+        for (i = 1; i <= range_row; i++)
+        {
+            #if defined(_OPENMP)
+            #pragma omp simd reduction(max:dt_local)
+            #endif
+            for (j = 1; j <= columns; j++)
+            {
+                Temperature[i][j] = 0.25 * (Temperature_last[i + 1][j] + Temperature_last[i - 1][j] +
+                                            Temperature_last[i][j + 1] + Temperature_last[i][j - 1]);
+                double d = fabs(Temperature[i][j] - Temperature_last[i][j]);
+                dt_local = d > dt_local ? d : dt_local; // fmax would stay scalar without -ffast-math
+            }
+        }
+        double(*swap)[pitch] = Temperature;
+        Temperature = Temperature_last;
+        Temperature_last = swap;
+        toggle = 1 - toggle;
+
+        MPI_Allreduce(&dt_local, &dt, 1, MPI_DOUBLE, MPI_MAX, comm);
+        halo_exchange(&halos[toggle]);
+        iteration++;
+    }
+
+    *iterations = iteration - 1;
+    halo_free(&halos[0]);
+    halo_free(&halos[1]);
+    free(Temperature);
+    return Temperature_last;
+}
@@ -0,0 +1,810 @@
+#if defined(_OPENMP)
+#include "omp.h"
+#endif
+
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <assert.h>
+
+#include "laplace.h"
+#include "../common/trace.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define rank_zero_only(statement) \
+    do                            \
+    {                             \
+        if (rank == 0)            \
+            statement;           \
+    } while (0);
+
+#define JACOBI 0
+#define REDBLACK 1
+
+#define SMOOTHER REDBLACK   // smoother of the V-cycle, damped JACOBI or REDBLACK Gauss-Seidel
+#define PRE_SMOOTH 2        // sweeps before the coarse grid correction
+#define POST_SMOOTH 2       // sweeps after the coarse grid correction
+#define JACOBI_DAMPING 0.8  // weight of damped Jacobi smoothing
+#define FMG 1               // full multigrid start instead of the all-zero interior
+#define FMG_CYCLES 1        // V-cycles on each level of the full multigrid pass
+#define COARSEST 3          // stop coarsening when rows or columns drop to this
+#define COARSE_SWEEPS 1000  // cap of smoothing sweeps on the coarsest level
+#define AGGLOMERATE_ROWS 16 // gather a level onto fewer ranks below this many rows per rank
+#define MAX_LEVELS 32
+
+// default size of plate
+#define COLUMNS 10000
+#define ROWS 10000
+
+// largest permitted change in temp (This value takes about 3400 steps)
+// here: the largest change one more Jacobi sweep would make, i.e. the scaled residual
+#define MAX_TEMP_ERROR 0.01
+
+// memory traffic and flops per cell of the kernels, for the roofline (TRACE_ROOFLINE=1);
+// the coefficients are per row and per column and stay in cache
+#if SMOOTHER == REDBLACK
+#define SMOOTH_BYTES 24.0   // a half-sweep reads u and f and writes u back, though only half the cells change
+#define SMOOTH_FLOPS 6.0    // 12 of an updated cell: 4 multiply-adds, the diagonal and the division
+#else
+#define SMOOTH_BYTES 48.0   // reads u and f and writes r, then the copy back into u
+#define SMOOTH_FLOPS 15.0
+#endif
+#define RESIDUAL_BYTES 24.0 // reads u and f, writes r
+#define RESIDUAL_FLOPS 14.0
+#define RESTRICT_BYTES 40.0 // of a coarse cell: its four fine cells read, the cell written
+#define RESTRICT_FLOPS 20.0
+#define PROLONG_BYTES 16.0  // of a fine cell: read and written, the coarse rows stay in cache
+#define PROLONG_FLOPS 10.0
+
+// one grid of the hierarchy, rows are distributed in slabs over a prefix of the ranks
+struct level
+{
+    int rows, columns;          // interior size
+    int pitch;                  // padded row length of u, f and r
+    int plate_rows, plate_columns; // interior size of the finest level, sets the boundary conditions
+    int first, range_row;       // global index of my first row, number of my rows
+    int *first_of, *range_of;   // slabs of all ranks
+    int active;                 // ranks 0..active-1 hold rows
+    int aligned;                // slab K of this level matches rows 2K of the finer slab, no redistribution
+    double *u, *f, *r;          // solution or correction, right hand side, residual, (range_row+2) x (columns+2)
+    double *row_pos, *col_pos;  // node positions in finest grid spacings, 0..rows+1 / 0..columns+1
+    double *cn, *cs, *cw, *ce;  // 5-point coefficients towards north, south, west, east neighbours
+    double *row_lo, *row_hi;    // interpolation weights from the next coarser level, per row
+    double *col_lo, *col_hi;    // and per column
+    double *row_rw, *col_rw;    // restriction weights from the next finer level, 3 per row / column
+};
+
+// helper routines
+int setup_levels(struct level *levels, int rows, int columns, int huge_pages, int rank, int size);
+
+void initialize(struct level *lv, int plate);
+
+void track_progress(struct level *lv, int cycle);
+
+void exchange_halo(struct level *lv, double *grid, int rank, MPI_Comm comm);
+
+void smooth(struct level *lv, int sweeps, int rank, MPI_Comm comm);
+
+double residual(struct level *lv);
+
+void restrict_residual(struct level *fine, struct level *coarse, int rank, int size, MPI_Comm comm);
+
+void prolongate(struct level *coarse, struct level *fine, int add, int rank, int size, MPI_Comm comm);
+
+void coarse_solve(struct level *lv, int rank, MPI_Comm comm);
+
+void vcycle(struct level *levels, int l, int nlevels, int rank, int size, MPI_Comm comm);
+
+void move_rows(double *src, int *src_first, int *src_range, double *dst, int *dst_first, int *dst_range,
+               int pitch, int rank, int size, MPI_Comm comm);
+
+int main(int argc, char **argv)
+{
+
+    int l;                                              // level index
+    int cycle = 1;                                      // current V-cycle
+    double dt = 100;                                    // largest scaled residual
+    struct timeval start_time, stop_time, elapsed_time; // timers
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 100};
+
+    int rank, size, error, nlevels;
+    double start, end, temp;
+    MPI_Comm comm = MPI_COMM_WORLD;
+    struct level levels[MAX_LEVELS];
+
+    error = MPI_Init(NULL, NULL);
+    assert(error == MPI_SUCCESS);
+
+    // Get process ID
+    MPI_Comm_rank(comm, &rank);
+    trace_init(rank);
+
+    // Get processes Number
+    MPI_Comm_size(comm, &size);
+
+    // every rank parses the same arguments, only rank 0 reports problems
+    int status = laplace_configure(argc, argv, &config, rank == 0);
+    if (status != 0)
+    {
+        MPI_Finalize();
+        return status < 0;
+    }
+
+    nlevels = setup_levels(levels, config.rows, config.columns, config.huge_pages, rank, size);
+    for (l = 0; l < nlevels && !config.quiet; l++)
+    {
+        rank_zero_only(printf("level %d: %d x %d on %d ranks%s\n", l, levels[l].rows, levels[l].columns,
+                              levels[l].active, l > 0 && !levels[l].aligned ? " (agglomerated)" : ""));
+    }
+
+    gettimeofday(&start_time, NULL); // Unix timer
+
+    initialize(&levels[0], 1); // initialize Temperature including boundary conditions
+
+    #if FMG
+    // full multigrid: solve the plate on the coarsest level, then interpolate upwards
+    // and improve every level with a few V-cycles before it is handed to the next finer one
+    start = MPI_Wtime();
+    initialize(&levels[nlevels - 1], 1);
+    coarse_solve(&levels[nlevels - 1], rank, comm);
+    for (l = nlevels - 2; l >= 0; l--)
+    {
+        initialize(&levels[l], 1);
+        prolongate(&levels[l + 1], &levels[l], 0, rank, size, comm);
+        for (int k = 0; k < FMG_CYCLES; k++)
+        {
+            vcycle(levels, l, nlevels, rank, size, comm);
+        }
+    }
+    temp = residual(&levels[0]);
+    trace_begin(TRACE_REDUCE);
+    MPI_Allreduce(&temp, &dt, 1, MPI_DOUBLE, MPI_MAX, comm);
+    trace_end(TRACE_REDUCE);
+    end = MPI_Wtime();
+    rank_zero_only(printf("full multigrid: residual %f time %lf\n", dt, end - start));
+    #endif
+
+    // V-cycles until the residual is below the tolerance or until max cycles
+    while (dt > config.max_temp_error && cycle <= config.max_iterations)
+    {
+        start = MPI_Wtime();
+        vcycle(levels, 0, nlevels, rank, size, comm);
+
+        temp = residual(&levels[0]);
+        trace_begin(TRACE_REDUCE);
+        MPI_Allreduce(&temp, &dt, 1, MPI_DOUBLE, MPI_MAX, comm);
+        trace_end(TRACE_REDUCE);
+        end = MPI_Wtime();
+        if (!config.quiet)
+            rank_zero_only(printf("cycle: %d residual: %f time: %lf\n", cycle, dt, end - start));
+
+        cycle++;
+    }
+
+    // print test values of the bottom right corner
+    if (levels[0].range_row > 0 && rank == levels[0].active - 1)
+    {
+        track_progress(&levels[0], cycle - 1);
+    }
+
+    gettimeofday(&stop_time, NULL); // Unix timer
+    timersub(&stop_time, &start_time,
+             &elapsed_time); // Unix timer substraction routine
+
+    rank_zero_only(printf("\nMax error at cycle %d was %f\n", cycle - 1, dt));
+    rank_zero_only(printf("Total time was %f seconds\n",
+           elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0)));
+
+    trace_finish();
+    MPI_Finalize();
+    for (l = 0; l < nlevels; l++)
+    {
+        free(levels[l].first_of);
+        free(levels[l].range_of);
+        free(levels[l].u);
+        free(levels[l].f);
+        free(levels[l].r);
+        free(levels[l].row_pos);
+        free(levels[l].col_pos);
+        free(levels[l].cn);
+        free(levels[l].cs);
+        free(levels[l].cw);
+        free(levels[l].ce);
+        free(levels[l].row_lo);
+        free(levels[l].row_hi);
+        free(levels[l].col_lo);
+        free(levels[l].col_hi);
+        free(levels[l].row_rw);
+        free(levels[l].col_rw);
+    }
+
+    return 0;
+}
+
+// split rows into even slabs over the first active ranks
+void balanced_slabs(struct level *lv, int active, int size)
+{
+    int r;
+    lv->active = active;
+    for (r = 0; r < size; r++)
+    {
+        int start = r < active ? (int)((long)r * lv->rows / active) : lv->rows;
+        int stop = r < active ? (int)((long)(r + 1) * lv->rows / active) : lv->rows;
+        lv->first_of[r] = start + 1;
+        lv->range_of[r] = stop - start;
+    }
+}
+
+// 5-point coefficients of a non-uniform node spacing, the finest level has all four equal to one
+void coefficients(double *pos, int n, double *lo, double *hi)
+{
+    int i;
+    for (i = 1; i <= n; i++)
+    {
+        double h_lo = pos[i] - pos[i - 1];
+        double h_hi = pos[i + 1] - pos[i];
+        lo[i] = 2.0 / (h_lo * (h_lo + h_hi));
+        hi[i] = 2.0 / (h_hi * (h_lo + h_hi));
+    }
+}
+
+// coarse nodes are the even fine nodes plus the far boundary, so any size coarsens,
+// fine node i sits between coarse i/2 and i/2+1
+void transfer_weights(double *pos, int n, double *pos_coarse, double *lo, double *hi, double *rw)
+{
+    int i, k;
+    int nc = n / 2;
+    for (k = 0; k <= nc; k++)
+    {
+        pos_coarse[k] = pos[2 * k];
+    }
+    pos_coarse[nc + 1] = pos[n + 1];
+
+    for (i = 1; i <= n; i++)
+    {
+        if (i % 2 == 0)
+        {
+            lo[i] = 1.0;
+            hi[i] = 0.0;
+        }
+        else
+        {
+            lo[i] = (pos[i + 1] - pos[i]) / (pos[i + 1] - pos[i - 1]);
+            hi[i] = 1.0 - lo[i];
+        }
+    }
+
+    // restriction is the transpose of interpolation, scaled to an average
+    for (k = 1; k <= nc; k++)
+    {
+        double w_lo = hi[2 * k - 1];
+        double w_hi = 2 * k + 1 <= n ? lo[2 * k + 1] : 0.0;
+        double sum = w_lo + 1.0 + w_hi;
+        rw[3 * k] = w_lo / sum;
+        rw[3 * k + 1] = 1.0 / sum;
+        rw[3 * k + 2] = w_hi / sum;
+    }
+}
+
+// build the grid hierarchy, returns the number of levels
+int setup_levels(struct level *levels, int rows, int columns, int huge_pages, int rank, int size)
+{
+    int l, i, r;
+    int nlevels = 1;
+    struct level *lv = &levels[0];
+
+    memset(levels, 0, sizeof(struct level) * MAX_LEVELS);
+    lv->rows = rows;
+    lv->columns = columns;
+    lv->first_of = (int *)malloc(sizeof(int) * size);
+    lv->range_of = (int *)malloc(sizeof(int) * size);
+    balanced_slabs(lv, min(size, rows), size);
+    lv->aligned = 1;
+    lv->row_pos = (double *)malloc(sizeof(double) * (rows + 2));
+    lv->col_pos = (double *)malloc(sizeof(double) * (columns + 2));
+    for (i = 0; i <= rows + 1; i++)
+    {
+        lv->row_pos[i] = i;
+    }
+    for (i = 0; i <= columns + 1; i++)
+    {
+        lv->col_pos[i] = i;
+    }
+
+    while (nlevels < MAX_LEVELS && lv->rows / 2 >= COARSEST && lv->columns / 2 >= COARSEST)
+    {
+        struct level *coarse = &levels[nlevels];
+        int aligned = 1;
+
+        coarse->rows = lv->rows / 2;
+        coarse->columns = lv->columns / 2;
+        coarse->first_of = (int *)malloc(sizeof(int) * size);
+        coarse->range_of = (int *)malloc(sizeof(int) * size);
+        coarse->row_pos = (double *)malloc(sizeof(double) * (coarse->rows + 2));
+        coarse->col_pos = (double *)malloc(sizeof(double) * (coarse->columns + 2));
+        lv->row_lo = (double *)malloc(sizeof(double) * (lv->rows + 2));
+        lv->row_hi = (double *)malloc(sizeof(double) * (lv->rows + 2));
+        lv->col_lo = (double *)malloc(sizeof(double) * (lv->columns + 2));
+        lv->col_hi = (double *)malloc(sizeof(double) * (lv->columns + 2));
+        coarse->row_rw = (double *)malloc(sizeof(double) * 3 * (coarse->rows + 2));
+        coarse->col_rw = (double *)malloc(sizeof(double) * 3 * (coarse->columns + 2));
+        transfer_weights(lv->row_pos, lv->rows, coarse->row_pos, lv->row_lo, lv->row_hi, coarse->row_rw);
+        transfer_weights(lv->col_pos, lv->columns, coarse->col_pos, lv->col_lo, lv->col_hi, coarse->col_rw);
+
+        // keep the coarse rows where their fine rows are while there are enough of them,
+        // otherwise gather the level onto fewer ranks
+        for (r = 0; r < size; r++)
+        {
+            int first = (lv->first_of[r] + 1) / 2;
+            int last = min((lv->first_of[r] + lv->range_of[r] - 1) / 2, coarse->rows);
+            coarse->first_of[r] = first;
+            coarse->range_of[r] = max(0, last - first + 1);
+            if (r < lv->active && coarse->range_of[r] == 0)
+            {
+                aligned = 0;
+            }
+        }
+        if (aligned && coarse->rows / lv->active >= AGGLOMERATE_ROWS)
+        {
+            coarse->active = lv->active;
+            coarse->aligned = 1;
+        }
+        else
+        {
+            balanced_slabs(coarse, max(1, min(lv->active, coarse->rows / AGGLOMERATE_ROWS)), size);
+            coarse->aligned = 0;
+        }
+
+        lv = coarse;
+        nlevels++;
+    }
+
+    for (l = 0; l < nlevels; l++)
+    {
+        lv = &levels[l];
+        lv->plate_rows = rows;
+        lv->plate_columns = columns;
+        lv->first = lv->first_of[rank];
+        lv->range_row = lv->range_of[rank];
+        lv->cn = (double *)malloc(sizeof(double) * (lv->rows + 2));
+        lv->cs = (double *)malloc(sizeof(double) * (lv->rows + 2));
+        lv->cw = (double *)malloc(sizeof(double) * (lv->columns + 2));
+        lv->ce = (double *)malloc(sizeof(double) * (lv->columns + 2));
+        coefficients(lv->row_pos, lv->rows, lv->cn, lv->cs);
+        coefficients(lv->col_pos, lv->columns, lv->cw, lv->ce);
+        lv->pitch = laplace_pitch(lv->columns + 2, sizeof(double));
+        lv->u = laplace_alloc(lv->range_row + 2, lv->pitch, sizeof(double), 0, huge_pages);
+        lv->r = laplace_alloc(lv->range_row + 2, lv->pitch, sizeof(double), 0, huge_pages);
+        // the plate itself has no sources, only the correction levels need a right hand side
+        if (l > 0)
+        {
+            lv->f = laplace_alloc(lv->range_row + 2, lv->pitch, sizeof(double), 0, huge_pages);
+        }
+        if (lv->u == NULL || lv->r == NULL || (l > 0 && lv->f == NULL))
+        {
+            printf("Rank %d cannot allocate the grids of level %d\n", rank, l);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    return nlevels;
+}
+
+// initialize a level with an all-zero interior and boundary conditions,
+// the plate ones (as in the other laplace codes) or zero for a correction
+void initialize(struct level *lv, int plate)
+{
+    int i, j;
+    double(*u)[lv->pitch] = (double(*)[lv->pitch]) lv->u;
+
+    for (i = 0; i <= lv->range_row + 1; i++)
+    {
+        for (j = 0; j <= lv->columns + 1; j++)
+        {
+            u[i][j] = 0.0;
+        }
+    }
+    if (!plate || lv->range_row == 0)
+    {
+        return;
+    }
+
+    // these boundary conditions never change thoughout run
+    // set left side to 0 and right side to a linear increase
+    for (i = 0; i <= lv->range_row + 1; i++)
+    {
+        u[i][lv->columns + 1] = (100.0 / lv->plate_rows) * lv->row_pos[i + lv->first - 1];
+    }
+
+    // set top to 0 and bottom to linear increase (only need to set in last rank)
+    if (lv->first + lv->range_row - 1 == lv->rows)
+    {
+        for (j = 0; j <= lv->columns + 1; j++)
+        {
+            u[lv->range_row + 1][j] = (100.0 / lv->plate_columns) * lv->col_pos[j];
+        }
+    }
+}
+
+// print diagonal in bottom right corner where most action is
+void track_progress(struct level *lv, int cycle)
+{
+    int i;
+    int range_row = lv->range_row;
+    int start_row = lv->first - 1;
+    double(*Temperature)[lv->pitch] = (double(*)[lv->pitch]) lv->u;
+
+    printf("--------- Cycle number: %d ---------\n", cycle);
+    for (i = max(1, range_row - 5); i <= range_row; i++)
+    {
+        printf("[%d,%d]: %5.2f ", i + start_row, i + start_row, Temperature[i][lv->columns + i - range_row]);
+    }
+    printf("\n");
+}
+
+// exchange boundary rows with the neighbouring active ranks of a level
+void exchange_halo(struct level *lv, double *grid, int rank, MPI_Comm comm)
+{
+    int count = lv->columns;
+    int range_row = lv->range_row;
+    double(*Temperature)[lv->pitch] = (double(*)[lv->pitch]) grid;
+    MPI_Request req[4];
+    int n = 0;
+
+    if (rank >= lv->active)
+    {
+        return;
+    }
+    trace_begin(TRACE_HALO);
+    if (rank + 1 < lv->active)
+    {
+        MPI_Irecv(&(Temperature[range_row + 1][1]), count, MPI_DOUBLE, rank + 1, 1, comm, &req[n++]);
+        MPI_Isend(&(Temperature[range_row][1]), count, MPI_DOUBLE, rank + 1, 2, comm, &req[n++]);
+    }
+    if (rank > 0)
+    {
+        MPI_Irecv(&(Temperature[0][1]), count, MPI_DOUBLE, rank - 1, 2, comm, &req[n++]);
+        MPI_Isend(&(Temperature[1][1]), count, MPI_DOUBLE, rank - 1, 1, comm, &req[n++]);
+    }
+    MPI_Waitall(n, req, MPI_STATUSES_IGNORE);
+    trace_end(TRACE_HALO);
+}
+
+// smoothing sweeps on A u = f, halos of u are up to date afterwards
+void smooth(struct level *lv, int sweeps, int rank, MPI_Comm comm)
+{
+    int columns = lv->columns;
+    int range_row = lv->range_row;
+    int first = lv->first;
+    double *cn = lv->cn, *cs = lv->cs, *cw = lv->cw, *ce = lv->ce;
+    double(*u)[lv->pitch] = (double(*)[lv->pitch]) lv->u;
+    double(*f)[lv->pitch] = (double(*)[lv->pitch]) lv->f;
+
+    for (int sweep = 0; sweep < sweeps; sweep++)
+    {
+        #if SMOOTHER == REDBLACK
+        for (int colour = 0; colour <= 1; colour++)
+        {
+            trace_begin(TRACE_COMPUTE);
+            #if defined(_OPENMP)
+            #pragma omp parallel for
+            #endif
+            for (int i = 1; i <= range_row; i++)
+            {
+                int gi = i + first - 1;
+                // colour is the parity of the global (row + column), first j of this colour
+                for (int j = 1 + (gi + 1 + colour) % 2; j <= columns; j += 2)
+                {
+                    double rhs = f ? f[i][j] : 0.0;
+                    u[i][j] = (rhs + cn[gi] * u[i - 1][j] + cs[gi] * u[i + 1][j] +
+                               cw[j] * u[i][j - 1] + ce[j] * u[i][j + 1]) /
+                              (cn[gi] + cs[gi] + cw[j] + ce[j]);
+                }
+            }
+            trace_work(TRACE_COMPUTE, SMOOTH_BYTES * range_row * columns, SMOOTH_FLOPS * range_row * columns);
+            trace_end(TRACE_COMPUTE);
+            exchange_halo(lv, lv->u, rank, comm);
+        }
+        #else
+        double(*r)[lv->pitch] = (double(*)[lv->pitch]) lv->r;
+        trace_begin(TRACE_COMPUTE);
+        #if defined(_OPENMP)
+        #pragma omp parallel for
+        #endif
+        for (int i = 1; i <= range_row; i++)
+        {
+            int gi = i + first - 1;
+            for (int j = 1; j <= columns; j++)
+            {
+                double rhs = f ? f[i][j] : 0.0;
+                double diag = cn[gi] + cs[gi] + cw[j] + ce[j];
+                r[i][j] = u[i][j] + JACOBI_DAMPING * ((rhs + cn[gi] * u[i - 1][j] + cs[gi] * u[i + 1][j] +
+                                                       cw[j] * u[i][j - 1] + ce[j] * u[i][j + 1]) / diag - u[i][j]);
+            }
+        }
+        #if defined(_OPENMP)
+        #pragma omp parallel for
+        #endif
+        for (int i = 1; i <= range_row; i++)
+        {
+            for (int j = 1; j <= columns; j++)
+            {
+                u[i][j] = r[i][j];
+            }
+        }
+        trace_work(TRACE_COMPUTE, SMOOTH_BYTES * range_row * columns, SMOOTH_FLOPS * range_row * columns);
+        trace_end(TRACE_COMPUTE);
+        exchange_halo(lv, lv->u, rank, comm);
+        #endif
+    }
+}
+
+// r = f - A u on my rows, returns the largest |r| / diagonal,
+// which on the plate is the change one Jacobi sweep would make
+double residual(struct level *lv)
+{
+    int columns = lv->columns;
+    int range_row = lv->range_row;
+    int first = lv->first;
+    double *cn = lv->cn, *cs = lv->cs, *cw = lv->cw, *ce = lv->ce;
+    double(*u)[lv->pitch] = (double(*)[lv->pitch]) lv->u;
+    double(*f)[lv->pitch] = (double(*)[lv->pitch]) lv->f;
+    double(*r)[lv->pitch] = (double(*)[lv->pitch]) lv->r;
+    double dt = 0.0;
+
+    trace_begin(TRACE_COMPUTE);
+    #if defined(_OPENMP)
+    #pragma omp parallel for reduction(max:dt)
+    #endif
+    for (int i = 1; i <= range_row; i++)
+    {
+        int gi = i + first - 1;
+        for (int j = 1; j <= columns; j++)
+        {
+            double rhs = f ? f[i][j] : 0.0;
+            double diag = cn[gi] + cs[gi] + cw[j] + ce[j];
+            r[i][j] = rhs + cn[gi] * u[i - 1][j] + cs[gi] * u[i + 1][j] +
+                      cw[j] * u[i][j - 1] + ce[j] * u[i][j + 1] - diag * u[i][j];
+            dt = fmax(fabs(r[i][j]) / diag, dt);
+        }
+    }
+    trace_work(TRACE_COMPUTE, RESIDUAL_BYTES * range_row * columns, RESIDUAL_FLOPS * range_row * columns);
+    trace_end(TRACE_COMPUTE);
+    return dt;
+}
+
+// full weighting of the fine residual into the coarse right hand side
+void restrict_residual(struct level *fine, struct level *coarse, int rank, int size, MPI_Comm comm)
+{
+    int r;
+    int coarse_columns = coarse->columns;
+    int pitch = coarse->pitch;
+    // coarse rows whose centre row 2K is one of my fine rows
+    int first = (fine->first + 1) / 2;
+    int last = min((fine->first + fine->range_row - 1) / 2, coarse->rows);
+    int range = fine->range_row > 0 ? max(0, last - first + 1) : 0;
+    double *rw = coarse->row_rw, *cw = coarse->col_rw;
+    double(*res)[fine->pitch] = (double(*)[fine->pitch]) fine->r;
+    double *target = coarse->f;
+
+    exchange_halo(fine, fine->r, rank, comm);
+    if (!coarse->aligned)
+    {
+        target = (double *)calloc((size_t)(range + 1) * pitch, sizeof(double));
+    }
+    double(*f)[pitch] = (double(*)[pitch]) target;
+
+    trace_begin(TRACE_COMPUTE);
+    #if defined(_OPENMP)
+    #pragma omp parallel for
+    #endif
+    for (int k = first; k <= first + range - 1; k++)
+    {
+        int i = 2 * k - fine->first + 1; // my local fine row of the centre
+        int fk = coarse->aligned ? k - first + 1 : k - first;
+        for (int c = 1; c <= coarse_columns; c++)
+        {
+            int j = 2 * c;
+            double sum = 0.0;
+            for (int a = -1; a <= 1; a++)
+            {
+                sum += rw[3 * k + a + 1] * (cw[3 * c] * res[i + a][j - 1] + cw[3 * c + 1] * res[i + a][j] +
+                                            cw[3 * c + 2] * res[i + a][j + 1]);
+            }
+            f[fk][c] = sum;
+        }
+    }
+    trace_work(TRACE_COMPUTE, RESTRICT_BYTES * range * coarse_columns, RESTRICT_FLOPS * range * coarse_columns);
+    trace_end(TRACE_COMPUTE);
+
+    if (!coarse->aligned)
+    {
+        // hand the rows over to the ranks that hold this level
+        int *src_first = (int *)malloc(sizeof(int) * size);
+        int *src_range = (int *)malloc(sizeof(int) * size);
+        for (r = 0; r < size; r++)
+        {
+            src_first[r] = (fine->first_of[r] + 1) / 2;
+            src_range[r] = fine->range_of[r] > 0
+                               ? max(0, min((fine->first_of[r] + fine->range_of[r] - 1) / 2, coarse->rows) - src_first[r] + 1)
+                               : 0;
+        }
+        move_rows(target, src_first, src_range, coarse->f + pitch, coarse->first_of, coarse->range_of,
+                  pitch, rank, size, comm);
+        free(src_first);
+        free(src_range);
+        free(target);
+    }
+}
+
+// bilinear interpolation of the coarse grid onto the fine one, added to it as a
+// correction or replacing its interior as the start of full multigrid
+void prolongate(struct level *coarse, struct level *fine, int add, int rank, int size, MPI_Comm comm)
+{
+    int r, i;
+    int columns = fine->columns;
+    int pitch = coarse->pitch;
+    double *lo = fine->row_lo, *hi = fine->row_hi, *clo = fine->col_lo, *chi = fine->col_hi;
+    double(*u)[fine->pitch] = (double(*)[fine->pitch]) fine->u;
+    double *source = coarse->u;
+    // coarse rows i/2 and i/2+1 of my fine rows, stored from row offset
+    int offset = coarse->first - 1;
+
+    if (coarse->aligned)
+    {
+        exchange_halo(coarse, coarse->u, rank, comm);
+    }
+    else
+    {
+        int *need_first = (int *)malloc(sizeof(int) * size);
+        int *need_range = (int *)malloc(sizeof(int) * size);
+        int lo_row = fine->first / 2;
+        int hi_row = (fine->first + fine->range_row - 1) / 2 + 1;
+        for (r = 0; r < size; r++)
+        {
+            need_first[r] = max(1, fine->first_of[r] / 2);
+            need_range[r] = fine->range_of[r] > 0
+                                ? min(coarse->rows, (fine->first_of[r] + fine->range_of[r] - 1) / 2 + 1) - need_first[r] + 1
+                                : 0;
+        }
+        offset = lo_row;
+        source = (double *)calloc((size_t)max(0, hi_row - lo_row + 1) * pitch, sizeof(double));
+        move_rows(coarse->u + pitch, coarse->first_of, coarse->range_of, source + (size_t)(need_first[rank] - lo_row) * pitch,
+                  need_first, need_range, pitch, rank, size, comm);
+        // boundary rows are not held by anyone: the top one and a correction are zero,
+        // the bottom of the plate is its linear increase
+        if (fine->range_row > 0 && !add && hi_row == coarse->rows + 1)
+        {
+            for (i = 0; i <= coarse->columns + 1; i++)
+            {
+                source[(size_t)(hi_row - lo_row) * pitch + i] = (100.0 / coarse->plate_columns) * coarse->col_pos[i];
+            }
+        }
+        free(need_first);
+        free(need_range);
+    }
+    double(*uc)[pitch] = (double(*)[pitch]) source;
+
+    trace_begin(TRACE_COMPUTE);
+    #if defined(_OPENMP)
+    #pragma omp parallel for
+    #endif
+    for (int li = 1; li <= fine->range_row; li++)
+    {
+        int gi = li + fine->first - 1;
+        int k = gi / 2 - offset;
+        for (int j = 1; j <= columns; j++)
+        {
+            int c = j / 2;
+            double value = lo[gi] * (clo[j] * uc[k][c] + chi[j] * uc[k][c + 1]) +
+                           hi[gi] * (clo[j] * uc[k + 1][c] + chi[j] * uc[k + 1][c + 1]);
+            u[li][j] = add ? u[li][j] + value : value;
+        }
+    }
+    trace_work(TRACE_COMPUTE, PROLONG_BYTES * fine->range_row * columns, PROLONG_FLOPS * fine->range_row * columns);
+    trace_end(TRACE_COMPUTE);
+
+    if (!coarse->aligned)
+    {
+        free(source);
+    }
+    exchange_halo(fine, fine->u, rank, comm);
+}
+
+// smooth the coarsest level until its residual has dropped by three orders
+void coarse_solve(struct level *lv, int rank, MPI_Comm comm)
+{
+    double local, initial, current;
+    int sweeps;
+
+    exchange_halo(lv, lv->u, rank, comm);
+    local = lv->range_row > 0 ? residual(lv) : 0.0;
+    trace_begin(TRACE_REDUCE);
+    MPI_Allreduce(&local, &initial, 1, MPI_DOUBLE, MPI_MAX, comm);
+    trace_end(TRACE_REDUCE);
+    current = initial;
+    for (sweeps = 0; sweeps < COARSE_SWEEPS && current > 1e-3 * initial; sweeps += 10)
+    {
+        if (rank < lv->active)
+        {
+            smooth(lv, 10, rank, comm);
+        }
+        local = lv->range_row > 0 ? residual(lv) : 0.0;
+        trace_begin(TRACE_REDUCE);
+        MPI_Allreduce(&local, &current, 1, MPI_DOUBLE, MPI_MAX, comm);
+        trace_end(TRACE_REDUCE);
+    }
+}
+
+// one V-cycle on level l, the coarser levels solve for the correction
+void vcycle(struct level *levels, int l, int nlevels, int rank, int size, MPI_Comm comm)
+{
+    struct level *lv = &levels[l];
+
+    if (l == nlevels - 1)
+    {
+        coarse_solve(lv, rank, comm);
+        return;
+    }
+
+    if (rank < lv->active)
+    {
+        smooth(lv, PRE_SMOOTH, rank, comm);
+        residual(lv);
+    }
+    restrict_residual(lv, &levels[l + 1], rank, size, comm);
+
+    initialize(&levels[l + 1], 0);
+    vcycle(levels, l + 1, nlevels, rank, size, comm);
+    prolongate(&levels[l + 1], lv, 1, rank, size, comm);
+
+    if (rank < lv->active)
+    {
+        smooth(lv, POST_SMOOTH, rank, comm);
+    }
+}
+
+// redistribute whole rows between two slab layouts of the same level,
+// src holds rows src_first[rank].. and dst receives rows dst_first[rank]..
+// the traces count it with the halo exchanges
+void move_rows(double *src, int *src_first, int *src_range, double *dst, int *dst_first, int *dst_range,
+               int pitch, int rank, int size, MPI_Comm comm)
+{
+    int r;
+    int *sendcounts = (int *)calloc(size, sizeof(int));
+    int *senddispls = (int *)calloc(size, sizeof(int));
+    int *recvcounts = (int *)calloc(size, sizeof(int));
+    int *recvdispls = (int *)calloc(size, sizeof(int));
+
+    for (r = 0; r < size; r++)
+    {
+        // my source rows that rank r wants
+        int first = max(src_first[rank], dst_first[r]);
+        int last = min(src_first[rank] + src_range[rank], dst_first[r] + dst_range[r]) - 1;
+        if (last >= first && src_range[rank] > 0 && dst_range[r] > 0)
+        {
+            sendcounts[r] = (last - first + 1) * pitch;
+            senddispls[r] = (first - src_first[rank]) * pitch;
+        }
+        // rows of rank r that I want
+        first = max(src_first[r], dst_first[rank]);
+        last = min(src_first[r] + src_range[r], dst_first[rank] + dst_range[rank]) - 1;
+        if (last >= first && src_range[r] > 0 && dst_range[rank] > 0)
+        {
+            recvcounts[r] = (last - first + 1) * pitch;
+            recvdispls[r] = (first - dst_first[rank]) * pitch;
+        }
+    }
+    trace_begin(TRACE_HALO);
+    MPI_Alltoallv(src, sendcounts, senddispls, MPI_DOUBLE, dst, recvcounts, recvdispls, MPI_DOUBLE, comm);
+    trace_end(TRACE_HALO);
+
+    free(sendcounts);
+    free(senddispls);
+    free(recvcounts);
+    free(recvdispls);
+}
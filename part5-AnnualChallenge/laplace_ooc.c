@@ -0,0 +1,446 @@
+#define _GNU_SOURCE // sync_file_range
+
+#if defined(_OPENMP)
+#include "omp.h"
+#endif
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "laplace.h"
+#include "laplaceio.h"
+#include "../common/trace.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define TIME_BLOCK 8     // Jacobi iterations applied to the plate in one streaming pass over the file
+#define BAND_BYTES (64 << 20) // rows are prefetched, written back and evicted in bands of about this size
+#define COLUMN_CHUNK 2048 // columns of one piece of work for a thread
+
+// default size of plate
+#define COLUMNS 10000
+#define ROWS 10000
+
+// largest permitted change in temp (This value takes about 3400 steps)
+#define MAX_TEMP_ERROR 0.01
+
+// memory traffic and flops per cell of a pass, for the roofline (TRACE_ROOFLINE=1): the pass reads
+// and writes every cell of the file once, however many iterations it applies, the rings stay in cache
+#define PASS_BYTES 16.0
+#define CELL_FLOPS 5.0  // of every iteration: 3 adds and a multiply of the stencil, the difference for dt
+
+// default plate file
+#define PLATE_FILE "plate.ooc"
+
+// open_plate: the file was left in the middle of a pass
+#define PLATE_TORN -2
+
+enum advice
+{
+    PREFETCH, // start reading ahead
+    WRITE,    // start writing back
+    RELEASE   // wait for the write back and drop the pages
+};
+
+// the plate file: a laplace_header and the (rows + 2) x (columns + 2) doubles, mapped as a whole
+struct plate
+{
+    int fd;
+    char *map;
+    size_t bytes;
+    struct laplace_header *header;
+    double *cells;    // row x starts at cells + x * (columns + 2)
+    int band_rows;    // rows of a band
+};
+
+// helper routines
+int open_plate(struct plate *plate, const char *path, int rows, int columns);
+
+void initialize(struct plate *plate, int rows, int columns);
+
+void advise(struct plate *plate, int columns, int first, int last, enum advice what);
+
+void stream_pass(struct plate *plate, int rows, int columns, int steps, double *ring, int threads, double *dt);
+
+double jacobi_row(double *restrict out, const double *restrict up, const double *restrict mid,
+                  const double *restrict down, int first, int last);
+
+void track_progress(struct plate *plate, int columns, int iteration, int rows);
+
+int main(int argc, char **argv)
+{
+    double dt = 100;                                    // largest chaneg in t
+    struct timeval start_time, stop_time, elapsed_time; // timers
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 4000, .progress = 100};
+    struct plate plate;
+
+    int status = laplace_configure(argc, argv, &config, 1);
+    if (status != 0)
+    {
+        return status < 0;
+    }
+    trace_init(0);
+    int rows = config.rows, columns = config.columns;
+    // the plate file is the checkpoint and the output, after the options or with -o
+    if (config.checkpoint != NULL || config.restart != NULL || config.snapshot != NULL || config.cache != NULL)
+    {
+        printf("-C, -R, -s and -W do not apply, the plate file is the checkpoint: %s [options] [-o] [plate file]\n",
+               argv[0]);
+        return 1;
+    }
+    if (config.output != NULL && optind < argc)
+    {
+        printf("Plate file given twice, %s and %s\n", config.output, argv[optind]);
+        return 1;
+    }
+    const char *path = config.output != NULL ? config.output : optind < argc ? argv[optind] : PLATE_FILE;
+
+    #if defined(_OPENMP)
+    int threads = omp_get_max_threads();
+    #else
+    int threads = 1;
+    #endif
+
+    gettimeofday(&start_time, NULL); // Unix timer
+
+    // the plate lives in the file; one that is already there is continued where it stopped
+    int iteration = open_plate(&plate, path, rows, columns);
+    if (iteration == PLATE_TORN)
+    {
+        // rows of two iterations, and the ones the pass still needed are overwritten
+        printf("%s was left in the middle of a pass and cannot be continued, remove it to start over\n", path);
+        return 1;
+    }
+    if (iteration < 0)
+    {
+        printf("Cannot use %s as the plate file of a %d x %d plate\n", path, rows, columns);
+        return 1;
+    }
+    if (iteration > 0)
+    {
+        dt = plate.header->dt;
+        printf("Continuing %s after iteration %d, dt %f\n", path, iteration, dt);
+    }
+    printf("Out of core %d x %d plate in %s, %.2f GB, bands of %d rows, %d iterations per pass, %d threads\n",
+           rows, columns, path, plate.bytes / 1e9, plate.band_rows, TIME_BLOCK, threads);
+
+    // per time level of a pass: 4 rows in a ring
+    double *ring = (double *)malloc(sizeof(double) * 4 * (TIME_BLOCK + 1) * (columns + 2));
+    double level_dt[TIME_BLOCK + 1];                    // largest change of every iteration of a pass
+    int converged = iteration;                          // first iteration below the tolerance, as reported
+    double converged_dt = dt;
+
+    // every pass streams the file once and moves the whole plate TIME_BLOCK iterations on,
+    // dt is the largest change of the last of them
+    while (dt > config.max_temp_error && iteration < config.max_iterations)
+    {
+        int steps = min(TIME_BLOCK, config.max_iterations - iteration);
+        struct timeval pass_start, pass_stop, pass_time;
+        gettimeofday(&pass_start, NULL);
+
+        // the file is in between two iterations during a pass, the mark is cleared when it is whole again
+        trace_begin(TRACE_IO);
+        plate.header->reserved = 1;
+        msync(plate.map, sizeof(struct laplace_header), MS_SYNC);
+        trace_end(TRACE_IO);
+        trace_begin(TRACE_COMPUTE);
+        stream_pass(&plate, rows, columns, steps, ring, threads, level_dt);
+        trace_work(TRACE_COMPUTE, PASS_BYTES * rows * columns, CELL_FLOPS * steps * rows * columns);
+        trace_end(TRACE_COMPUTE);
+        // the other solvers stop at the first iteration below the tolerance, this one only at the end
+        // of the pass; the iteration and dt reported are those of that first iteration
+        int t = 1;
+        while (t < steps && level_dt[t] > config.max_temp_error)
+        {
+            t++;
+        }
+        converged = iteration + t;
+        converged_dt = level_dt[t];
+        dt = level_dt[steps];
+        iteration += steps;
+        trace_begin(TRACE_IO);
+        msync(plate.map, plate.bytes, MS_SYNC);
+        plate.header->iteration = iteration;
+        plate.header->dt = dt;
+        plate.header->reserved = 0;
+        msync(plate.map, sizeof(struct laplace_header), MS_SYNC);
+        trace_end(TRACE_IO);
+
+        if (!config.quiet)
+        {
+            gettimeofday(&pass_stop, NULL);
+            timersub(&pass_stop, &pass_start, &pass_time);
+            printf("pass to iteration %d: %f s, dt %f\n", iteration, pass_time.tv_sec + pass_time.tv_usec / 1000000.0, dt);
+        }
+        // periodically print test values
+        if (config.progress && iteration / config.progress != (iteration - steps) / config.progress)
+        {
+            track_progress(&plate, columns, iteration, rows);
+        }
+    }
+
+    gettimeofday(&stop_time, NULL); // Unix timer
+    timersub(&stop_time, &start_time,
+             &elapsed_time); // Unix timer substraction routine
+
+    printf("\nMax error at iteration %d was %f\n", converged, converged_dt);
+    printf("Total time was %f seconds\n", elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0));
+    printf("Field in %s after iteration %d\n", path, iteration);
+
+    trace_finish();
+
+    free(ring);
+    munmap(plate.map, plate.bytes);
+    close(plate.fd);
+    return 0;
+}
+
+// map the plate file at path, created with the initial plate if it is missing; returns the iteration
+// it holds, PLATE_TORN if it was left in the middle of a pass, -1 if it is of another plate size
+int open_plate(struct plate *plate, const char *path, int rows, int columns)
+{
+    struct stat info;
+    size_t row_bytes = sizeof(double) * (columns + 2);
+    int fresh = stat(path, &info) != 0;
+
+    plate->bytes = sizeof(struct laplace_header) + (rows + 2) * row_bytes;
+    plate->band_rows = BAND_BYTES / row_bytes > 1 ? BAND_BYTES / row_bytes : 1;
+    plate->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (plate->fd < 0 || (!fresh && (size_t)info.st_size != plate->bytes) ||
+        (fresh && ftruncate(plate->fd, plate->bytes) != 0))
+    {
+        return -1;
+    }
+    plate->map = (char *)mmap(NULL, plate->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, plate->fd, 0);
+    if (plate->map == MAP_FAILED)
+    {
+        close(plate->fd);
+        return -1;
+    }
+    plate->header = (struct laplace_header *)plate->map;
+    plate->cells = (double *)(plate->map + sizeof(struct laplace_header));
+
+    if (fresh)
+    {
+        initialize(plate, rows, columns);
+        return 0;
+    }
+    if (strncmp(plate->header->magic, "LAPLACE", sizeof(plate->header->magic)) != 0 ||
+        plate->header->rows != rows || plate->header->columns != columns || plate->header->reserved != 0)
+    {
+        int torn = plate->header->reserved != 0;
+        munmap(plate->map, plate->bytes);
+        close(plate->fd);
+        return torn ? PLATE_TORN : -1;
+    }
+    return plate->header->iteration;
+}
+
+// initial plate and boundary conditions into a new (zero) file, band by band
+void initialize(struct plate *plate, int rows, int columns)
+{
+    int i, j, band;
+
+    memset(plate->header, 0, sizeof(struct laplace_header));
+    strcpy(plate->header->magic, "LAPLACE");
+    plate->header->rows = rows;
+    plate->header->columns = columns;
+
+    // these boundary conditions never change thoughout run
+    // set left side to 0 and right side to a linear increase
+    for (band = 0; band <= rows + 1; band += plate->band_rows)
+    {
+        int last = min(band + plate->band_rows, rows + 2) - 1;
+        for (i = band; i <= last; i++)
+        {
+            plate->cells[(size_t)i * (columns + 2) + columns + 1] = (100.0 / rows) * i;
+        }
+        advise(plate, columns, band, last, WRITE);
+        if (band > 0)
+        {
+            advise(plate, columns, band - plate->band_rows, band - 1, RELEASE);
+        }
+    }
+
+    // set top to 0 and bottom to linear increase
+    for (j = 0; j <= columns + 1; j++)
+    {
+        plate->cells[(size_t)(rows + 1) * (columns + 2) + j] = (100.0 / columns) * j;
+    }
+    msync(plate->map, plate->bytes, MS_SYNC);
+}
+
+// prefetch, write back or release plate rows first..last of the file; page cache hints only, the
+// data is always right. A release keeps pages shared with rows outside the band
+void advise(struct plate *plate, int columns, int first, int last, enum advice what)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t row_bytes = sizeof(double) * (columns + 2);
+    size_t begin = sizeof(struct laplace_header) + first * row_bytes;
+    size_t end = sizeof(struct laplace_header) + (last + 1) * row_bytes;
+
+    if (what == RELEASE)
+    {
+        begin = (begin + page - 1) / page * page;
+        end = end / page * page;
+    }
+    else
+    {
+        begin = begin / page * page;
+    }
+    if (end <= begin)
+    {
+        return;
+    }
+
+    switch (what)
+    {
+    case PREFETCH:
+        madvise(plate->map + begin, end - begin, MADV_WILLNEED);
+        break;
+    case WRITE:
+        #if defined(SYNC_FILE_RANGE_WRITE)
+        sync_file_range(plate->fd, begin, end - begin, SYNC_FILE_RANGE_WRITE);
+        #endif
+        break;
+    case RELEASE:
+        #if defined(SYNC_FILE_RANGE_WRITE)
+        sync_file_range(plate->fd, begin, end - begin,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        #endif
+        madvise(plate->map + begin, end - begin, MADV_DONTNEED);
+        posix_fadvise(plate->fd, begin, end - begin, POSIX_FADV_DONTNEED);
+        break;
+    }
+}
+
+// steps Jacobi iterations in one pass over the file, dt[t] is the largest change of iteration t of them.
+// Time level 0 are the rows of the file, level t the plate after t iterations. In step r of the
+// pass level 0 reads row r and level t computes row r - 2t from rows r - 2t - 1 .. r - 2t + 1 of
+// level t - 1, which were complete one step earlier, so all levels of a step run in parallel. Every
+// level below the last keeps its latest 4 rows in ring, the last one writes its row back into the
+// file, well behind the rows still to be read. The next band is prefetched while the current one
+// is read, a band is written back once the last level is done with it and dropped one band later.
+void stream_pass(struct plate *plate, int rows, int columns, int steps, double *ring, int threads, double *dt)
+{
+    int r, work, band_rows = plate->band_rows;
+    size_t width = columns + 2;
+    int chunks = (columns + COLUMN_CHUNK - 1) / COLUMN_CHUNK;
+    double level[TIME_BLOCK + 1] = {0.0};
+    #define LEVEL_ROW(t, x) (ring + ((size_t)(t) * 4 + (x) % 4) * width)
+    #define FILE_ROW(x) (plate->cells + (size_t)(x) * width)
+
+    advise(plate, columns, 0, min(band_rows, rows + 2) - 1, PREFETCH);
+
+    #if defined(_OPENMP)
+    #pragma omp parallel num_threads(threads) private(r, work) reduction(max:level)
+    #else
+    (void)threads;
+    #endif
+    for (r = 0; r <= rows + 1 + 2 * steps; r++)
+    {
+        #if defined(_OPENMP)
+        #pragma omp single
+        #endif
+        {
+            // level 0: the next row of the file, the band after it is read ahead
+            if (r <= rows + 1)
+            {
+                if (r % band_rows == 0 && r + band_rows <= rows + 1)
+                {
+                    advise(plate, columns, r + band_rows, min(r + 2 * band_rows, rows + 2) - 1, PREFETCH);
+                }
+                memcpy(LEVEL_ROW(0, r), FILE_ROW(r), sizeof(double) * width);
+            }
+            // the last level finished a band in the step before, the final one is synced by the caller
+            int x = r - 2 * steps - 1;
+            if (x >= 0 && x % band_rows == band_rows - 1)
+            {
+                int band = x / band_rows * band_rows;
+                advise(plate, columns, band, x, WRITE);
+                if (band > 0)
+                {
+                    advise(plate, columns, band - band_rows, band - 1, RELEASE);
+                }
+            }
+        } // implicit barrier: level 0 row r is there
+
+        // levels 1..steps, each split into column chunks
+        #if defined(_OPENMP)
+        #pragma omp for schedule(static)
+        #endif
+        for (work = 0; work < steps * chunks; work++)
+        {
+            int t = 1 + work / chunks, chunk = work % chunks;
+            int x = r - 2 * t;
+            if (x < 0 || x > rows + 1)
+            {
+                continue;
+            }
+            int first = 1 + chunk * COLUMN_CHUNK, last = min(first + COLUMN_CHUNK - 1, columns);
+            const double *mid = LEVEL_ROW(t - 1, x);
+            double *out = t == steps ? FILE_ROW(x) : LEVEL_ROW(t, x);
+
+            // fixed boundary: the top and bottom rows, the left and right columns are carried over
+            // (the file has them already)
+            if (t < steps && (x == 0 || x == rows + 1))
+            {
+                int low = first == 1 ? 0 : first, high = last == columns ? columns + 1 : last;
+                memcpy(out + low, mid + low, sizeof(double) * (high - low + 1));
+            }
+            if (x == 0 || x == rows + 1)
+            {
+                continue;
+            }
+            if (t < steps && first == 1)
+            {
+                out[0] = mid[0];
+            }
+            if (t < steps && last == columns)
+            {
+                out[columns + 1] = mid[columns + 1];
+            }
+            double change = jacobi_row(out, LEVEL_ROW(t - 1, x - 1), mid, LEVEL_ROW(t - 1, x + 1), first, last);
+            level[t] = change > level[t] ? change : level[t]; // fmax would stay scalar without -ffast-math
+        } // implicit barrier: the rows of step r are complete before step r + 1
+    }
+    #undef LEVEL_ROW
+    #undef FILE_ROW
+    memcpy(dt, level, sizeof(level));
+}
+
+// one Jacobi row, out[j] = average of the four neighbours of mid[j] for j = first..last, same
+// arithmetic as the laplace_row_kernel; returns the largest change
+double jacobi_row(double *restrict out, const double *restrict up, const double *restrict mid,
+                  const double *restrict down, int first, int last)
+{
+    int j;
+    double dt = 0.0;
+    for (j = first; j <= last; j++)
+    {
+        out[j] = 0.25 * (down[j] + up[j] + mid[j + 1] + mid[j - 1]);
+        double change = fabs(out[j] - mid[j]);
+        dt = change > dt ? change : dt; // fmax would stay scalar without -ffast-math
+    }
+    return dt;
+}
+
+// print diagonal in bottom right corner where most action is
+void track_progress(struct plate *plate, int columns, int iteration, int rows)
+{
+    int i;
+    printf("--------- Iteration number: %d ---------\n", iteration);
+    for (i = rows - 5; i <= rows; i++)
+    {
+        printf("[%d,%d]: %5.2f ", i, i, plate->cells[(size_t)i * (columns + 2) + columns + i - rows]);
+    }
+    printf("\n");
+}
@@ -3,59 +3,78 @@
 #include <math.h>
 #include <sys/time.h>
 
-//size of plate
+#include "laplace.h"
+#include "../common/trace.h"
+
+//default size of plate
 #define COLUMNS 1000
 #define ROWS    1000
 
 // largest permitted change in temp (This value takes about 3400 steps)
 #define MAX_TEMP_ERROR 0.01
 
-double Temperature[ROWS+2][COLUMNS+2];       // temperature grid
-double Temperature_last[ROWS+2][COLUMNS+2];  // temperature grid from last iteration
+// memory traffic and flops per cell of one iteration, for the roofline (TRACE_ROOFLINE=1)
+#define CELL_BYTES 40.0 // the stencil reads one grid and writes the other, the copy reads both and writes one
+#define CELL_FLOPS 5.0  // 3 adds and a multiply of the stencil, the difference for dt
 
-// helper routines 
-void initialize(void);
-void track_progress(int iteration);
+// helper routines
+void initialize(int rows, int columns, int pitch, double (*Temperature_last)[pitch]);
+void track_progress(int iteration, int rows, int columns, int pitch, double (*Temperature)[pitch]);
 
 int main(int argc, char **argv) {
-    
+
     int i, j;                                           // grid indexes
-    int max_iterations;                                 // number of iterations
     int iteration = 1;                                  // current iteration
     double dt = 100;                                    // largest chaneg in t
     struct timeval start_time, stop_time, elapsed_time; // timers
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 4000, .progress = 100};
 
-    printf("Maximum iterations [100-4000]?\n");
-    scanf("%d", &max_iterations);
+    int status = laplace_configure(argc, argv, &config, 1);
+    if (status != 0) {
+        return status < 0;
+    }
+    trace_init(0);
+    int rows = config.rows, columns = config.columns;
+    int pitch = laplace_pitch(columns+2, sizeof(double));  // padded row length
+    laplace_row_fn stencil = laplace_row_kernel(columns);
+
+    double (*Temperature)[pitch] = laplace_alloc(rows+2, pitch, sizeof(double), 1, config.huge_pages);       // temperature grid
+    double (*Temperature_last)[pitch] = laplace_alloc(rows+2, pitch, sizeof(double), 1, config.huge_pages);  // temperature grid from last iteration
+    if (Temperature == NULL || Temperature_last == NULL)
+    {
+        printf("Cannot allocate the grids of a %d x %d plate\n", rows, columns);
+        return 1;
+    }
 
     gettimeofday(&start_time, NULL); // Unix timer
-    initialize();                    // initialize Temp_last including boundary conditions
+    initialize(rows, columns, pitch, Temperature_last); // initialize Temp_last including boundary conditions
 
     // do util error is minimal of until max steps
-    while ( dt > MAX_TEMP_ERROR && iteration <= max_iterations ) {
+    while ( dt > config.max_temp_error && iteration <= config.max_iterations ) {
 
         // main calculation: average my four neighbors
-        for (i = 1; i <= ROWS; i++) {
-            for (j = 1; j <= COLUMNS; j++) {
-                Temperature[i][j] = 0.25 * (Temperature_last[i+1][j] + Temperature_last[i-1][j] +
-                                            Temperature_last[i][j+1] + Temperature_last[i][j-1]);   
-            }
+        trace_begin(TRACE_COMPUTE);
+        for (i = 1; i <= rows; i++) {
+            stencil(Temperature[i], Temperature_last[i], pitch, columns);
         }
-        
+
         dt = 0.0; // reset largest temperature change
 
         // copy grid to old grid for next iteration and find latest dt
-        for (i = 1; i <= ROWS; i++) {
-            for (j = 1; j <= COLUMNS; j++) {
+        for (i = 1; i <= rows; i++) {
+            for (j = 1; j <= columns; j++) {
                 dt = fmax(fabs(Temperature[i][j] - Temperature_last[i][j]), dt);
                 Temperature_last[i][j] = Temperature[i][j];
             }
         }
+        trace_work(TRACE_COMPUTE, CELL_BYTES * rows * columns, CELL_FLOPS * rows * columns);
+        trace_end(TRACE_COMPUTE);
         // printf("iter: %d dt: %lf\n", iteration, dt);
 
         // periodically print test values
-        if (iteration % 100 == 0) {
-            track_progress(iteration);
+        if (config.progress && iteration % config.progress == 0) {
+            track_progress(iteration, rows, columns, pitch, Temperature);
         }
 
         iteration++;
@@ -67,39 +86,40 @@ int main(int argc, char **argv) {
     printf("\nMax error at iteration %d was %f\n", iteration-1, dt);
     printf("Total time was %f seconds\n", elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0));
 
+    trace_finish();
+
+    free(Temperature);
+    free(Temperature_last);
+
     return 0;
 }
 
 // initialize plate and boundary conditions
 // Temp_last is used tp start first iteration
-void initialize(void) {
+void initialize(int rows, int columns, int pitch, double (*Temperature_last)[pitch]) {
     int i, j;
-    for (i = 0; i <= ROWS+1; i++) {
-        for (j = 0; j <= COLUMNS+1; j++) {
-            Temperature_last[i][j] = 0.0;
-        }
-    }
+    // the grids come zeroed from laplace_alloc, only the boundaries need values
 
     // these boundary conditions never change thoughout run
     // set left side to 0 and right side to a linear increase
-    for (i = 0; i <= ROWS+1; i++) {
+    for (i = 0; i <= rows+1; i++) {
         Temperature_last[i][0] = 0.0;
-        Temperature_last[i][COLUMNS+1] = (100.0/ROWS)*i;
+        Temperature_last[i][columns+1] = (100.0/rows)*i;
     }
-    
+
     // set top to 0 and bottom to linear increase
-    for (j = 0; j <= COLUMNS+1; j++) {
+    for (j = 0; j <= columns+1; j++) {
         Temperature_last[0][j] = 0.0;
-        Temperature_last[ROWS+1][j] = (100.0/COLUMNS)*j;
+        Temperature_last[rows+1][j] = (100.0/columns)*j;
     }
 }
 
 // print diagonal in bottom right corner where most action is
-void track_progress(int iteration) {
+void track_progress(int iteration, int rows, int columns, int pitch, double (*Temperature)[pitch]) {
     int i;
     printf("--------- Iteration number: %d ---------\n", iteration);
-    for (i = ROWS-5; i <= ROWS; i++) {
-        printf("[%d,%d]: %5.2f ", i, i, Temperature[i][i]);
+    for (i = rows-5; i <= rows; i++) {
+        printf("[%d,%d]: %5.2f ", i, i, Temperature[i][columns-rows+i]);
     }
     printf("\n");
-}
\ No newline at end of file
+}
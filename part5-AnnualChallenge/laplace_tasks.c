@@ -0,0 +1,579 @@
+#if defined(_OPENMP)
+#include "omp.h"
+#endif
+
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <assert.h>
+
+#include "laplace.h"
+#include "laplaceio.h"
+#include "../common/halo.h"
+#include "../common/trace.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define rank_zero_only(statement) \
+    do                            \
+    {                             \
+        if (rank == 0)            \
+            statement;           \
+    } while (0);
+
+
+#define HYPER 2    // enable hyperthreading
+#define SNAPSHOT_PIXELS 512 // largest side of a snapshot frame
+
+// tile of one task, full-width tiles get the fixed trip count row kernel
+#ifndef TILE_ROWS
+#define TILE_ROWS 64
+#endif
+#ifndef TILE_COLUMNS
+#define TILE_COLUMNS 1000
+#endif
+
+// tile-activity mode (build with -DACTIVITY=1): tiles whose neighbourhood changed by less than
+// QUIET_FRACTION * MAX_TEMP_ERROR are frozen and only updated again when a neighbour moves
+// or after RECHECK_EVERY skipped sweeps
+#ifndef ACTIVITY
+#define ACTIVITY 0
+#endif
+#define QUIET_FRACTION 0.01
+#define RECHECK_EVERY 16
+// ACTIVITY: rerun as plain Jacobi afterwards and report the deviation, unless --validate 0
+
+// default size of plate
+#define COLUMNS 10000
+#define ROWS 10000
+
+// largest permitted change in temp (This value takes about 3400 steps)
+#define MAX_TEMP_ERROR 0.01
+
+// memory traffic and flops per cell of a tile update, for the roofline (TRACE_ROOFLINE=1)
+#define CELL_BYTES 16.0 // the stencil reads one grid and writes the other, dt finds the row still in cache
+#define CELL_FLOPS 5.0  // 3 adds and a multiply of the stencil, the difference for dt
+
+// warm-start cache key of the boundary conditions of initialize
+#define BOUNDARY "ramp100"
+
+// dependence object of tile row a, tile column b of grid g, tile rows 0 and ntr + 1 stand for the
+// ghost rows; it also holds the largest change of the latest update of that tile
+#define TILE(g, a, b) (((g) * (ntr + 2) + (a)) * ntc + (b))
+
+// helper routines
+double update_tile(double *out, const double *in, int pitch, int first_row, int last_row, int first_column, int width);
+
+double active_tile(double *out, const double *in, int pitch, int first_row, int last_row, int first_column, int width,
+                   double around, double quiet, int *idle, long *updates);
+
+double ghost_change(int columns, int pitch, const double *out, const double *in, int row, int first_column, int width);
+
+void *solve_jacobi(int rows, int columns, int pitch, double max_temp_error, int max_iterations, int *iterations,
+                   int range_row, int start_row, int last_rank, MPI_Comm comm);
+
+int main(int argc, char **argv)
+{
+
+    int iteration = 1;                                  // current iteration
+    double dt = 100;                                    // largest chaneg in t
+    struct timeval start_time, stop_time, elapsed_time; // timers
+    struct laplace_config config = {.rows = ROWS, .columns = COLUMNS, .max_temp_error = MAX_TEMP_ERROR,
+                                    .max_iterations = 4000, .progress = 100, .validate = ACTIVITY};
+    struct laplace_io checkpoint = {.active = 0};       // checkpoint being written
+    struct laplace_io output = {.active = 0};           // final field
+    struct laplace_snapshots snapshots = {.active = 0}; // in-situ frames
+
+    int rank, size, error, last_rank, provided;
+    double start;
+    MPI_Comm comm = MPI_COMM_WORLD;
+    char found[256];                                    // warm-start cache entry
+    #if ACTIVITY
+    int warm = 0;                                       // started from it
+    #endif
+
+    // the communication tasks run on any thread, one at a time
+    error = MPI_Init_thread(NULL, NULL, MPI_THREAD_SERIALIZED, &provided);
+    assert(error == MPI_SUCCESS);
+
+    // Get process ID
+    MPI_Comm_rank(comm, &rank);
+    trace_init(rank);
+
+    // Get processes Number
+    MPI_Comm_size(comm, &size);
+
+    // every rank parses the same arguments, only rank 0 reports problems
+    int status = laplace_configure(argc, argv, &config, rank == 0);
+    if (status != 0)
+    {
+        MPI_Finalize();
+        return status < 0;
+    }
+    int rows = config.rows, columns = config.columns;
+
+    #if defined(_OPENMP)
+    int total_cores = omp_get_num_procs()*HYPER;
+    int local_cores = total_cores > size ? total_cores / size : 1;
+    if (provided < MPI_THREAD_SERIALIZED)
+    {
+        rank_zero_only(printf("MPI does not provide MPI_THREAD_SERIALIZED, running on one thread\n"));
+        local_cores = 1;
+    }
+    rank_zero_only(printf("Openmp total_cores: %d local_cores: %d\n", total_cores, local_cores));
+    #else
+    int local_cores = 1;
+    #endif
+
+    int PART_ROW = (rows + size - 1) / size;
+    int start_row = rank * PART_ROW;
+    int stop_row = min((rank + 1) * PART_ROW, rows);
+    int range_row = stop_row - start_row;
+    last_rank = (rank == (size - 1));
+    int pitch = laplace_pitch(columns + 2, sizeof(double)); // padded row length
+
+    // iteration k reads grid[(k - first) % 2] and writes the other one
+    double *grid[2];
+    grid[0] = laplace_alloc(range_row + 2, pitch, sizeof(double), local_cores, config.huge_pages);
+    grid[1] = laplace_alloc(range_row + 2, pitch, sizeof(double), local_cores, config.huge_pages);
+    if (grid[0] == NULL || grid[1] == NULL)
+    {
+        printf("Rank %d cannot allocate the grids of its %d x %d slab\n", rank, range_row, columns);
+        MPI_Abort(comm, 1);
+    }
+
+    // one halo exchange per grid, HALO picks the back-end
+    struct halo halos[2];
+    laplace_halo_create(&halos[0], grid[0], pitch, columns, range_row, MPI_DOUBLE, comm);
+    laplace_halo_create(&halos[1], grid[1], pitch, columns, range_row, MPI_DOUBLE, comm);
+    rank_zero_only(printf("Halo exchange: %s\n", halo_method_name(halos[0].method)));
+
+    int ntr = (range_row + TILE_ROWS - 1) / TILE_ROWS;  // tile rows
+    int ntc = (columns + TILE_COLUMNS - 1) / TILE_COLUMNS; // tile columns
+    double *change = (double *)calloc(2 * (ntr + 2) * ntc, sizeof(double));
+    rank_zero_only(printf("Tiles of %d x %d, %d x %d per rank\n", TILE_ROWS, TILE_COLUMNS, ntr, ntc));
+    #if ACTIVITY
+    // everything counts as moving until its first update
+    for (int t = 0; t < 2 * (ntr + 2) * ntc; t++)
+    {
+        change[t] = HUGE_VAL;
+    }
+    int *idle = (int *)calloc(ntr * ntc, sizeof(int)); // sweeps a tile was left alone, 0 while active
+    double quiet = QUIET_FRACTION * config.max_temp_error;
+    long updates = 0;                                  // tile updates done
+    rank_zero_only(printf("Tile activity: quiet below %g, recheck after %d sweeps\n", quiet, RECHECK_EVERY));
+    #endif
+
+    gettimeofday(&start_time, NULL); // Unix timer
+
+    // both grids carry the boundary, the ghost rows come with the halo tasks
+    laplace_initialize(rows, columns, pitch, (double (*)[pitch])grid[0], range_row, start_row, last_rank);
+    laplace_initialize(rows, columns, pitch, (double (*)[pitch])grid[1], range_row, start_row, last_rank);
+
+    // or continue from a checkpoint, which brings the boundary and my ghost rows along
+    if (config.restart != NULL)
+    {
+        if (laplace_read(config.restart, &iteration, &dt, rows, columns, pitch, grid[0],
+                         range_row, start_row, comm) != 0)
+        {
+            rank_zero_only(printf("Cannot restart from %s\n", config.restart));
+            MPI_Finalize();
+            return 1;
+        }
+        rank_zero_only(printf("Restarted from %s after iteration %d, dt %f\n", config.restart, iteration, dt));
+        iteration++;
+    }
+    // or start from the closest converged field in the warm-start cache, with its ghost rows
+    else if (config.cache != NULL &&
+             laplace_cache_load(config.cache, BOUNDARY, rows, columns, pitch, grid[0],
+                                range_row, start_row, found, sizeof(found), comm) == 0)
+    {
+        rank_zero_only(printf("Warm start from %s\n", found));
+        halo_exchange(&halos[0]);
+        #if ACTIVITY
+        warm = 1;
+        #endif
+    }
+
+    if (config.snapshot != NULL)
+    {
+        laplace_snapshot_init(&snapshots, config.snapshot, SNAPSHOT_PIXELS, rows, columns, range_row, start_row, comm);
+        rank_zero_only(printf("Snapshots of %d x %d every %d iterations\n", snapshots.width, snapshots.height, config.snapshot_every));
+    }
+
+    if (!config.quiet)
+        printf("This is rank %d, world_size: %d max_iter: %d\n", rank, size, config.max_iterations);
+
+    int first = iteration;      // first iteration of this run
+    int last = iteration - 1;   // latest iteration known to be complete on all ranks
+    int done = !(dt > config.max_temp_error) || first > config.max_iterations;
+    int pending = -1;           // grid of a reduction started for an iteration beyond last
+    double local[2], global[2]; // largest change of my tiles and of the plate, by destination grid
+    MPI_Request reduce[2];
+    int comm_token = 0;         // dependence object that chains all MPI calls
+    int decided = 0;            // dependence object of the latest convergence decision
+    (void)comm_token;           // both are only named in depend clauses
+    (void)decided;
+    long tasks = 0;
+
+    // One thread creates the tasks of an iteration, everybody runs them. A tile waits only for
+    // itself and its four neighbours of the previous iteration, and the halo of the previous
+    // iteration for the first and last tile row, so neighbouring iterations overlap and there is no
+    // barrier. The tiles of an iteration leave their largest change in change[], one reduction task
+    // combines them and starts an MPI_Iallreduce that is only completed one iteration later, while
+    // the next iteration is already being computed. Before the tasks of iteration k + 1 are created,
+    // which would overwrite the grid of k - 1, the creating thread waits for the decision on k - 1:
+    // the result is that of plain Jacobi, at the price of one speculative iteration at the end.
+    #pragma omp parallel num_threads(local_cores)
+    #pragma omp single
+    {
+        for (int k = first; !done; k++)
+        {
+            int s = (k - first) % 2, d = 1 - s; // source and destination grid
+            double *in = grid[s], *out = grid[d];
+            int run = k <= config.max_iterations;
+
+            if (run)
+            {
+                for (int a = 1; a <= ntr; a++)
+                {
+                    for (int b = 0; b < ntc; b++)
+                    {
+                        int left = b > 0 ? b - 1 : b, right = b < ntc - 1 ? b + 1 : b;
+                        #pragma omp task depend(in: change[TILE(s, a - 1, b)], change[TILE(s, a + 1, b)], change[TILE(s, a, left)], change[TILE(s, a, right)], change[TILE(s, a, b)]) \
+                                         depend(out: change[TILE(d, a, b)])
+                        {
+                            int first_row = (a - 1) * TILE_ROWS + 1, last_row = min(a * TILE_ROWS, range_row);
+                            int first_column = b * TILE_COLUMNS + 1, width = min(TILE_COLUMNS, columns - b * TILE_COLUMNS);
+                            #if ACTIVITY
+                            // largest change of the tile and its neighbours in the previous iteration
+                            double around = fmax(fmax(change[TILE(s, a - 1, b)], change[TILE(s, a + 1, b)]),
+                                                 fmax(fmax(change[TILE(s, a, left)], change[TILE(s, a, right)]), change[TILE(s, a, b)]));
+                            change[TILE(d, a, b)] = active_tile(out, in, pitch, first_row, last_row, first_column, width,
+                                                                around, quiet, &idle[(a - 1) * ntc + b], &updates);
+                            #else
+                            change[TILE(d, a, b)] = update_tile(out, in, pitch, first_row, last_row, first_column, width);
+                            #endif
+                        }
+                    }
+                }
+                tasks += ntr * ntc;
+            }
+
+            // decision on the previous iteration, whose grid is in until the tiles of k + 1 exist
+            if (k > first)
+            {
+                int previous = k - 1;
+                #pragma omp task depend(inout: comm_token) depend(out: decided)
+                {
+                    trace_begin(TRACE_REDUCE);
+                    MPI_Wait(&reduce[s], MPI_STATUS_IGNORE);
+                    trace_end(TRACE_REDUCE);
+
+                    // periodically print test values
+                    if (last_rank && config.progress && previous % config.progress == 0)
+                    {
+                        laplace_track_progress(columns, pitch, (double (*)[pitch])in, previous, range_row, start_row);
+                    }
+
+                    // checkpoint, the collective write goes on behind the next iterations
+                    if (config.checkpoint != NULL && previous % config.checkpoint_every == 0)
+                    {
+                        trace_begin(TRACE_IO);
+                        if (laplace_write_start(&checkpoint, config.checkpoint, previous, global[s], rows, columns, pitch,
+                                                in, range_row, start_row, comm) != 0)
+                        {
+                            rank_zero_only(printf("Cannot write checkpoint %s\n", config.checkpoint));
+                        }
+                        trace_end(TRACE_IO);
+                    }
+                    laplace_write_progress(&checkpoint);
+
+                    // downsampled frame of the plate, gathered and written while the solver goes on
+                    if (config.snapshot != NULL && previous % config.snapshot_every == 0)
+                    {
+                        trace_begin(TRACE_IO);
+                        laplace_snapshot_take(&snapshots, previous, pitch, in, comm);
+                        trace_end(TRACE_IO);
+                    }
+                    laplace_snapshot_progress(&snapshots);
+                }
+            }
+
+            if (run)
+            {
+                // my first and last rows to the neighbours, their rows into my ghost rows
+                #pragma omp task depend(iterator(t = 0:ntc), in: change[TILE(d, 1, t)], change[TILE(d, ntr, t)]) \
+                                 depend(iterator(t = 0:ntc), out: change[TILE(d, 0, t)], change[TILE(d, ntr + 1, t)]) \
+                                 depend(inout: comm_token)
+                {
+                    trace_begin(TRACE_HALO);
+                    halo_exchange(&halos[d]);
+                    #if ACTIVITY
+                    // a tile next to a neighbour rank wakes up when the ghost row above or below it moves
+                    for (int t = 0; t < ntc; t++)
+                    {
+                        int width = min(TILE_COLUMNS, columns - t * TILE_COLUMNS);
+                        change[TILE(d, 0, t)] = ghost_change(columns, pitch, out, in, 0, t * TILE_COLUMNS + 1, width);
+                        change[TILE(d, ntr + 1, t)] = ghost_change(columns, pitch, out, in, range_row + 1, t * TILE_COLUMNS + 1, width);
+                    }
+                    #endif
+                    trace_end(TRACE_HALO);
+                }
+
+                // per tile changes of this iteration, combined over the ranks in the background
+                #pragma omp task depend(iterator(a = 1:ntr + 1, t = 0:ntc), in: change[TILE(d, a, t)]) \
+                                 depend(inout: comm_token)
+                {
+                    trace_begin(TRACE_REDUCE);
+                    local[d] = 0.0;
+                    for (int a = 1; a <= ntr; a++)
+                    {
+                        for (int b = 0; b < ntc; b++)
+                        {
+                            local[d] = fmax(change[TILE(d, a, b)], local[d]);
+                        }
+                    }
+                    MPI_Iallreduce(&local[d], &global[d], 1, MPI_DOUBLE, MPI_MAX, comm, &reduce[d]);
+                    trace_end(TRACE_REDUCE);
+                }
+                tasks += 2;
+                pending = d;
+            }
+
+            if (k > first)
+            {
+                #pragma omp taskwait depend(in: decided)
+                last = k - 1;
+                dt = global[s];
+                done = !(dt > config.max_temp_error) || !run;
+                pending = run ? d : -1;
+            }
+        }
+
+        // the reduction of the speculative iteration still has to complete
+        if (pending >= 0)
+        {
+            #pragma omp task depend(inout: comm_token)
+            {
+                trace_begin(TRACE_REDUCE);
+                MPI_Wait(&reduce[pending], MPI_STATUS_IGNORE);
+                trace_end(TRACE_REDUCE);
+            }
+        }
+    }
+    laplace_write_wait(&checkpoint, comm);
+    if (config.snapshot != NULL)
+    {
+        laplace_snapshot_finish(&snapshots, comm);
+        rank_zero_only(printf("%d snapshots, %f seconds in the solver\n", snapshots.frames, snapshots.time));
+    }
+
+    gettimeofday(&stop_time, NULL); // Unix timer
+    timersub(&stop_time, &start_time,
+             &elapsed_time); // Unix timer substraction routine
+
+    rank_zero_only(printf("\n%ld tasks per rank, %d speculative iteration(s)\n", tasks, pending >= 0));
+    rank_zero_only(printf("\nMax error at iteration %d was %f\n", last, dt));
+    rank_zero_only(printf("Total time was %f seconds\n",
+           elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0)));
+
+    // the result of the last iteration is in its destination grid
+    double *result = grid[(last - first + 1) % 2];
+
+    #if ACTIVITY
+    {
+        long updates_all, possible = (long)ntr * ntc * (last - first + 1 + (pending >= 0)), possible_all;
+        MPI_Allreduce(&updates, &updates_all, 1, MPI_LONG, MPI_SUM, comm);
+        MPI_Allreduce(&possible, &possible_all, 1, MPI_LONG, MPI_SUM, comm);
+        rank_zero_only(printf("Tile updates: %ld of %ld (%.1f%%)\n", updates_all, possible_all, 100.0 * updates_all / possible_all));
+    }
+    // deviation report: the same plate with every cell updated every sweep, as laplace_horizon.c does it
+    if (config.validate && config.restart == NULL && !warm)
+    {
+        int iterations_jacobi, i, j;
+        double diff = 0.0, diff_all, sum = 0.0, sum_all;
+        start = MPI_Wtime();
+        double(*Reference)[pitch] = solve_jacobi(rows, columns, pitch, config.max_temp_error, config.max_iterations, &iterations_jacobi,
+                                                 range_row, start_row, last_rank, comm);
+        double jacobi_time = MPI_Wtime() - start;
+        double(*Temperature)[pitch] = (double (*)[pitch])result;
+        for (i = 1; i <= range_row; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                double d = fabs(Temperature[i][j] - Reference[i][j]);
+                diff = fmax(d, diff);
+                sum += d * d;
+            }
+        }
+        MPI_Allreduce(&diff, &diff_all, 1, MPI_DOUBLE, MPI_MAX, comm);
+        MPI_Allreduce(&sum, &sum_all, 1, MPI_DOUBLE, MPI_SUM, comm);
+        rank_zero_only(printf("\nDeviation from full Jacobi\n"));
+        rank_zero_only(printf("iterations: active %d full %d\n", last, iterations_jacobi));
+        rank_zero_only(printf("time: active %f full %f seconds\n",
+                              elapsed_time.tv_sec + (elapsed_time.tv_usec / 1000000.0), jacobi_time));
+        rank_zero_only(printf("max |difference|: %e rms difference: %e\n", diff_all, sqrt(sum_all / ((double)rows * columns))));
+        free(Reference);
+    }
+    free(idle);
+    #endif
+    if (config.output != NULL)
+    {
+        trace_begin(TRACE_IO);
+        start = MPI_Wtime();
+        if (laplace_write_start(&output, config.output, last, dt, rows, columns, pitch,
+                                result, range_row, start_row, comm) != 0)
+        {
+            rank_zero_only(printf("Cannot write %s\n", config.output));
+        }
+        laplace_write_wait(&output, comm);
+        trace_end(TRACE_IO);
+        rank_zero_only(printf("Field written to %s in %f seconds\n", config.output, MPI_Wtime() - start));
+    }
+
+    // a converged field goes into the warm-start cache
+    if (config.cache != NULL && dt <= config.max_temp_error &&
+        laplace_cache_store(config.cache, BOUNDARY, last, dt, rows, columns, pitch,
+                            result, range_row, start_row, comm))
+    {
+        rank_zero_only(printf("Field added to the warm-start cache %s\n", config.cache));
+    }
+
+    trace_finish();
+    halo_free(&halos[0]);
+    halo_free(&halos[1]);
+    MPI_Finalize();
+    free(change);
+    free(grid[0]);
+    free(grid[1]);
+
+    return 0;
+}
+
+// Jacobi update of rows first_row..last_row and width columns from first_column on,
+// returns the largest change in the tile
+double update_tile(double *out, const double *in, int pitch, int first_row, int last_row, int first_column, int width)
+{
+    laplace_row_fn stencil = laplace_row_kernel(width);
+    double dt = 0.0;
+    int i, j;
+
+    trace_begin(TRACE_COMPUTE);
+    for (i = first_row; i <= last_row; i++)
+    {
+        // the kernel updates elements 1..width, so start one before the tile
+        double *row = out + (size_t)i * pitch + first_column - 1;
+        const double *row_last = in + (size_t)i * pitch + first_column - 1;
+        stencil(row, row_last, pitch, width);
+        for (j = 1; j <= width; j++)
+        {
+            dt = fmax(fabs(row[j] - row_last[j]), dt);
+        }
+    }
+    trace_work(TRACE_COMPUTE, CELL_BYTES * (last_row - first_row + 1) * width,
+               CELL_FLOPS * (last_row - first_row + 1) * width);
+    trace_end(TRACE_COMPUTE);
+    return dt;
+}
+
+// tile-activity update: a tile whose neighbourhood changed by less than quiet in the previous
+// iteration is frozen, its values are copied into the other grid once so both grids agree, and it
+// is then left alone until a neighbour moves again or RECHECK_EVERY sweeps have been skipped;
+// idle counts the skipped sweeps, returns the largest change in the tile, 0 if it was not updated
+double active_tile(double *out, const double *in, int pitch, int first_row, int last_row, int first_column, int width,
+                   double around, double quiet, int *idle, long *updates)
+{
+    int i;
+
+    if (around >= quiet || *idle >= RECHECK_EVERY)
+    {
+        *idle = 0;
+        #pragma omp atomic
+        (*updates)++;
+        return update_tile(out, in, pitch, first_row, last_row, first_column, width);
+    }
+    if (*idle == 0)
+    {
+        trace_begin(TRACE_COMPUTE);
+        for (i = first_row; i <= last_row; i++)
+        {
+            memcpy(out + (size_t)i * pitch + first_column, in + (size_t)i * pitch + first_column, sizeof(double) * width);
+        }
+        trace_work(TRACE_COMPUTE, 16.0 * (last_row - first_row + 1) * width, 0.0);
+        trace_end(TRACE_COMPUTE);
+    }
+    (*idle)++;
+    return 0.0;
+}
+
+// largest change of width elements from first_column on in row of the new grid out against in
+double ghost_change(int columns, int pitch, const double *out, const double *in, int row, int first_column, int width)
+{
+    const double *now = out + (size_t)row * pitch + first_column;
+    const double *before = in + (size_t)row * pitch + first_column;
+    double dt = 0.0;
+    int j;
+
+    (void)columns;
+    for (j = 0; j < width; j++)
+    {
+        dt = fmax(fabs(now[j] - before[j]), dt);
+    }
+    return dt;
+}
+
+// reference solve: Jacobi with two toggled grids and every cell updated, until the same criterion,
+// returns the solution grid of pitch doubles per row
+void *solve_jacobi(int rows, int columns, int pitch, double max_temp_error, int max_iterations, int *iterations,
+                   int range_row, int start_row, int last_rank, MPI_Comm comm)
+{
+    int i, j;
+    int iteration = 1;
+    double dt = 100, dt_local;
+    laplace_row_fn stencil = laplace_row_kernel(columns);
+    double(*Temperature)[pitch] = laplace_alloc(range_row + 2, pitch, sizeof(double), 0, 0);
+    double(*Temperature_last)[pitch] = laplace_alloc(range_row + 2, pitch, sizeof(double), 0, 0);
+    if (Temperature == NULL || Temperature_last == NULL)
+    {
+        printf("Cannot allocate the grids of the reference solve\n");
+        MPI_Abort(comm, 1);
+    }
+
+    laplace_initialize(rows, columns, pitch, Temperature, range_row, start_row, last_rank);
+    laplace_initialize(rows, columns, pitch, Temperature_last, range_row, start_row, last_rank);
+    struct halo halos[2];
+    laplace_halo_create(&halos[0], Temperature, pitch, columns, range_row, MPI_DOUBLE, comm);
+    laplace_halo_create(&halos[1], Temperature_last, pitch, columns, range_row, MPI_DOUBLE, comm);
+    int toggle = 1;                                      // halo of Temperature_last
+
+    while (dt > max_temp_error && iteration <= max_iterations)
+    {
+        dt_local = 0.0;
+        #pragma omp parallel for private(j) reduction(max:dt_local)
+        for (i = 1; i <= range_row; i++)
+        {
+            stencil(Temperature[i], Temperature_last[i], pitch, columns);
+            for (j = 1; j <= columns; j++)
+            {
+                dt_local = fmax(fabs(Temperature[i][j] - Temperature_last[i][j]), dt_local);
+            }
+        }
+        double(*swap)[pitch] = Temperature;
+        Temperature = Temperature_last;
+        Temperature_last = swap;
+        toggle = 1 - toggle;
+
+        MPI_Allreduce(&dt_local, &dt, 1, MPI_DOUBLE, MPI_MAX, comm);
+        halo_exchange(&halos[toggle]);
+        iteration++;
+    }
+
+    *iterations = iteration - 1;
+    halo_free(&halos[0]);
+    halo_free(&halos[1]);
+    free(Temperature);
+    return Temperature_last;
+}
@@ -0,0 +1,486 @@
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "laplaceio.h"
+
+#define MAGIC "LAPLACE"
+
+// file name the data is written to before it is complete
+static char *part_name(const char *path)
+{
+    char *part = (char *)malloc(strlen(path) + sizeof(".part"));
+    sprintf(part, "%s.part", path);
+    return part;
+}
+
+// rows [first, first + count) of the (rows + 2) x (columns + 2) plate behind the header
+static MPI_Datatype plate_rows(int rows, int columns, int first, int count)
+{
+    MPI_Datatype type;
+    int sizes[2] = {rows + 2, columns + 2};
+    int subsizes[2] = {count, columns + 2};
+    int starts[2] = {first, 0};
+
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+int laplace_write_start(struct laplace_io *io, const char *path, int iteration, double dt,
+                        int rows, int columns, int pitch, double *grid,
+                        int range_row, int start_row, MPI_Comm comm)
+{
+    int i, rank, error;
+    char *part;
+
+    laplace_write_wait(io, comm);
+    MPI_Comm_rank(comm, &rank);
+
+    // the first rank also holds the top boundary row, the last one the bottom row
+    int first = start_row == 0 ? 0 : 1;
+    int last = start_row + range_row == rows ? range_row + 1 : range_row;
+
+    io->count = (last - first + 1) * (columns + 2);
+    io->staging = (double *)malloc(sizeof(double) * io->count);
+    for (i = first; i <= last; i++)
+    {
+        memcpy(io->staging + (size_t)(i - first) * (columns + 2), grid + (size_t)i * pitch, sizeof(double) * (columns + 2));
+    }
+
+    part = part_name(path);
+    error = MPI_File_open(comm, part, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &io->file);
+    free(part);
+    if (error != MPI_SUCCESS)
+    {
+        free(io->staging);
+        return -1;
+    }
+    io->path = strdup(path);
+    MPI_File_set_size(io->file, sizeof(struct laplace_header) + sizeof(double) * (MPI_Offset)(rows + 2) * (columns + 2));
+
+    io->filetype = plate_rows(rows, columns, start_row + first, last - first + 1);
+    MPI_File_set_view(io->file, sizeof(struct laplace_header), MPI_DOUBLE, io->filetype, "native", MPI_INFO_NULL);
+    MPI_File_iwrite_all(io->file, io->staging, io->count, MPI_DOUBLE, &io->request);
+
+    memset(&io->header, 0, sizeof(io->header));
+    strcpy(io->header.magic, MAGIC);
+    io->header.rows = rows;
+    io->header.columns = columns;
+    io->header.iteration = iteration;
+    io->header.dt = dt;
+    io->active = 1;
+    return 0;
+}
+
+void laplace_write_progress(struct laplace_io *io)
+{
+    int flag;
+    if (io->active)
+    {
+        MPI_Test(&io->request, &flag, MPI_STATUS_IGNORE);
+    }
+}
+
+void laplace_write_wait(struct laplace_io *io, MPI_Comm comm)
+{
+    int rank;
+
+    if (!io->active)
+    {
+        return;
+    }
+    MPI_Comm_rank(comm, &rank);
+    MPI_Wait(&io->request, MPI_STATUS_IGNORE);
+
+    // the header goes in once the data is there
+    MPI_File_set_view(io->file, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+    if (rank == 0)
+    {
+        MPI_File_write_at(io->file, 0, &io->header, sizeof(io->header), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    MPI_File_close(&io->file);
+    MPI_Type_free(&io->filetype);
+
+    // a crash during the write leaves the last complete file in place
+    if (rank == 0)
+    {
+        char *part = part_name(io->path);
+        if (rename(part, io->path) != 0)
+        {
+            printf("Cannot rename %s to %s\n", part, io->path);
+        }
+        free(part);
+    }
+    free(io->path);
+    free(io->staging);
+    io->active = 0;
+}
+
+int laplace_read(const char *path, int *iteration, double *dt,
+                 int rows, int columns, int pitch, double *grid,
+                 int range_row, int start_row, MPI_Comm comm)
+{
+    MPI_File file;
+    MPI_Datatype filetype, memtype;
+    struct laplace_header header;
+    int sizes[2] = {range_row + 2, pitch};
+    int subsizes[2] = {range_row + 2, columns + 2};
+    int starts[2] = {0, 0};
+
+    if (MPI_File_open(comm, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+    {
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    MPI_File_read_all(file, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    if (strncmp(header.magic, MAGIC, sizeof(header.magic)) != 0 || header.rows != rows || header.columns != columns)
+    {
+        MPI_File_close(&file);
+        return -1;
+    }
+
+    // my rows and both ghost rows, the slabs of the writer do not matter
+    filetype = plate_rows(rows, columns, start_row, range_row + 2);
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &memtype);
+    MPI_Type_commit(&memtype);
+    MPI_File_set_view(file, sizeof(struct laplace_header), MPI_DOUBLE, filetype, "native", MPI_INFO_NULL);
+    MPI_File_read_all(file, grid, 1, memtype, MPI_STATUS_IGNORE);
+
+    MPI_Type_free(&filetype);
+    MPI_Type_free(&memtype);
+    MPI_File_close(&file);
+    *iteration = header.iteration;
+    *dt = header.dt;
+    return 0;
+}
+
+// file of the cache entry of a plate size
+static char *cache_name(const char *dir, const char *boundary, int rows, int columns)
+{
+    char *name = (char *)malloc(strlen(dir) + strlen(boundary) + 32);
+    sprintf(name, "%s/%s-%dx%d.lap", dir, boundary, rows, columns);
+    return name;
+}
+
+int laplace_cache_load(const char *dir, const char *boundary, int rows, int columns, int pitch, double *grid,
+                       int range_row, int start_row, char *found, size_t size, MPI_Comm comm)
+{
+    int i, j, rank, best[2] = {0, 0};
+    MPI_File file;
+    struct laplace_header header;
+
+    MPI_Comm_rank(comm, &rank);
+
+    // rank 0 picks the entry closest in size, by the sum of the log ratios of rows and columns
+    if (rank == 0)
+    {
+        DIR *directory = opendir(dir);
+        struct dirent *entry;
+        size_t length = strlen(boundary);
+        double distance = HUGE_VAL;
+
+        while (directory != NULL && (entry = readdir(directory)) != NULL)
+        {
+            int r, c, end = 0;
+            if (strncmp(entry->d_name, boundary, length) != 0 ||
+                sscanf(entry->d_name + length, "-%dx%d.lap%n", &r, &c, &end) != 2 ||
+                end == 0 || entry->d_name[length + end] != '\0' || r < 1 || c < 1)
+            {
+                continue;
+            }
+            double d = fabs(log((double)r / rows)) + fabs(log((double)c / columns));
+            if (d < distance)
+            {
+                distance = d;
+                best[0] = r;
+                best[1] = c;
+            }
+        }
+        if (directory != NULL)
+        {
+            closedir(directory);
+        }
+    }
+    MPI_Bcast(best, 2, MPI_INT, 0, comm);
+    if (best[0] == 0)
+    {
+        return -1;
+    }
+
+    char *path = cache_name(dir, boundary, best[0], best[1]);
+    snprintf(found, size, "%s", path);
+    int error = MPI_File_open(comm, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
+    free(path);
+    if (error != MPI_SUCCESS)
+    {
+        return -1;
+    }
+    MPI_File_read_at_all(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    if (strncmp(header.magic, MAGIC, sizeof(header.magic)) != 0 || header.rows != best[0] || header.columns != best[1])
+    {
+        MPI_File_close(&file);
+        return -1;
+    }
+
+    // plate row gi lies at row gi * (R + 1) / (rows + 1) of the cached R x C plate, same for the
+    // columns; my rows need the cached rows lo..hi, including its boundary rows
+    int R = best[0], C = best[1];
+    double scale_rows = (double)(R + 1) / (rows + 1), scale_columns = (double)(C + 1) / (columns + 1);
+    int lo = (int)((start_row + 1) * scale_rows), hi = (int)((start_row + range_row) * scale_rows) + 1;
+    lo = lo < R ? lo : R;
+    hi = range_row > 0 ? (hi < R + 1 ? hi : R + 1) : lo - 1;
+    double *band = (double *)malloc(sizeof(double) * (size_t)(hi - lo + 1) * (C + 2));
+    MPI_File_read_at_all(file, sizeof(header) + sizeof(double) * (MPI_Offset)lo * (C + 2), band,
+                         (hi - lo + 1) * (C + 2), MPI_DOUBLE, MPI_STATUS_IGNORE);
+    MPI_File_close(&file);
+
+    // bilinear, which leaves the values alone where the sizes agree
+    for (i = 1; i <= range_row; i++)
+    {
+        double y = (start_row + i) * scale_rows;
+        int r = (int)y < R ? (int)y : R;
+        double wy = y - r;
+        const double *above = band + (size_t)(r - lo) * (C + 2), *below = above + C + 2;
+        double *row = grid + (size_t)i * pitch;
+        for (j = 1; j <= columns; j++)
+        {
+            double x = j * scale_columns;
+            int c = (int)x < C ? (int)x : C;
+            double wx = x - c;
+            row[j] = (1.0 - wy) * ((1.0 - wx) * above[c] + wx * above[c + 1]) +
+                     wy * ((1.0 - wx) * below[c] + wx * below[c + 1]);
+        }
+    }
+    free(band);
+    return 0;
+}
+
+int laplace_cache_store(const char *dir, const char *boundary, int iteration, double dt,
+                        int rows, int columns, int pitch, double *grid,
+                        int range_row, int start_row, MPI_Comm comm)
+{
+    struct laplace_io io = {.active = 0};
+    struct laplace_header header;
+    int rank, store = 1;
+    char *path = cache_name(dir, boundary, rows, columns);
+
+    MPI_Comm_rank(comm, &rank);
+    if (rank == 0)
+    {
+        mkdir(dir, 0755);
+        FILE *file = fopen(path, "rb");
+        if (file != NULL)
+        {
+            store = !(fread(&header, sizeof(header), 1, file) == 1 &&
+                      strncmp(header.magic, MAGIC, sizeof(header.magic)) == 0 && header.dt <= dt);
+            fclose(file);
+        }
+    }
+    MPI_Bcast(&store, 1, MPI_INT, 0, comm);
+
+    // written like a field dump, the entry is replaced only once the new one is complete
+    if (store)
+    {
+        store = laplace_write_start(&io, path, iteration, dt, rows, columns, pitch, grid,
+                                    range_row, start_row, comm) == 0;
+        laplace_write_wait(&io, comm);
+    }
+    free(path);
+    return store;
+}
+
+// rank 0: write queued frames as binary PGM while the solver goes on
+static void *snapshot_writer(void *arg)
+{
+    struct laplace_snapshots *snap = (struct laplace_snapshots *)arg;
+
+    pthread_mutex_lock(&snap->lock);
+    while (1)
+    {
+        while (snap->queued < 0 && !snap->done)
+        {
+            pthread_cond_wait(&snap->cond, &snap->lock);
+        }
+        if (snap->queued < 0)
+        {
+            break;
+        }
+        int b = snap->queued;
+        pthread_mutex_unlock(&snap->lock);
+
+        char *name = (char *)malloc(strlen(snap->prefix) + 32);
+        sprintf(name, "%s%06d.pgm", snap->prefix, snap->iteration[b]);
+        FILE *file = fopen(name, "wb");
+        if (file != NULL)
+        {
+            fprintf(file, "P5\n%d %d\n255\n", snap->width, snap->height);
+            fwrite(snap->frame[b], 1, (size_t)snap->width * snap->height, file);
+            fclose(file);
+        }
+        else
+        {
+            printf("Cannot write snapshot %s\n", name);
+        }
+        free(name);
+
+        pthread_mutex_lock(&snap->lock);
+        snap->queued = -1;
+        pthread_cond_broadcast(&snap->cond);
+    }
+    pthread_mutex_unlock(&snap->lock);
+    return NULL;
+}
+
+// rank 0: give the gathered frame to the writer once it is done with the one before
+static void snapshot_queue(struct laplace_snapshots *snap, int b)
+{
+    pthread_mutex_lock(&snap->lock);
+    while (snap->queued >= 0)
+    {
+        pthread_cond_wait(&snap->cond, &snap->lock);
+    }
+    snap->queued = b;
+    pthread_cond_broadcast(&snap->cond);
+    pthread_mutex_unlock(&snap->lock);
+}
+
+// complete the gather in flight and queue its frame
+static void snapshot_complete(struct laplace_snapshots *snap, int rank)
+{
+    if (!snap->gathering)
+    {
+        return;
+    }
+    MPI_Wait(&snap->request, MPI_STATUS_IGNORE);
+    snap->gathering = 0;
+    if (rank == 0)
+    {
+        snapshot_queue(snap, 1 - snap->next);
+    }
+    snap->frames++;
+}
+
+void laplace_snapshot_init(struct laplace_snapshots *snap, const char *prefix, int pixels,
+                           int rows, int columns, int range_row, int start_row, MPI_Comm comm)
+{
+    int rank, size, r, b;
+    int largest = rows > columns ? rows : columns;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    memset(snap, 0, sizeof(*snap));
+    snap->prefix = prefix;
+    snap->step = (largest + pixels - 1) / pixels;
+    snap->width = (columns - 1) / snap->step + 1;
+    snap->height = (rows - 1) / snap->step + 1;
+
+    // sampled are the global rows 1, 1 + step, 1 + 2 step, ...
+    int first_global = (start_row + snap->step - 1) / snap->step * snap->step + 1;
+    snap->first = first_global - start_row;
+    snap->count = first_global <= start_row + range_row ? (start_row + range_row - first_global) / snap->step + 1 : 0;
+
+    for (b = 0; b < 2; b++)
+    {
+        snap->send[b] = (unsigned char *)malloc((size_t)snap->count * snap->width + 1);
+    }
+    if (rank == 0)
+    {
+        snap->counts = (int *)malloc(sizeof(int) * size);
+        snap->displs = (int *)malloc(sizeof(int) * size);
+    }
+    r = snap->count * snap->width;
+    MPI_Gather(&r, 1, MPI_INT, snap->counts, 1, MPI_INT, 0, comm);
+    if (rank == 0)
+    {
+        snap->displs[0] = 0;
+        for (r = 1; r < size; r++)
+        {
+            snap->displs[r] = snap->displs[r - 1] + snap->counts[r - 1];
+        }
+        for (b = 0; b < 2; b++)
+        {
+            snap->frame[b] = (unsigned char *)malloc((size_t)snap->width * snap->height);
+        }
+        snap->queued = -1;
+        pthread_mutex_init(&snap->lock, NULL);
+        pthread_cond_init(&snap->cond, NULL);
+        pthread_create(&snap->writer, NULL, snapshot_writer, snap);
+    }
+    snap->active = 1;
+}
+
+void laplace_snapshot_take(struct laplace_snapshots *snap, int iteration, int pitch, double *grid, MPI_Comm comm)
+{
+    int rank, k, c;
+    double start = MPI_Wtime();
+    int b = snap->next;
+    unsigned char *pixel = snap->send[b];
+
+    MPI_Comm_rank(comm, &rank);
+    // queue the previous frame, this buffer was last gathered two snapshots ago
+    snapshot_complete(snap, rank);
+
+    // 0 to 100 degrees onto 0 to 255
+    for (k = 0; k < snap->count; k++)
+    {
+        const double *row = grid + (size_t)(snap->first + k * snap->step) * pitch;
+        for (c = 0; c < snap->width; c++)
+        {
+            double t = row[1 + c * snap->step] * 2.55;
+            *pixel++ = (unsigned char)(t < 0.0 ? 0.0 : t > 255.0 ? 255.0 : t + 0.5);
+        }
+    }
+
+    snap->iteration[b] = iteration;
+    MPI_Igatherv(snap->send[b], snap->count * snap->width, MPI_UNSIGNED_CHAR,
+                 rank == 0 ? snap->frame[b] : NULL, snap->counts, snap->displs, MPI_UNSIGNED_CHAR, 0, comm, &snap->request);
+    snap->gathering = 1;
+    snap->next = 1 - b;
+    snap->time += MPI_Wtime() - start;
+}
+
+void laplace_snapshot_progress(struct laplace_snapshots *snap)
+{
+    int flag;
+    if (snap->active && snap->gathering)
+    {
+        MPI_Test(&snap->request, &flag, MPI_STATUS_IGNORE);
+    }
+}
+
+void laplace_snapshot_finish(struct laplace_snapshots *snap, MPI_Comm comm)
+{
+    int rank, b;
+
+    if (!snap->active)
+    {
+        return;
+    }
+    MPI_Comm_rank(comm, &rank);
+    snapshot_complete(snap, rank);
+    if (rank == 0)
+    {
+        pthread_mutex_lock(&snap->lock);
+        snap->done = 1;
+        pthread_cond_broadcast(&snap->cond);
+        pthread_mutex_unlock(&snap->lock);
+        pthread_join(snap->writer, NULL);
+        pthread_mutex_destroy(&snap->lock);
+        pthread_cond_destroy(&snap->cond);
+        for (b = 0; b < 2; b++)
+        {
+            free(snap->frame[b]);
+        }
+        free(snap->counts);
+        free(snap->displs);
+    }
+    for (b = 0; b < 2; b++)
+    {
+        free(snap->send[b]);
+    }
+    snap->active = 0;
+}
@@ -0,0 +1,98 @@
+#include <mpi.h>
+#include <pthread.h>
+
+// checkpoints and field dumps: this header followed by the (rows + 2) x (columns + 2) plate
+// including its boundary, doubles in row order, all in native byte order
+struct laplace_header
+{
+    char magic[8];  // "LAPLACE"
+    int rows, columns;
+    int iteration;  // last completed iteration
+    int reserved;
+    double dt;      // largest change of that iteration
+};
+
+// one collective write in flight
+struct laplace_io
+{
+    MPI_File file;
+    MPI_Datatype filetype; // my rows of the plate in the file
+    MPI_Request request;
+    double *staging;       // copy of my rows, the grid moves on while the write runs
+    int count;             // doubles in staging
+    int active;            // a write was started and not yet finished
+    char *path;            // final name, the data goes to path.part until it is complete
+    struct laplace_header header;
+};
+
+// copy my rows 1..range_row of grid (plus the top or bottom boundary row on the first and last rank)
+// and start writing them collectively to path with MPI_File_iwrite_all, returns at once.
+// A previous write on io is finished first. Returns 0, or -1 if the file cannot be opened
+int laplace_write_start(struct laplace_io *io, const char *path, int iteration, double dt,
+                        int rows, int columns, int pitch, double *grid,
+                        int range_row, int start_row, MPI_Comm comm);
+
+// let a write in flight progress, call it now and then from the compute loop
+void laplace_write_progress(struct laplace_io *io);
+
+// complete the write, add the header and move path.part to path, collective, nothing to do if idle
+void laplace_write_wait(struct laplace_io *io, MPI_Comm comm);
+
+// read rows 0..range_row+1 of my slab from a file written with any number of ranks,
+// returns 0 with the iteration and dt of the file, -1 if it is missing or of another plate size
+int laplace_read(const char *path, int *iteration, double *dt,
+                 int rows, int columns, int pitch, double *grid,
+                 int range_row, int start_row, MPI_Comm comm);
+
+// warm-start cache: converged fields in the checkpoint format, one per boundary condition and plate
+// size, in DIR/<boundary>-<rows>x<columns>.lap; boundary names the boundary conditions of the program
+
+// fill my rows 1..range_row of grid, but not its boundary columns, from the cached field of the same
+// boundary closest in size, bilinearly interpolated if the size differs; returns 0 with the file in
+// found (size bytes at most), -1 if there is none, collective
+int laplace_cache_load(const char *dir, const char *boundary, int rows, int columns, int pitch, double *grid,
+                       int range_row, int start_row, char *found, size_t size, MPI_Comm comm);
+
+// add a converged field to the cache, replacing the entry of its size unless that one is converged
+// as far already (dt no larger); returns 1 if it was stored, collective
+int laplace_cache_store(const char *dir, const char *boundary, int iteration, double dt,
+                        int rows, int columns, int pitch, double *grid,
+                        int range_row, int start_row, MPI_Comm comm);
+
+// in-situ snapshots: every step-th row and column of the plate as an 8-bit grey PGM frame
+struct laplace_snapshots
+{
+    const char *prefix;       // frames go to <prefix><iteration>.pgm
+    int step;                 // sampling distance in rows and columns
+    int width, height;        // frame size
+    int first, count;         // my first sampled local row, number of my frame rows
+    int *counts, *displs;     // rank 0: bytes of every rank in a frame
+    unsigned char *send[2];   // my rows of a frame, alternately
+    unsigned char *frame[2];  // rank 0: gathered frames, alternately
+    int next;                 // buffer of the next snapshot
+    int iteration[2];         // iteration of each buffer
+    MPI_Request request;      // gather in flight
+    int active, gathering;
+    double time;              // seconds the solver spent on snapshots
+    int frames;
+    // rank 0: the writer thread takes one queued frame at a time
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int queued;               // frame buffer waiting for or being written, -1 for none
+    int done;
+};
+
+// set up snapshots of the plate of at most pixels x pixels and start the writer thread on rank 0, collective
+void laplace_snapshot_init(struct laplace_snapshots *snap, const char *prefix, int pixels,
+                           int rows, int columns, int range_row, int start_row, MPI_Comm comm);
+
+// sample my slab into the free buffer and start gathering it on rank 0, the previous frame is
+// handed to the writer thread; costs a sampling pass over (rows / step) x (columns / step) cells
+void laplace_snapshot_take(struct laplace_snapshots *snap, int iteration, int pitch, double *grid, MPI_Comm comm);
+
+// let a gather in flight progress
+void laplace_snapshot_progress(struct laplace_snapshots *snap);
+
+// write out the last frame and stop the writer thread, collective
+void laplace_snapshot_finish(struct laplace_snapshots *snap, MPI_Comm comm);
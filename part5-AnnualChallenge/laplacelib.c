@@ -0,0 +1,552 @@
+#if defined(_OPENMP)
+#include "omp.h"
+#endif
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "laplace.h"
+#include "../common/halo.h"
+#include "../common/tune.h"
+
+// plate widths that get their own kernel with a constant trip count
+#define LAPLACE_KERNEL_WIDTHS(X) \
+    X(1000)                      \
+    X(10000)
+
+#define CACHE_LINE 64          // bytes, also a multiple of the AVX-512 vector
+#define PAGE_ALIAS 4096        // loads and stores this far apart look dependent to the core
+#define HUGE_PAGE (2 << 20)    // transparent huge page size on x86-64
+#define CHECKPOINT_EVERY 1000  // default iterations between checkpoints
+#define SNAPSHOT_EVERY 100     // default iterations between snapshots
+#define CALIBRATION_SWEEPS 3   // Jacobi sweeps of one tuning run
+
+static void usage(const char *program, struct laplace_config *config)
+{
+    printf("Usage: %s [options]\n", program);
+    printf("  -r, --rows N            rows of the plate (%d)\n", config->rows);
+    printf("  -c, --columns N         columns of the plate (%d)\n", config->columns);
+    printf("  -d, --planes N          planes of a 3D volume (laplace3d)\n");
+    printf("  -n, --size N            rows and columns of the plate (and planes of a volume)\n");
+    printf("  -t, --tolerance X       largest permitted change in temp (%g)\n", config->max_temp_error);
+    printf("  -i, --max-iterations N  iteration cap (%d)\n", config->max_iterations);
+    printf("  -p, --progress N        print test values every N iterations, 0 for never (%d)\n", config->progress);
+    printf("  -q, --quiet             no per iteration output\n");
+    printf("  -H, --huge-pages        back the grids with transparent huge pages\n");
+    printf("  -o, --output FILE       write the final field to FILE (MPI solvers)\n");
+    printf("  -C, --checkpoint FILE   checkpoint to FILE (MPI solvers)\n");
+    printf("  -e, --checkpoint-every N  iterations between checkpoints (%d)\n", CHECKPOINT_EVERY);
+    printf("  -R, --restart FILE      continue from a checkpoint, written with any number of ranks\n");
+    printf("  -s, --snapshot PREFIX   write downsampled PGM frames PREFIX<iteration>.pgm (MPI solvers)\n");
+    printf("  -S, --snapshot-every N  iterations between snapshots (%d)\n", SNAPSHOT_EVERY);
+    printf("  -W, --warm-cache DIR    start from the nearest converged field in DIR and add the result (MPI solvers)\n");
+    printf("  -V, --validate 0|1      rerun as the reference solver and report the difference (%d)\n", config->validate);
+    printf("  -f, --config FILE       read \"option = value\" lines, long option names without dashes\n");
+    printf("  -h, --help              this message\n");
+}
+
+// apply one option given by its short name, returns 0 if the value is usable
+static int apply(struct laplace_config *config, int option, const char *value)
+{
+    char *end = NULL;
+    long number = 0;
+    double real = 0.0;
+
+    // file names, kept for the whole run
+    switch (option)
+    {
+    case 'o':
+        config->output = strdup(value);
+        return 0;
+    case 'C':
+        config->checkpoint = strdup(value);
+        return 0;
+    case 'R':
+        config->restart = strdup(value);
+        return 0;
+    case 's':
+        config->snapshot = strdup(value);
+        return 0;
+    case 'W':
+        config->cache = strdup(value);
+        return 0;
+    }
+
+    if (value != NULL)
+    {
+        number = strtol(value, &end, 10);
+        if (option == 't')
+        {
+            real = strtod(value, &end);
+        }
+        if (end == value || *end != '\0')
+        {
+            return -1;
+        }
+    }
+
+    switch (option)
+    {
+    case 'r':
+        config->rows = (int)number;
+        return number > 0 ? 0 : -1;
+    case 'c':
+        config->columns = (int)number;
+        return number > 0 ? 0 : -1;
+    case 'd':
+        config->planes = (int)number;
+        return number > 0 ? 0 : -1;
+    case 'n':
+        config->rows = config->columns = config->planes = (int)number;
+        return number > 0 ? 0 : -1;
+    case 't':
+        config->max_temp_error = real;
+        return real > 0.0 ? 0 : -1;
+    case 'i':
+        config->max_iterations = (int)number;
+        return number >= 0 ? 0 : -1;
+    case 'p':
+        config->progress = (int)number;
+        return number >= 0 ? 0 : -1;
+    case 'q':
+        config->quiet = 1;
+        return 0;
+    case 'H':
+        config->huge_pages = 1;
+        return 0;
+    case 'e':
+        config->checkpoint_every = (int)number;
+        return number > 0 ? 0 : -1;
+    case 'S':
+        config->snapshot_every = (int)number;
+        return number > 0 ? 0 : -1;
+    case 'V':
+        config->validate = (int)number;
+        return number == 0 || number == 1 ? 0 : -1;
+    }
+    return -1;
+}
+
+static const struct option long_options[] = {
+    {"rows", required_argument, NULL, 'r'},
+    {"columns", required_argument, NULL, 'c'},
+    {"planes", required_argument, NULL, 'd'},
+    {"size", required_argument, NULL, 'n'},
+    {"tolerance", required_argument, NULL, 't'},
+    {"max-iterations", required_argument, NULL, 'i'},
+    {"progress", required_argument, NULL, 'p'},
+    {"quiet", no_argument, NULL, 'q'},
+    {"huge-pages", no_argument, NULL, 'H'},
+    {"output", required_argument, NULL, 'o'},
+    {"checkpoint", required_argument, NULL, 'C'},
+    {"checkpoint-every", required_argument, NULL, 'e'},
+    {"restart", required_argument, NULL, 'R'},
+    {"snapshot", required_argument, NULL, 's'},
+    {"snapshot-every", required_argument, NULL, 'S'},
+    {"warm-cache", required_argument, NULL, 'W'},
+    {"validate", required_argument, NULL, 'V'},
+    {"config", required_argument, NULL, 'f'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+// read "option = value" lines, # starts a comment
+static int read_config(const char *path, struct laplace_config *config, int report)
+{
+    char line[256], key[64], value[128];
+    int number = 0;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        if (report)
+            printf("Cannot open config file %s\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        const struct option *option;
+        char *comment = strchr(line, '#');
+        number++;
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+        value[0] = '\0';
+        if (sscanf(line, " %63[^= \t] = %127s", key, value) < 1)
+        {
+            continue;
+        }
+        for (option = long_options; option->name != NULL; option++)
+        {
+            if (strcmp(option->name, key) == 0)
+                break;
+        }
+        if (option->name == NULL || option->val == 'f' || option->val == 'h' ||
+            apply(config, option->val, option->has_arg ? value : NULL) != 0)
+        {
+            if (report)
+                printf("%s:%d: bad setting \"%s\"\n", path, number, key);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+int laplace_configure(int argc, char **argv, struct laplace_config *config, int report)
+{
+    int option;
+
+    // the config file comes first so that the command line can override it
+    opterr = 0;
+    optind = 1;
+    while ((option = getopt_long(argc, argv, "r:c:d:n:t:i:p:qHo:C:e:R:s:S:W:V:f:h", long_options, NULL)) != -1)
+    {
+        if (option == 'f' && read_config(optarg, config, report) != 0)
+        {
+            return -1;
+        }
+    }
+
+    optind = 1;
+    while ((option = getopt_long(argc, argv, "r:c:d:n:t:i:p:qHo:C:e:R:s:S:W:V:f:h", long_options, NULL)) != -1)
+    {
+        if (option == 'f')
+        {
+            continue;
+        }
+        if (option == 'h')
+        {
+            if (report)
+                usage(argv[0], config);
+            return 1;
+        }
+        if (option == '?' || apply(config, option, optarg) != 0)
+        {
+            if (report)
+            {
+                printf("Bad option %s\n", argv[optind - 1]);
+                usage(argv[0], config);
+            }
+            return -1;
+        }
+    }
+    if (config->checkpoint != NULL && config->checkpoint_every == 0)
+    {
+        config->checkpoint_every = CHECKPOINT_EVERY;
+    }
+    if (config->snapshot != NULL && config->snapshot_every == 0)
+    {
+        config->snapshot_every = SNAPSHOT_EVERY;
+    }
+    return 0;
+}
+
+#define LAPLACE_ROW_KERNEL(WIDTH)                                                                            \
+    static void laplace_row_##WIDTH(double *restrict out, const double *restrict in, int pitch, int columns) \
+    {                                                                                                        \
+        const double *restrict up = in - pitch;                                                              \
+        const double *restrict down = in + pitch;                                                            \
+        (void)columns;                                                                                       \
+        for (int j = 1; j <= WIDTH; j++)                                                                     \
+        {                                                                                                    \
+            out[j] = 0.25 * (down[j] + up[j] + in[j + 1] + in[j - 1]);                                       \
+        }                                                                                                    \
+    }
+
+LAPLACE_KERNEL_WIDTHS(LAPLACE_ROW_KERNEL)
+
+void laplace_row_any(double *restrict out, const double *restrict in, int pitch, int columns)
+{
+    const double *restrict up = in - pitch;
+    const double *restrict down = in + pitch;
+    for (int j = 1; j <= columns; j++)
+    {
+        out[j] = 0.25 * (down[j] + up[j] + in[j + 1] + in[j - 1]);
+    }
+}
+
+#define LAPLACE_ROW_CASE(WIDTH) \
+    case WIDTH:                 \
+        return laplace_row_##WIDTH;
+
+laplace_row_fn laplace_row_kernel(int columns)
+{
+    switch (columns)
+    {
+        LAPLACE_KERNEL_WIDTHS(LAPLACE_ROW_CASE)
+    default:
+        return laplace_row_any;
+    }
+}
+
+int laplace_pitch(int width, size_t size)
+{
+    int line = CACHE_LINE / (int)size;
+    int pitch = (width + line - 1) / line * line;
+
+    if ((pitch * size) % PAGE_ALIAS == 0)
+    {
+        pitch += line;
+    }
+    return pitch;
+}
+
+void *laplace_alloc(int rows, int pitch, size_t size, int threads, int huge_pages)
+{
+    size_t row_bytes = (size_t)pitch * size;
+    size_t bytes = (size_t)rows * row_bytes;
+    size_t align = CACHE_LINE;
+    char *grid;
+
+    if (huge_pages)
+    {
+        align = HUGE_PAGE;
+        bytes = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    }
+    if (posix_memalign((void **)&grid, align, bytes) != 0)
+    {
+        return NULL;
+    }
+#if defined(MADV_HUGEPAGE)
+    // only a hint, without THP support the grid keeps its small pages
+    if (huge_pages)
+    {
+        madvise(grid, bytes, MADV_HUGEPAGE);
+    }
+#endif
+
+#if defined(_OPENMP)
+    if (threads <= 0)
+    {
+        threads = omp_get_max_threads();
+    }
+#pragma omp parallel for num_threads(threads) schedule(static)
+#else
+    (void)threads;
+#endif
+    for (int i = 1; i < rows - 1; i++)
+    {
+        memset(grid + i * row_bytes, 0, row_bytes);
+    }
+    memset(grid, 0, row_bytes);
+    if (rows > 1)
+    {
+        memset(grid + (rows - 1) * row_bytes, 0, bytes - (rows - 1) * row_bytes);
+    }
+    return grid;
+}
+
+void laplace_initialize(int rows, int columns, int pitch, double (*grid)[pitch], int range_row, int start_row, int last_rank)
+{
+    int i, j;
+
+    // these boundary conditions never change thoughout run
+    // set left side to 0 and right side to a linear increase
+    for (i = 0; i <= range_row + 1; i++)
+    {
+        grid[i][columns + 1] = (100.0 / rows) * (i + start_row);
+    }
+
+    // set top to 0 and bottom to linear increase (only need to set in last rank)
+    if (last_rank)
+    {
+        for (j = 0; j <= columns + 1; j++)
+        {
+            grid[range_row + 1][j] = (100.0 / columns) * j;
+        }
+    }
+}
+
+void laplace_track_progress(int columns, int pitch, double (*grid)[pitch], int iteration, int range_row, int start_row)
+{
+    int i;
+    printf("--------- Iteration number: %d ---------\n", iteration);
+    for (i = range_row - 5; i <= range_row; i++)
+    {
+        printf("[%d,%d]: %5.2f ", i + start_row, i + start_row, grid[i][columns + i - range_row]);
+    }
+    printf("\n");
+}
+
+void laplace_halo_create(struct halo *halo, void *grid, int pitch, int columns, int range_row, MPI_Datatype type,
+                         MPI_Comm comm)
+{
+    int rank, size, type_size;
+    int periods[1] = {0};
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    MPI_Type_size(type, &type_size);
+    char *row0 = (char *)grid + type_size; // element [0][1]
+    size_t row_bytes = (size_t)type_size * pitch;
+    struct halo_side sides[2] = {{row0 + row_bytes, row0, columns, type},
+                                 {row0 + range_row * row_bytes, row0 + (range_row + 1) * row_bytes, columns, type}};
+    if (halo_create(halo, halo_method_env(HALO_NONBLOCKING, rank), comm, 1, &size, periods, sides) != 0 &&
+        halo_create(halo, HALO_NONBLOCKING, comm, 1, &size, periods, sides) != 0)
+    {
+        printf("Rank %d cannot set up the halo exchange of its %d x %d slab\n", rank, range_row, columns);
+        MPI_Abort(comm, 1);
+    }
+}
+
+// what a tuning run needs
+struct calibration
+{
+    int columns, pitch, range_row;
+    double *grid, *scratch;
+    int allocated;        // scratch is a grid of the calibration, first touched by first_touch threads
+    int first_touch;
+    laplace_row_fn fixed; // kernel for this width
+    laplace_sweep_fn sweep; // the solver's own sweep, NULL for the two grid Jacobi one
+    void *data;
+    int count;            // knobs
+    double dt;            // largest change of the last run, so the sweeps are not optimised away
+};
+
+// one tuning run: CALIBRATION_SWEEPS sweeps with the threads, schedule and kernel of the knobs.
+// The solver's sweep works on a copy of the grid in scratch, made before the clock starts; without
+// one the Jacobi sweeps with the change of every cell, as in the solvers, only read the grid and
+// write into scratch
+static double calibration_sweeps(struct tune_knob *knobs, void *data)
+{
+    struct calibration *c = data;
+    int pitch = c->pitch, columns = c->columns, i, j, s;
+    int threads = tune_value(knobs, c->count, "threads", 1);
+    laplace_row_fn stencil = tune_value(knobs, c->count, "kernel", 0) ? laplace_row_any : c->fixed;
+    double (*in)[pitch] = (double (*)[pitch])c->grid;
+    double dt = 0.0;
+    struct timespec start, end;
+
+    if (c->scratch == NULL)
+    {
+        c->scratch = laplace_alloc(c->range_row + 2, pitch, sizeof(double), c->first_touch, 0);
+        c->allocated = 1;
+        if (c->scratch == NULL)
+        {
+            // the other ranks are calibrating with us, nobody may leave the tuning alone
+            printf("Cannot allocate the calibration grid of %d rows\n", c->range_row + 2);
+            abort();
+        }
+    }
+    double (*out)[pitch] = (double (*)[pitch])c->scratch;
+#if defined(_OPENMP)
+    omp_sched_t kind;
+    int chunk;
+    omp_get_schedule(&kind, &chunk);
+    omp_set_schedule(tune_value(knobs, c->count, "schedule", kind), tune_value(knobs, c->count, "chunk", chunk));
+#else
+    (void)threads;
+#endif
+    if (c->sweep != NULL)
+    {
+        memcpy(c->scratch, c->grid, sizeof(double) * (c->range_row + 2) * pitch);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (s = 0; s < CALIBRATION_SWEEPS; s++)
+    {
+        if (c->sweep != NULL)
+        {
+            double change = c->sweep(c->scratch, threads, c->data);
+            dt = change > dt ? change : dt;
+            continue;
+        }
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(threads) schedule(runtime)
+#endif
+        for (i = 1; i <= c->range_row; i++)
+        {
+            stencil(out[i], in[i], pitch, columns);
+        }
+#if defined(_OPENMP)
+#pragma omp parallel for num_threads(threads) schedule(runtime) private(j) reduction(max:dt)
+#endif
+        for (i = 1; i <= c->range_row; i++)
+        {
+            for (j = 1; j <= columns; j++)
+            {
+                double change = fabs(out[i][j] - in[i][j]);
+                dt = change > dt ? change : dt; // fmax would stay scalar without -ffast-math
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+#if defined(_OPENMP)
+    omp_set_schedule(kind, chunk);
+#endif
+    c->dt = dt;
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void laplace_tune(const char *program, int rows, int columns, int ranks, int pitch, double *grid, double *scratch,
+                  int range_row, int tunable, int *threads, laplace_row_fn *stencil, laplace_sweep_fn sweep, void *data)
+{
+    struct tune_knob knobs[4];
+    struct calibration calibration = {columns, pitch, range_row, grid, scratch, 0, *threads,
+                                      laplace_row_kernel(columns), sweep, data, 0, 0.0};
+    // the row kernel can only be chosen for the Jacobi sweep of the calibration
+    int kernels = (tunable & LAPLACE_TUNE_KERNEL) && sweep == NULL;
+    char problem[128];
+    int n = 0;
+
+#if defined(_OPENMP)
+    // nothing to tune about the schedule of a kernel without schedule(runtime) loops
+    int scheduled = getenv("OMP_SCHEDULE") != NULL || !(tunable & LAPLACE_TUNE_SCHEDULE);
+    if (!scheduled)
+    {
+        omp_set_schedule(omp_sched_static, 0);
+    }
+    // a quarter, half and all of the threads, hyperthreads included
+    struct tune_knob team = {"threads", 0, {0}, {NULL}, *threads};
+    for (int t = *threads >= 4 ? *threads / 4 : 1; t < *threads; t *= 2)
+    {
+        team.values[team.count++] = t;
+    }
+    team.values[team.count++] = *threads;
+    knobs[n++] = team;
+    if (!scheduled)
+    {
+        struct tune_knob schedule = {"schedule", 3, {omp_sched_static, omp_sched_dynamic, omp_sched_guided},
+                                     {"static", "dynamic", "guided"}, omp_sched_static};
+        struct tune_knob chunk = {"chunk", 4, {0, 1, 4, 16}, {NULL}, 0};
+        knobs[n++] = schedule;
+        knobs[n++] = chunk;
+    }
+#endif
+    if (kernels && calibration.fixed != laplace_row_any)
+    {
+        struct tune_knob kernel = {"kernel", 2, {0, 1}, {"fixed", "generic"}, 0};
+        knobs[n++] = kernel;
+    }
+    calibration.count = n;
+    if (n == 0)
+    {
+        return;
+    }
+
+    snprintf(problem, sizeof(problem), "%s %dx%d ranks=%d", program, rows, columns, ranks);
+    if (tune(problem, knobs, n, calibration_sweeps, &calibration))
+    {
+        *threads = tune_value(knobs, n, "threads", *threads);
+        if (kernels)
+        {
+            *stencil = tune_value(knobs, n, "kernel", 0) ? laplace_row_any : calibration.fixed;
+        }
+#if defined(_OPENMP)
+        if (!scheduled)
+        {
+            omp_set_schedule(tune_value(knobs, n, "schedule", omp_sched_static), tune_value(knobs, n, "chunk", 0));
+        }
+#endif
+    }
+    if (calibration.allocated)
+    {
+        free(calibration.scratch);
+    }
+}